@@ -1,12 +1,5 @@
 /*
- * TODO:
- *  -  Binary format and import / export
- *
- *
- *
  * BUGS:
- *  -  spt_delete leaves empty gaps which are interpreted as the end of the vector of names
- *  -  spt_extract does not remove the entry
  *
  *
  *
@@ -17,19 +10,114 @@
 #ifndef __SEPET_H__
 #define __SEPET_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define SPT_INVALID_ID        (-1)        /* Error code, app state invalid. */
 #define SPT_UNSPECIFIED_ID    (0)         /* Explicit value for unstored or currently unavailable items. */
 #define SPT_DEFAULT_ID        (1)         /* Unspecified but valid as storage, e.g. subsection value for tiny containers. */
-#define SPT_NAME_SIZE         (32)        /* Maximum number of characters per name. */
+#define SPT_NAME_SIZE         (256)       /* Maximum name size, terminator included. Longer names are truncated. */
 #define SPT_MSG_SIZE          (2048)      /* Output error message buffer size. */
+
+/* Build-time capacities. Override them with compiler definitions (see the
+ * SEPET_* cache variables of CMakeLists.txt), every translation unit using
+ * the library has to see the same values. Both have to be powers of two. */
+#ifndef SPT_MAX_FIELDS
 #define SPT_MAX_FIELDS        (256)       /* Maximum number of unique storage fields for each type. */
+#endif
+#ifndef SPT_MAX_ITEMS
 #define SPT_MAX_ITEMS         (1U << 13)  /* Maximum number of unique items. */
+#endif
+#ifndef SPT_LOCATION_ID_BITS
+#define SPT_LOCATION_ID_BITS  (8)         /* Width of the location IDs stored in entries, 8 or 16. */
+#endif
+
+#ifndef SPT_ENTRY_COLUMNS
+#define SPT_ENTRY_COLUMNS     (0)         /* Non-zero to store entries as one array per field instead of spt_entry records. */
+#endif
+#ifndef SPT_STATS
+#define SPT_STATS             (0)         /* Non-zero for call statistics and the trace hook (see: spt_stats_get). */
+#endif
+#ifndef SPT_UNDO
+#define SPT_UNDO              (1)         /* Non-zero for snapshots (see: spt_undo_open), at the cost of a check on every write. */
+#endif
+#ifndef SPT_NAME_ARENA_SIZE
+#define SPT_NAME_ARENA_SIZE   ((SPT_MAX_ITEMS + 4 * SPT_MAX_FIELDS) * 24) /* Bytes of interned name storage. */
+#endif
+
+#if SPT_LOCATION_ID_BITS == 8
+typedef uint8_t spt_loc_id;               /* Storage field (location) identifier as stored in entries. */
+#elif SPT_LOCATION_ID_BITS == 16
+typedef uint16_t spt_loc_id;
+#else
+#error "SPT_LOCATION_ID_BITS has to be 8 or 16."
+#endif
+
+#if SPT_MAX_FIELDS > (1 << SPT_LOCATION_ID_BITS)
+#error "SPT_MAX_FIELDS does not fit in SPT_LOCATION_ID_BITS."
+#endif
+
+#if SPT_ENTRY_COLUMNS && SPT_MAX_ITEMS < 64
+#error "SPT_ENTRY_COLUMNS needs SPT_MAX_ITEMS of at least 64."
+#endif
+
+/* Alignment of the entry tables, so that they start on a cache line. */
+#if defined(_MSC_VER)
+#define SPT_CACHE_ALIGNED     __declspec(align(64))
+#else
+#define SPT_CACHE_ALIGNED     __attribute__((aligned(64)))
+#endif
+
+#if SPT_MAX_ITEMS < 0x10000
+typedef uint16_t spt_slot;                /* Index type of the internal tables (IDs and entry slots + 1). */
+#else
+typedef uint32_t spt_slot;
+#endif
+
+#define SPT_INDEX_FIELDS      (SPT_MAX_FIELDS * 2) /* Name index slots for each storage field (power of two). */
+#define SPT_INDEX_ITEMS       (SPT_MAX_ITEMS * 2)  /* Name index slots for items (power of two). */
+#define SPT_LOCATION_FIELDS   (SPT_FIELD_ITEM) /* Number of storage fields (building, room, container and subsection). */
+#define SPT_ANY               (-1)        /* Wildcard location ID for queries (see: spt_query_location). */
+#define SPT_IMAGE_VERSION     (6)         /* Binary image format version (see: spt_image_header). */
+#define SPT_IMAGE_ENDIAN      (0x01020304U) /* Endianness marker, stored in the writer's byte order. */
+#define SPT_DELTA_VERSION     (3)         /* Delta format version (see: spt_delta_header). */
+#define SPT_CHANGELOG_SIZE    (1U << 16)  /* Default change log capacity in bytes (see: spt_changelog_open). */
+#define SPT_CSV_CHUNK         (1U << 14)  /* Read and write size of the CSV file descriptor functions. */
+#define SPT_PATH_SEPARATOR    ('/')       /* Separator of the location names in paths (see: spt_resolve_path). */
+#define SPT_PATH_CACHE_SIZE   (128)       /* Resolved paths remembered by the context (power of two, see: spt_resolve_path). */
+#define SPT_UNDO_DEPTH        (16)        /* Default number of snapshots kept (see: spt_undo_open). */
+#define SPT_UNDO_PAGE         (4096)      /* Copy-on-write granularity of snapshots in bytes. */
+#define SPT_HISTORY_SIZE      (1U << 16)  /* Default number of movements kept in memory (see: spt_history_open). */
+#define SPT_HISTORY_BATCH     (64)        /* Movements buffered before they are appended to the history file. */
+#define SPT_HISTORY_VERSION   (1)         /* History file format version. */
+#define SPT_READ_TIMEOUT_MS   (1000)      /* Longest wait of the _r functions for a mutation to end (see: Concurrent readers). */
+#define SPT_SLOTS_FIELDS      ((SPT_MAX_FIELDS + 63) / 64)   /* Allocation bitmap words for each storage field. */
+#define SPT_SLOTS_ITEMS       ((SPT_MAX_ITEMS + 63) / 64)    /* Allocation bitmap words for items. */
+#define SPT_SUMMARY_FIELDS    ((SPT_SLOTS_FIELDS + 63) / 64) /* Bitmap summary words for each storage field. */
+#define SPT_SUMMARY_ITEMS     ((SPT_SLOTS_ITEMS + 63) / 64)  /* Bitmap summary words for items. */
+#define SPT_STAT_ERRORS       (8)         /* Result counters per operation: SPT_NOOP and every error code. */
+#define SPT_STAT_BUCKETS      (32)        /* Latency histogram buckets, bucket i counts calls of [2^i, 2^(i+1)) ns. */
+#define SPT_STAT_ERROR_INDEX(code) ((code) >= 0 ? 0 : (-(code) - 90) / 10) /* spt_op_stats::errors index of a non-success code. */
+
+/* Opaque write-ahead journal state (see: spt_journal_open). */
+struct spt_journal;
+
+/* Opaque change log state (see: spt_changelog_open). */
+struct spt_changelog;
+
+/* Opaque snapshot stack (see: spt_undo_open). */
+struct spt_undo;
+
+/* Opaque movement history (see: spt_history_open). */
+struct spt_history;
 
 /* Error callback signature. Will be called in case of error if provided (see: spt_context::err_callback). */
 typedef void (*ErrCb)(void *usrdata, int errcode, const char *errmsg);
 
+/* Trace callback signature. Called after every counted call (see: enum spt_stat_ops) with its result
+ * code and duration, only available with SPT_STATS (see: spt_context::trace_callback). */
+typedef void (*TraceCb)(void *usrdata, int op, int errcode, uint64_t elapsed_ns);
+
 /* Error code definitions. Do not expect this enum to be used as a type (codes are stored in 'int' variables when used). */
 enum spt_error_codes {
     SPT_SUCCESS         = 1,    /* Last API call returned successfuly. */
@@ -39,6 +127,57 @@ enum spt_error_codes {
     SPT_ERROR_MEMORY    = -120, /* Memory limit reached for the requested field. Consider increasing the configured sizes. */
     SPT_ERROR_STATE     = -130, /* Incompatibilities between state and calls, like trying to rename disabled items. */
     SPT_ERROR_NOT_FOUND = -140, /* Could not find the specified element in the entry list. */
+    SPT_ERROR_IO        = -150, /* File system or memory mapping operation failed, see errno. */
+    SPT_ERROR_FORMAT    = -160, /* Binary data is not a valid image for this build (magic, version, sizes or checksum). */
+    SPT_ERROR_TIMEOUT   = -170, /* A concurrent reader waited SPT_READ_TIMEOUT_MS for a mutation to end, e.g. its writer died. */
+};
+
+/* Cascade modes for deleting referenced elements (see: spt_delete_ex). */
+enum spt_cascade_modes {
+    SPT_CASCADE_EXTRACT = 0,    /* Extract the entries that reference the deleted element. */
+    SPT_CASCADE_REHOME,         /* Move the entries stored in the deleted storage element to SPT_DEFAULT_ID of its field (items are extracted). */
+    SPT_CASCADE_REFUSE,         /* Fail with SPT_ERROR_STATE if any entry references the element. */
+};
+
+/* Operations with statistics (see: spt_stats_get), named after the public function they count. */
+enum spt_stat_ops {
+    SPT_STAT_ADD = 0,
+    SPT_STAT_RENAME,
+    SPT_STAT_INSERT,
+    SPT_STAT_EXTRACT,
+    SPT_STAT_DELETE,            /* spt_delete and spt_delete_ex. */
+    SPT_STAT_DELETE_BATCH,
+    SPT_STAT_COMPACT_NAMES,
+    SPT_STAT_GET_ID,
+    SPT_STAT_GET_NAME,
+    SPT_STAT_FIND,
+    SPT_STAT_NEXT,
+    SPT_STAT_QUERY_LOCATION,
+    SPT_STAT_CURSOR_NEXT,
+    SPT_STAT_SCAN,
+    SPT_STAT_SEARCH,
+    SPT_STAT_LOAD,
+    SPT_STAT_SAVE,
+    SPT_STAT_SAVE_FILE,
+    SPT_STAT_JOURNAL_REPLAY,
+    SPT_STAT_EXPORT_DELTA,
+    SPT_STAT_APPLY_DELTA,
+    SPT_STAT_RESOLVE_PATH,
+    SPT_STAT_SET_QUANTITY,
+    SPT_STAT_INSERT_PATH,
+    SPT_STAT_IMPORT_CSV,        /* spt_import_csv and spt_import_csv_fd. */
+    SPT_STAT_EXPORT_CSV,        /* spt_export_csv and spt_export_csv_fd. */
+    SPT_STAT_JOURNAL_COMPACT,
+    SPT_STAT_SNAPSHOT,
+    SPT_STAT_ROLLBACK,
+    SPT_STAT_UNDO,
+    SPT_STAT_REDO,
+    SPT_STAT_SNAPSHOT_SAVE,
+    SPT_STAT_ITEM_HISTORY,
+    SPT_STAT_HISTORY_QUERY,
+    SPT_STAT_GET_ENTRY,
+    SPT_STAT_COUNTS,            /* spt_count and spt_counts. */
+    SPT_STAT_COUNT
 };
 
 /* Item and storage field identifiers. Do not expect this enum to be used as a type (codes are stored in 'int' variables when used). */
@@ -51,40 +190,238 @@ enum spt_fields {
     SPT_FIELD_COUNT
 };
 
-/* char[] encapsulation for cleaner code: pointer arithmetic and operator '=' */
-typedef struct spt_name {
-    char buf[SPT_NAME_SIZE];
-} spt_name;
-
 /* Stored item ID. It encodes the item identifier and its stored location. */
 typedef struct spt_entry {
-    uint8_t     building;   /* Building ID. */
-    uint8_t     room;       /* Room ID. */
-    uint8_t     container;  /* Container ID. */
-    uint8_t     subsection; /* Subsection ID. */
+    spt_loc_id  building;   /* Building ID. */
+    spt_loc_id  room;       /* Room ID. */
+    spt_loc_id  container;  /* Container ID. */
+    spt_loc_id  subsection; /* Subsection ID. */
     uint32_t    item;       /* Item ID. */
 } spt_entry;
 
+/* Statistics of a single operation. */
+typedef struct spt_op_stats {
+    uint64_t    calls;
+    uint64_t    errors[SPT_STAT_ERRORS];    /* Calls that did not succeed, by SPT_STAT_ERROR_INDEX of their code. */
+    uint64_t    probes;                     /* Name index slots probed, entries and IDs visited. */
+    uint64_t    total_ns;
+    uint64_t    latency[SPT_STAT_BUCKETS];  /* Log2 histogram of the call durations in ns. */
+} spt_op_stats;
+
+/* Movement of an item (see: spt_item_history). Both entries hold the item ID,
+ * a 'from' with every location SPT_UNSPECIFIED_ID means the item was not
+ * stored, a 'to' with every location SPT_UNSPECIFIED_ID that it was extracted. */
+typedef struct spt_move {
+    int64_t     time;               /* Milliseconds since the epoch (CLOCK_REALTIME). */
+    spt_entry   from;               /* Entry before the movement. */
+    spt_entry   to;                 /* Entry after the movement. */
+} spt_move;
+
+/* Path cache entry, the location IDs of a recently resolved path (see: spt_resolve_path). */
+typedef struct spt_path_slot {
+    uint32_t    hash;                           /* Hash of the whole path, 0 if the entry is empty. */
+    spt_loc_id  locations[SPT_LOCATION_FIELDS]; /* Location IDs, indexed by storage field. */
+} spt_path_slot;
+
+/* Call statistics (see: spt_stats_get). */
+typedef struct spt_stats {
+    spt_op_stats ops[SPT_STAT_COUNT];       /* Indexed by enum spt_stat_ops. */
+} spt_stats;
+
 /* Application context (or environment, instance, ...), it contains all the application state. */
 typedef struct spt_context {
-    /* Persistent data (inventory state). */
-    spt_name    building_names  [SPT_MAX_FIELDS];   /* User-defined building aliases, used to describe large contiguous spaces, e.g. "Home", "Parents'", "Workplace", ... */
-    spt_name    room_names      [SPT_MAX_FIELDS];   /* User-defined room aliases, used to delimit area units, e.g. "Bedroom", "Garage", "Attic", ... */
-    spt_name    container_names [SPT_MAX_FIELDS];   /* User-defined container aliases for listing the storage units of the room, e.g. "Desk", "Shelves", "Suitcase", ... */
-    spt_name    subsec_names    [SPT_MAX_FIELDS];   /* User-defined subsection aliases, wildcard to refer to compartments and other final locations, e.g. "TopShelf", "Drawer_3", "OutsidePocket", ... */
-    spt_name    item_names      [SPT_MAX_ITEMS];    /* List of user-defined item aliases. */
-    spt_entry   entries         [SPT_MAX_ITEMS];    /* References to every single stored item and its location info. */
+    /* Persistent data (inventory state). The entry tables come first, they are the ones touched by
+     * every insertion, query and scan, the name tables and strings follow. */
+#if SPT_ENTRY_COLUMNS
+    /* Entries stored by column (see: SPT_ENTRY_COLUMNS), slot s is made of entry_locations[field][s]
+     * for every storage field and entry_items[s]. Free slots are all zeroes. Read them with spt_get_entry. */
+    SPT_CACHE_ALIGNED spt_loc_id entry_locations[SPT_LOCATION_FIELDS][SPT_MAX_ITEMS];
+    SPT_CACHE_ALIGNED uint32_t   entry_items[SPT_MAX_ITEMS];
+#else
+    SPT_CACHE_ALIGNED spt_entry  entries[SPT_MAX_ITEMS]; /* References to every single stored item and its location info. Read them with spt_get_entry. */
+#endif
+
+    /* Entry allocation. Do not modify. */
+    spt_slot    item_entries    [SPT_MAX_ITEMS];    /* Entry slot + 1 of every item ID, 0 if the item is not stored. */
+    spt_slot    entry_stack     [SPT_MAX_ITEMS];    /* Stack of free entry slots, lowest slots on top. */
+    uint32_t    entry_stack_top;                    /* Number of free entry slots. */
+
+    /* Location index. For every storage field and ID, an intrusive doubly linked list of the entry
+     * slots stored there. Links hold entry slot + 1, 0 ends the list. Do not modify. */
+    spt_slot    location_heads  [SPT_LOCATION_FIELDS][SPT_MAX_FIELDS];
+    spt_slot    location_counts [SPT_LOCATION_FIELDS][SPT_MAX_FIELDS]; /* Number of entries stored in every location ID. */
+    spt_slot    location_next   [SPT_LOCATION_FIELDS][SPT_MAX_ITEMS];
+    spt_slot    location_prev   [SPT_LOCATION_FIELDS][SPT_MAX_ITEMS];
+
+    /* Quantities (see: spt_set_quantity). Location sums are kept up to date by every mutation, read
+     * them with spt_count and spt_counts. Do not modify. */
+    uint32_t    item_quantities [SPT_MAX_ITEMS];    /* Quantity of every stored item ID, 0 if the item is not stored. */
+    uint64_t    location_quantities[SPT_LOCATION_FIELDS][SPT_MAX_FIELDS]; /* Sum of the quantities stored in every location ID. */
+
+    /* Names are handles into names_arena (0 if the ID is free), read them with spt_get_name. */
+    uint32_t    building_names  [SPT_MAX_FIELDS];   /* User-defined building aliases, used to describe large contiguous spaces, e.g. "Home", "Parents'", "Workplace", ... */
+    uint32_t    room_names      [SPT_MAX_FIELDS];   /* User-defined room aliases, used to delimit area units, e.g. "Bedroom", "Garage", "Attic", ... */
+    uint32_t    container_names [SPT_MAX_FIELDS];   /* User-defined container aliases for listing the storage units of the room, e.g. "Desk", "Shelves", "Suitcase", ... */
+    uint32_t    subsec_names    [SPT_MAX_FIELDS];   /* User-defined subsection aliases, wildcard to refer to compartments and other final locations, e.g. "TopShelf", "Drawer_3", "OutsidePocket", ... */
+    uint32_t    item_names      [SPT_MAX_ITEMS];    /* List of user-defined item aliases. */
+
+    /* Name lookup indices. Open addressing hash tables (linear probing) over the name arrays above,
+     * every slot holds the element ID + 1 and 0 means empty. Maintained by the library, do not modify. */
+    spt_slot    building_index  [SPT_INDEX_FIELDS];
+    spt_slot    room_index      [SPT_INDEX_FIELDS];
+    spt_slot    container_index [SPT_INDEX_FIELDS];
+    spt_slot    subsec_index    [SPT_INDEX_FIELDS];
+    spt_slot    item_index      [SPT_INDEX_ITEMS];
+
+    /* Name search signatures (see: spt_search). One bit per hashed bigram and trigram of the
+     * lowercase name, set for every ID with a name. Maintained by the library, do not modify. */
+    uint64_t    building_grams  [SPT_MAX_FIELDS];
+    uint64_t    room_grams      [SPT_MAX_FIELDS];
+    uint64_t    container_grams [SPT_MAX_FIELDS];
+    uint64_t    subsec_grams    [SPT_MAX_FIELDS];
+    uint64_t    item_grams      [SPT_MAX_ITEMS];
+
+    /* Slot allocators. One bit per element, set if the ID is free. Summary bits are set if the matching
+     * bitmap word has any free ID, so that the lowest free ID is found with two bit scans. Do not modify. */
+    uint64_t    building_free   [SPT_SLOTS_FIELDS];
+    uint64_t    room_free       [SPT_SLOTS_FIELDS];
+    uint64_t    container_free  [SPT_SLOTS_FIELDS];
+    uint64_t    subsec_free     [SPT_SLOTS_FIELDS];
+    uint64_t    item_free       [SPT_SLOTS_ITEMS];
+    uint64_t    building_summary[SPT_SUMMARY_FIELDS];
+    uint64_t    room_summary    [SPT_SUMMARY_FIELDS];
+    uint64_t    container_summary[SPT_SUMMARY_FIELDS];
+    uint64_t    subsec_summary  [SPT_SUMMARY_FIELDS];
+    uint64_t    item_summary    [SPT_SUMMARY_ITEMS];
+
+    uint64_t    version;            /* Mutation counter, incremented by every successful mutating call. Used for journal replay and deltas. */
+    uint64_t    chain;              /* Hash of the records leading to version, tells apart contexts that reached the same version differently (see: spt_apply_delta). */
+
+    /* Interned name strings. Records are appended and shared by the elements of a field with the same
+     * name, the ones no longer referenced are reclaimed by spt_compact_names. Has to be the last
+     * persistent member: only its used part is saved. Do not modify. */
+    uint32_t    arena_used;         /* Bytes of names_arena in use, records of unreferenced names included. */
+    uint32_t    arena_garbage;      /* Bytes taken by unreferenced records. */
+    char        names_arena     [SPT_NAME_ARENA_SIZE];
 
     /* Runtime utils. */
     int         out_error;          /* Out error code (from: enum spt_error_codes). This value is overwritten on every API call. */
-    char        out_err_msg[SPT_MSG_SIZE];  /* Out error message. Null-terminated string containing more specific details of the error ocurred, in contrast with out_error which is a generic code. This buffer written only when errors occur. */
     ErrCb       err_callback;       /* User-defined callback function. If not NULL */
     void       *usr_data;           /* User-defined pointer to data. It will not be used by this library except for providing it in user callbacks. */
+    struct spt_journal *journal;    /* Write-ahead journal (see: spt_journal_open). NULL if disabled. */
+    struct spt_changelog *changelog; /* Recent mutations for spt_export_delta (see: spt_changelog_open). NULL if disabled. */
+    struct spt_undo *undo;          /* Snapshots for spt_undo and spt_rollback (see: spt_undo_open). NULL if disabled. */
+    struct spt_history *history;    /* Movements of the items (see: spt_history_open). NULL if disabled. */
+    size_t      alloc_size;         /* Size of the spt_create allocation, 0 if the context memory is not owned by the library. */
+    uint32_t    seq;                /* Seqlock sequence, odd while a mutation is in progress (see: spt_get_id_r). Do not modify. */
+    spt_path_slot path_cache[SPT_PATH_CACHE_SIZE]; /* Two-way set associative cache of resolved paths, most recent way first. Cleared when location names change. Do not modify. */
+#if SPT_STATS
+    TraceCb     trace_callback;     /* User-defined trace callback. If not NULL, called after every counted call. */
+    uint64_t    stats_probes;       /* Probe counter of the running call. Do not modify. */
+    spt_stats   stats;              /* Call statistics, read them with spt_stats_get. */
+#endif
+    char        out_err_msg[SPT_MSG_SIZE];  /* Out error message. Null-terminated string containing more specific details of the error ocurred, in contrast with out_error which is a generic code. This buffer written only when errors occur. */
 } spt_context;
 
+/* spt_config::flags values. */
+enum spt_config_flags {
+    SPT_CONFIG_HUGE_PAGES = 1 << 0, /* Back the context with transparent huge pages when the OS supports them. */
+};
+
+/* Options for spt_create. The capacities are the ones the caller was built
+ * with (see: SPT_CONFIG_INIT), 0 skips their check. */
+typedef struct spt_config {
+    ErrCb       err_callback;       /* Initial spt_context::err_callback. */
+    void       *usr_data;           /* Initial spt_context::usr_data. */
+    int         flags;              /* Bitmask of enum spt_config_flags. */
+    uint32_t    max_items;          /* Expected SPT_MAX_ITEMS. */
+    uint32_t    max_fields;         /* Expected SPT_MAX_FIELDS. */
+    uint32_t    location_id_bits;   /* Expected SPT_LOCATION_ID_BITS. */
+    size_t      context_size;       /* Expected sizeof(spt_context). */
+#if SPT_STATS
+    TraceCb     trace_callback;     /* Initial spt_context::trace_callback. */
+#endif
+} spt_config;
+
+/* spt_config initializer recording the capacities of the translation unit
+ * using it, so that spt_create rejects a library built with other ones. */
+#define SPT_CONFIG_INIT { .max_items = SPT_MAX_ITEMS,                       \
+                          .max_fields = SPT_MAX_FIELDS,                     \
+                          .location_id_bits = SPT_LOCATION_ID_BITS,         \
+                          .context_size = sizeof(spt_context) }
+
+/* Location query iterator (see: spt_query_location). */
+typedef struct spt_cursor {
+    spt_context *ctx;
+    int         field;              /* Storage field whose list is walked, SPT_ANY if every entry is visited. */
+    uint32_t    slot;               /* Next entry slot + 1 to visit, 0 once finished. */
+    int         filter[SPT_LOCATION_FIELDS]; /* Location IDs to match, indexed by enum spt_fields, SPT_ANY matches anything. */
+} spt_cursor;
+
+/* Compiled entry filter for spt_scan (see: spt_predicate_compile). */
+typedef struct spt_predicate {
+    uint64_t    loc_mask;           /* Location bytes to compare, laid out like the location part of spt_entry. */
+    uint64_t    loc_value;          /* Expected location bytes (already masked). */
+    uint32_t    item_min;           /* Inclusive item ID range. */
+    uint32_t    item_max;
+} spt_predicate;
+
+/* Binary image header. An image is this header followed by the spt_context
+ * bytes, runtime utils zeroed. Only the first data_size context bytes are
+ * written (the unused part of names_arena is left out, as a hole in image
+ * files). All values are stored in the writer's native byte order, readers
+ * reject images whose endian marker does not match. */
+typedef struct spt_image_header {
+    char        magic[4];           /* "SEPT". */
+    uint32_t    version;            /* SPT_IMAGE_VERSION. */
+    uint32_t    endian;             /* SPT_IMAGE_ENDIAN. */
+    uint32_t    header_size;        /* sizeof(spt_image_header), offset of the context. */
+    uint32_t    max_fields;         /* SPT_MAX_FIELDS of the writer. */
+    uint32_t    max_items;          /* SPT_MAX_ITEMS of the writer. */
+    uint32_t    name_size;          /* SPT_NAME_SIZE of the writer. */
+    uint32_t    location_bits;      /* SPT_LOCATION_ID_BITS of the writer. */
+    uint32_t    entry_columns;      /* SPT_ENTRY_COLUMNS of the writer, 0 or 1. */
+    uint32_t    reserved1;
+    uint64_t    context_size;       /* sizeof(spt_context) of the writer. */
+    uint64_t    checksum;           /* FNV-1a (64-bit words) of the first data_size context bytes. */
+    uint64_t    data_size;          /* Context bytes stored after the header. */
+} spt_image_header;
+
+#define SPT_IMAGE_SIZE (sizeof(spt_image_header) + sizeof(spt_context)) /* Maximum image size in bytes. */
+
+/* CSV import summary (see: spt_import_csv). */
+typedef struct spt_csv_result {
+    size_t      rows;               /* Data rows read, the header row and blank lines excluded. */
+    size_t      imported;           /* Rows stored as a new item. */
+    size_t      rejected;           /* Rows skipped because of an error, each one reported to err_callback. */
+    size_t      first_error_line;   /* Line of the first rejected row (1-based), 0 if none. */
+} spt_csv_result;
+
+/* Delta header (see: spt_export_delta), followed by size bytes of records:
+ * the operations taking a context from from_version to to_version, one per
+ * version. Stored in the writer's native byte order like images. */
+typedef struct spt_delta_header {
+    char        magic[4];           /* "SPTD". */
+    uint32_t    version;            /* SPT_DELTA_VERSION. */
+    uint32_t    endian;             /* SPT_IMAGE_ENDIAN. */
+    uint32_t    size;               /* Record bytes after the header. */
+    uint64_t    from_version;       /* spt_context::version the delta applies to. */
+    uint64_t    to_version;         /* spt_context::version after applying it. */
+    uint32_t    checksum;           /* FNV-1a of the record bytes. */
+    uint32_t    reserved1;
+    uint64_t    from_chain;         /* spt_context::chain at from_version. */
+} spt_delta_header;
+
+/* spt_open_mmap flags. */
+enum spt_map_flags {
+    SPT_MAP_VERIFY      = 1 << 0,   /* Validate the checksum, reads the whole image. */
+};
+
 /**
  * @brief Initialize / reset a spt instance with default values.
- * @note Any previous data will be erased.
+ * @note Any previous data will be erased, and the journal, change log,
+ * snapshots and history are closed. Callbacks, user data and the allocation
+ * are kept: ctx has to be zeroed memory or an initialized context.
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error checking after this call.
  * @param ctx SPT instance.
  */
@@ -95,20 +432,73 @@ spt_context *spt_reset(
  * @brief Restore context state from a previous shapshot.
  * Since this lib is so simple, all the data fits in a statically allocated
  * struct that can be mapped to memory in a single block.
- * The current configuration allows for ~10k items and ~1k storage location
- * identifiers, every one of them having storage for the user-defined naming
- * string, has a total of ~350KB.
+ * Capacities are set at build time (SPT_MAX_ITEMS items and SPT_MAX_FIELDS
+ * storage location identifiers per field), names are interned in a shared
+ * arena.
+ * The image header is validated (magic, version, endianness, capacities and
+ * checksum) before copying. Runtime utils of ctx (callback and user data)
+ * are kept.
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error
  * checking after this call.
  * @param ctx SPT instance to load the data on.
- * @param blob Chunk of binary data formatted like spt_context struct.
+ * @param blob Image written by spt_save or spt_save_file (at most
+ * SPT_IMAGE_SIZE bytes, the actual size is given by its header).
  */
 void spt_load(
+    spt_context *ctx,
+    const void  *blob);
+
+/**
+ * @brief Write the context state as a binary image (see: spt_image_header).
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_FORMAT if blob is NULL.
+ * @param ctx SPT instance.
+ * @param blob Destination buffer of at least SPT_IMAGE_SIZE bytes.
+ * @return Image size in bytes, 0 on error.
+ */
+size_t spt_save(
     spt_context *ctx,
     void        *blob);
 
+/**
+ * @brief Write the context image to a file.
+ * The image is written to a temporary file that is synced and renamed over
+ * path, so a crash never leaves a partially written image behind.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param path Destination file.
+ */
+void spt_save_file(
+    spt_context *ctx,
+    const char  *path);
+
+/**
+ * @brief Map an image file and use it in place as a context, without copying.
+ * The mapping is private: pages are only read from the file when touched and
+ * writes are copy-on-write, they never reach the file (use spt_save_file for
+ * that). Runtime utils are reset, set the callback and user data again if
+ * needed.
+ * @param path Image file written by spt_save_file.
+ * @param flags Bitmask of enum spt_map_flags.
+ * @param out_error Optional, receives the error code (see: enum spt_error_codes).
+ * @return Mapped context or NULL on error. Release it with spt_close_mmap.
+ */
+spt_context *spt_open_mmap(
+    const char  *path,
+    int          flags,
+    int         *out_error);
+
+/**
+ * @brief Unmap a context returned by spt_open_mmap.
+ * @param ctx Mapped SPT instance.
+ */
+void spt_close_mmap(
+    spt_context *ctx);
+
 /** 
  * @brief Adds a new item or storage field to the database.
+ * The lowest free ID is assigned, IDs released by spt_delete are reused.
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error
  * checking after this call.
  * @param ctx SPT instance.
@@ -140,8 +530,11 @@ void spt_rename(
 
 /**
  * @brief Stores an item in a specified location.
+ * Constant time, every item has at most one entry. The item and every
+ * location ID have to be active (SPT_UNSPECIFIED_ID and SPT_DEFAULT_ID
+ * always are).
  * @note If the item was already stored, it is extracted from its previous
- * location before the insertion.
+ * location before the insertion (its entry is updated in place).
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error
  * checking after this call.
  * @param ctx SPT instance.
@@ -155,14 +548,14 @@ void spt_rename(
 spt_entry spt_insert(
     spt_context *ctx,
     uint32_t     item,
-    uint8_t      building,
-    uint8_t      room,
-    uint8_t      container,
-    uint8_t      subsection);
+    spt_loc_id   building,
+    spt_loc_id   room,
+    spt_loc_id   container,
+    spt_loc_id   subsection);
 
 /**
  * @brief Extract an item from its storage location.
- * The item is left in an unspecified state.
+ * Constant time, the item's entry is removed and its slot freed.
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error
  * checking after this call.
  * @param ctx SPT instance.
@@ -173,12 +566,29 @@ uint32_t spt_extract(
     spt_context *ctx,
     spt_entry    entry);
 
+/**
+ * @brief Set the quantity of a stored item, e.g. the number of screws in a
+ * box. Items are stored with quantity 1, moving them keeps it and
+ * extracting them clears it.
+ * Constant time, the sums of the item's locations are updated by the
+ * difference.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_NOT_FOUND if the item is not stored,
+ * SPT_NOOP if it already has that quantity.
+ * @param ctx SPT instance.
+ * @param item Item ID.
+ * @param quantity New quantity, 0 is allowed (the item stays stored).
+ */
+void spt_set_quantity(
+    spt_context *ctx,
+    uint32_t     item,
+    uint32_t     quantity);
+
 /**
  * @brief Delete the specified element from the database.
  * Reset the user-defined name and the generated ID.
- * Any dangling references (like contained items if the element was a storage
- * field or active entry if it was a stored item) will be left to an
- * unspecified state.
+ * Same as spt_delete_ex with SPT_CASCADE_EXTRACT: deleted items are
+ * extracted, and so are the items stored in a deleted storage element.
  * @note Read ctx->out_error code (see: enum spt_error_codes) for error
  * checking after this call.
  * @param ctx SPT instance.
@@ -190,45 +600,964 @@ void spt_delete(
     int          field,
     uint32_t     element);
 
+/**
+ * @brief Delete an element, choosing what happens to the entries that
+ * reference it.
+ * Only the affected entries are visited (see: spt_query_location), so the
+ * cost depends on how many items the element holds.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier from 'spt_fields'.
+ * @param element Item or storage to delete.
+ * @param mode Cascade mode (see: enum spt_cascade_modes).
+ */
+void spt_delete_ex(
+    spt_context *ctx,
+    int          field,
+    uint32_t     element,
+    int          mode);
+
+/**
+ * @brief Delete several elements of the same field atomically.
+ * Every element is validated before deleting anything: if one of them is out
+ * of bounds, or referenced with SPT_CASCADE_REFUSE, nothing is deleted.
+ * Inactive or repeated elements are skipped. Concurrent readers see the
+ * whole batch or none of it, and journal replays and deltas apply it whole
+ * (a batch cut short by a crash is dropped). SPT_ERROR_MEMORY if the batch
+ * bookkeeping can not be allocated (nothing is deleted).
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier from 'spt_fields'.
+ * @param elements Items or storages to delete.
+ * @param count Number of elements.
+ * @param mode Cascade mode (see: enum spt_cascade_modes).
+ */
+void spt_delete_batch(
+    spt_context    *ctx,
+    int             field,
+    const uint32_t *elements,
+    size_t          count,
+    int             mode);
+
 /**
  * @brief SPT instance generator.
  * This spt_context instances can be created and managed by anyone.
  * The only reason this function exist is for QoL when interfacing with other
  * programming languages or frameworks.
+ * @note The whole context is returned by value, prefer spt_create for
+ * avoiding the copy and the stack usage.
  * @return Generated instance default-initialized.
- * TODO: More in-depth checks regarding the possible copy of the instance.
- * The memory location of the instance is not the same but it's hard to tell
- * how is the OS copying the memory. I'm not able to spot any memory movement
- * when looking at the release disassembly. Maybe it's implemented using
- * virtual memory pager tricks? Since it is moving ~400KB of sequencial
- * data from a temp object to a lvalue...
  */
 static inline spt_context spt_mkctx() { return *spt_reset(&(spt_context){}); }
 
+/**
+ * @brief Allocate and initialize a context in a single aligned block.
+ * The block comes zeroed from the OS, so pages are only committed once they
+ * are used (names of unused IDs never are). Capacities are set at build
+ * time (see: SPT_MAX_ITEMS, SPT_MAX_FIELDS and SPT_LOCATION_ID_BITS).
+ * @param config Options, NULL for defaults. Start from SPT_CONFIG_INIT to
+ * have the capacities checked against the library build.
+ * @return New context or NULL if the allocation failed or the capacities of
+ * config do not match the library's. Release it with spt_destroy.
+ */
+spt_context *spt_create(
+    const spt_config *config);
+
+/**
+ * @brief Release a context created with spt_create or spt_shm_create,
+ * closing its journal, change log, snapshots and history (if any). Shared
+ * memory segments outlive it (see: spt_shm_unlink).
+ * @param ctx SPT instance.
+ */
+void spt_destroy(
+    spt_context *ctx);
+
 /**
  * @brief Obtain an element's ID.
- * @note Inefficient function. Performance-aware apps should cache their ids.
+ * Constant time lookup through the field's name index. If several elements
+ * share the same name, the lowest ID is returned.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param name Name to look for.
+ * @return Element ID or SPT_INVALID_ID if there is no element with that
+ * name (out_error is set to SPT_ERROR_NOT_FOUND).
  */
 uint32_t spt_get_id(
     spt_context *ctx,
     int          field,
     const char  *name);
 
+/**
+ * @brief Obtain an element's name.
+ * @note The string lives in the context arena: it is invalidated by any
+ * later mutation of ctx (renames, deletions and name compaction move or
+ * reuse arena records). Copy it if needed.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param element Element ID.
+ * @return Null-terminated name, empty string if the element is not active.
+ */
+const char *spt_get_name(
+    spt_context *ctx,
+    int          field,
+    uint32_t     element);
+
+/**
+ * @brief Reclaim the arena space of names that are no longer referenced.
+ * Live records are moved down and every name handle is updated. Called
+ * automatically when a new name does not fit in the arena.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if there was nothing to reclaim.
+ * @param ctx SPT instance.
+ */
+void spt_compact_names(
+    spt_context *ctx);
+
+/**
+ * @brief Obtain the entry of a stored item.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param item Item ID.
+ * @return Item's entry, zeroed if the item is not stored (out_error is set
+ * to SPT_ERROR_NOT_FOUND).
+ */
+spt_entry spt_find(
+    spt_context *ctx,
+    uint32_t     item);
+
+/**
+ * @brief Read an entry slot of the entry table.
+ * Use it instead of spt_context::entries, which does not exist with
+ * SPT_ENTRY_COLUMNS. Slots are not related to item IDs (see: spt_find).
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param slot Entry slot, in [0, SPT_MAX_ITEMS).
+ * @return Entry stored in the slot, item is 0 if the slot is free.
+ */
+spt_entry spt_get_entry(
+    spt_context *ctx,
+    uint32_t     slot);
+
+/**
+ * @brief Total quantity stored in a location, or the quantity of an item.
+ * Constant time, the sums are maintained by every mutation. Without
+ * spt_set_quantity, it is the number of items stored there.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param element Location or item ID, in [0, SPT_MAX_FIELDS) or
+ * [0, SPT_MAX_ITEMS). SPT_DEFAULT_ID counts what is stored at the default
+ * location of the field.
+ * @return Sum of the quantities of the items stored in the location, or
+ * the item's quantity (0 if it is not stored).
+ */
+uint64_t spt_count(
+    spt_context *ctx,
+    int          field,
+    uint32_t     element);
+
+/**
+ * @brief Total quantities of every location ID of a storage field (see:
+ * spt_count), a copy of SPT_MAX_FIELDS sums.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Storage field identifier (building, room, container or
+ * subsection).
+ * @param out Receives SPT_MAX_FIELDS sums, indexed by location ID (free IDs
+ * are 0).
+ */
+void spt_counts(
+    spt_context *ctx,
+    int          field,
+    uint64_t    *out);
+
+/**
+ * @brief Start a query over the entries stored in a location.
+ * Every location ID can be SPT_ANY, e.g. (b, r, SPT_ANY, SPT_ANY) lists
+ * everything stored in room r of building b. Only the entries stored in the
+ * most selective specified ID are visited, so the cost depends on the result
+ * size instead of SPT_MAX_ITEMS (except when every ID is SPT_ANY).
+ * @note The context must not be modified while the cursor is in use.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param building Building ID or SPT_ANY.
+ * @param room Room ID or SPT_ANY.
+ * @param container Container ID or SPT_ANY.
+ * @param subsection Subsection ID or SPT_ANY.
+ * @return Cursor for spt_cursor_next, empty on error.
+ */
+spt_cursor spt_query_location(
+    spt_context *ctx,
+    int          building,
+    int          room,
+    int          container,
+    int          subsection);
+
+/**
+ * @brief Advance a query cursor.
+ * @param cursor Cursor returned by spt_query_location.
+ * @param out Receives the next matching entry.
+ * @return 1 if an entry was written to out, 0 when the query is exhausted.
+ */
+int spt_cursor_next(
+    spt_cursor  *cursor,
+    spt_entry   *out);
+
+/**
+ * @brief Build a scan predicate.
+ * Entries match if every specified location ID is equal (SPT_ANY ignores
+ * the field) and the item ID is within [item_min, item_max]. Free entry
+ * slots never match.
+ * @param building Building ID or SPT_ANY.
+ * @param room Room ID or SPT_ANY.
+ * @param container Container ID or SPT_ANY.
+ * @param subsection Subsection ID or SPT_ANY.
+ * @param item_min Lowest item ID, 0 for no lower bound.
+ * @param item_max Highest item ID, UINT32_MAX for no upper bound.
+ * @return Compiled predicate.
+ */
+spt_predicate spt_predicate_compile(
+    int          building,
+    int          room,
+    int          container,
+    int          subsection,
+    uint32_t     item_min,
+    uint32_t     item_max);
+
+/**
+ * @brief Filter the whole entry table with a compiled predicate.
+ * Entries are compared several at a time with SSE2 or AVX2 (selected at
+ * runtime) when available, with a scalar fallback otherwise. With
+ * SPT_ENTRY_COLUMNS only the location columns used by the predicate are
+ * read, and the items of the slots they match.
+ * In contrast with spt_query_location, the cost is always proportional to
+ * SPT_MAX_ITEMS, but any combination of fields and item ranges is allowed.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param pred Predicate from spt_predicate_compile.
+ * @param out Receives the matching entries in slot order, NULL for only
+ * counting them.
+ * @param max Capacity of out, the scan stops once it is full.
+ * @return Number of matching entries (written to out if not NULL).
+ */
+size_t spt_scan(
+    spt_context         *ctx,
+    const spt_predicate *pred,
+    spt_entry           *out,
+    size_t               max);
+
+/**
+ * @brief Find the elements whose name contains a pattern, ignoring ASCII
+ * case.
+ * Names are prefiltered with their n-gram signatures, kept up to date by
+ * spt_add, spt_rename and spt_delete, so only the candidates sharing every
+ * bigram and trigram of the pattern are compared.
+ * Results are ranked: exact matches first, then prefixes and then the rest
+ * by match position. Ties go to shorter names and then to lower IDs.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param pattern Text to look for, an empty pattern matches every element.
+ * @param out_ids Receives the best 'max' matching IDs, NULL for only
+ * counting the matches.
+ * @param max Capacity of out_ids.
+ * @return Number of IDs written to out_ids (number of matches if NULL).
+ */
+size_t spt_search(
+    spt_context *ctx,
+    int          field,
+    const char  *pattern,
+    uint32_t    *out_ids,
+    size_t       max);
+
+/**
+ * @brief Iterate over the active elements of a field, skipping deleted ones.
+ * for (uint32_t id = spt_next(ctx, f, SPT_INVALID_ID); id != SPT_INVALID_ID; id = spt_next(ctx, f, id))
+ * @note The reserved SPT_UNSPECIFIED_ID and SPT_DEFAULT_ID elements are
+ * always active.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param element Previous element ID, SPT_INVALID_ID for starting.
+ * @return Next active element ID or SPT_INVALID_ID if there are no more.
+ */
+uint32_t spt_next(
+    spt_context *ctx,
+    int          field,
+    uint32_t     element);
+
+
+/**
+ * @brief Copy the call statistics of the context.
+ * Every mutating and query call of the regular API is counted (see: enum
+ * spt_stat_ops). The concurrent reader functions (_r) never write the
+ * context and are not, neither are spt_predicate_compile (it has no
+ * context), nor the calls creating, opening or closing a context or its
+ * journal, change log, snapshots or history. Nested public calls are
+ * counted too (e.g. spt_journal_replay counts every replayed mutation).
+ * @note Statistics are only collected if the library is built with
+ * SPT_STATS, otherwise out is zeroed and out_error is set to SPT_NOOP.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param out Receives the statistics, SPT_ERROR_BOUNDS if it is NULL.
+ */
+void spt_stats_get(
+    spt_context *ctx,
+    spt_stats   *out);
+
+/**
+ * @brief Zero the call statistics of the context.
+ * @param ctx SPT instance.
+ */
+void spt_stats_reset(
+    spt_context *ctx);
+
 
 /*
- * * * * spt_name helpers * * * *
+ * * * * Concurrent readers * * * *
+ * Any number of threads can call the _r functions while a single thread
+ * mutates the context through the regular API. Readers neither lock nor
+ * write the context: mutations keep spt_context::seq odd while they run and
+ * readers repeat their read if it overlapped one (seqlock). Errors are
+ * returned through the optional out_error argument instead of
+ * ctx->out_error. Readers wait for a mutation in progress at most
+ * SPT_READ_TIMEOUT_MS and then fail with SPT_ERROR_TIMEOUT. The rest of the
+ * API is not safe to call concurrently with the writer.
  */
-#define SPT_NAME_CODE_NULL 0x0081
-#define SPT_NAME_CODE_FREE 0x0082
 
-/* Check if name is empty string, i.e. buf[0] == '\0'. */
-static inline int spt_name_is_empty(spt_name *n) { return !*n->buf; }
+/**
+ * @brief spt_get_id for concurrent readers.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param name Name to look for.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes), SPT_ERROR_NOT_FOUND if there is no element with that
+ * name.
+ * @return Lowest element ID with that name or SPT_INVALID_ID.
+ */
+uint32_t spt_get_id_r(
+    const spt_context *ctx,
+    int                field,
+    const char        *name,
+    int               *out_error);
 
-/* Clears contents of a name. The cleared name is guaranteed to be empty. */
-static inline void spt_name_clear(spt_name *n) { *n->buf = 0; }
+/**
+ * @brief Copy an element's name, for concurrent readers.
+ * @param ctx SPT instance.
+ * @param field Field identifier (see: enum spt_fields).
+ * @param element Element ID.
+ * @param buf Receives the null-terminated name, truncated if needed (names
+ * always fit in SPT_NAME_SIZE bytes).
+ * @param size Size of buf.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes), SPT_ERROR_STATE if the element is not active.
+ * @return Length of the copied name.
+ */
+size_t spt_get_name_r(
+    const spt_context *ctx,
+    int                field,
+    uint32_t           element,
+    char              *buf,
+    size_t             size,
+    int               *out_error);
 
-/* Marks the name as freed so its memory can be reused by the next alias definition. */
-static inline void spt_name_release(spt_name *n) { *(uint16_t*)n->buf = SPT_NAME_CODE_FREE; }
+/**
+ * @brief spt_find for concurrent readers.
+ * @param ctx SPT instance.
+ * @param item Item ID.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes), SPT_ERROR_NOT_FOUND if the item is not stored.
+ * @return Item's entry, zeroed if the item is not stored.
+ */
+spt_entry spt_find_r(
+    const spt_context *ctx,
+    uint32_t           item,
+    int               *out_error);
+
+/**
+ * @brief spt_query_location for concurrent readers.
+ * The matching entries are collected at once instead of through a cursor,
+ * since the context can change between calls.
+ * @param ctx SPT instance.
+ * @param building Building ID or SPT_ANY.
+ * @param room Room ID or SPT_ANY.
+ * @param container Container ID or SPT_ANY.
+ * @param subsection Subsection ID or SPT_ANY.
+ * @param out Receives the first 'max' matching entries, can be NULL.
+ * @param max Capacity of out.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes).
+ * @return Number of matching entries, which can be larger than max.
+ */
+size_t spt_query_location_r(
+    const spt_context *ctx,
+    int                building,
+    int                room,
+    int                container,
+    int                subsection,
+    spt_entry         *out,
+    size_t             max,
+    int               *out_error);
+
+/**
+ * @brief spt_counts for concurrent readers.
+ * @param ctx SPT instance.
+ * @param field Storage field identifier.
+ * @param out Receives SPT_MAX_FIELDS sums, indexed by location ID.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes).
+ */
+void spt_counts_r(
+    const spt_context *ctx,
+    int                field,
+    uint64_t          *out,
+    int               *out_error);
+
+
+/*
+ * * * * Write-ahead journal * * * *
+ * Every successful mutating call (spt_add, spt_rename, spt_insert,
+ * spt_extract, spt_set_quantity, spt_delete) appends a small record to the journal
+ * instead of rewriting the whole image. Records carry the context version
+ * they produce, so replaying a journal only applies the ones that are newer
+ * than the loaded image.
+ * Startup: spt_load / spt_open_mmap the image, spt_journal_replay the
+ * journal file and spt_journal_open it for appending.
+ */
+
+/**
+ * @brief Start journaling the mutations of ctx to a file.
+ * The file is created if it does not exist, a torn record at its end (if
+ * any) is discarded. Records are written as they happen, but only synced to
+ * disk every 'batch' records (see: spt_journal_sync).
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param path Journal file.
+ * @param batch Number of records per fsync, 1 for syncing every record.
+ */
+void spt_journal_open(
+    spt_context *ctx,
+    const char  *path,
+    uint32_t     batch);
+
+/**
+ * @brief Sync the journal records written so far to disk.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ */
+void spt_journal_sync(
+    spt_context *ctx);
+
+/**
+ * @brief Sync and close the journal. Mutations are not journaled afterwards.
+ * @param ctx SPT instance.
+ */
+void spt_journal_close(
+    spt_context *ctx);
+
+/**
+ * @brief Apply the records of a journal file that are newer than ctx.
+ * Replay stops at the first torn or corrupted record, which is expected
+ * after a crash in the middle of a write. Replayed movements are not
+ * recorded in the history (see: spt_history_open): a history file kept
+ * along with the journal already has them, with their original times.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_STATE means the journal does not
+ * follow the context version (records missing) or a record could not be
+ * applied.
+ * @param ctx SPT instance, usually just loaded from an image.
+ * @param path Journal file.
+ */
+void spt_journal_replay(
+    spt_context *ctx,
+    const char  *path);
+
+/**
+ * @brief Fold the journal into a new image and empty the journal.
+ * If the process dies between both steps, replaying the old journal on the
+ * new image is harmless since its records are not newer than the image.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance with an open journal.
+ * @param image_path Image file (see: spt_save_file).
+ */
+void spt_journal_compact(
+    spt_context *ctx,
+    const char  *image_path);
+
+
+/*
+ * * * * Deltas * * * *
+ * Replicas are kept in sync by shipping the mutations made since their
+ * version instead of whole images. The source keeps its most recent
+ * mutations in a change log (a fixed size ring, the oldest ones are
+ * dropped), spt_export_delta encodes the ones newer than the replica and
+ * spt_apply_delta replays them on the replica.
+ * Sync: the replica sends its ctx->version, the source answers with a
+ * delta, or with a full image (spt_save / spt_load) if spt_export_delta
+ * fails with SPT_ERROR_STATE because the log no longer reaches that far.
+ */
+
+/**
+ * @brief Start recording the mutations of ctx for spt_export_delta.
+ * Only the mutations made from now on are recorded. Every successful
+ * mutating call takes a few bytes (names included), once the log is full
+ * the oldest records are dropped. spt_load empties it.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param capacity Log size in bytes, 0 for SPT_CHANGELOG_SIZE.
+ */
+void spt_changelog_open(
+    spt_context *ctx,
+    size_t       capacity);
+
+/**
+ * @brief Stop recording mutations and release the change log.
+ * @param ctx SPT instance.
+ */
+void spt_changelog_close(
+    spt_context *ctx);
+
+/**
+ * @brief Encode the mutations that take a context at since_version to the
+ * current version of ctx.
+ * The delta is a spt_delta_header followed by the records, a few bytes per
+ * mutation: varint IDs, names only for additions and renames.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_STATE if the change log is closed or
+ * does not reach since_version (send a full image instead), SPT_ERROR_MEMORY
+ * if size is too small (nothing is written).
+ * @param ctx SPT instance with an open change log.
+ * @param since_version Version of the replica, e.g. its ctx->version.
+ * @param buf Receives the delta, NULL for only computing its size.
+ * @param size Capacity of buf in bytes.
+ * @return Size of the delta in bytes, 0 on error (other than SPT_ERROR_MEMORY).
+ */
+size_t spt_export_delta(
+    spt_context *ctx,
+    uint64_t     since_version,
+    void        *buf,
+    size_t       size);
+
+/**
+ * @brief Apply a delta from spt_export_delta.
+ * The delta is validated (header and checksum) before anything is applied.
+ * Records the context already has are skipped, so applying the same delta
+ * twice is harmless. The chain of ctx (see: spt_context::chain) has to match
+ * the writer's at ctx->version, a context that reached its version through
+ * other mutations is refused.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if ctx is already up to date,
+ * SPT_ERROR_FORMAT for invalid deltas, SPT_ERROR_STATE if the delta starts
+ * after ctx->version or ctx diverged from the writer (load a full image
+ * instead), or if a record could not be applied (ctx stays at the version
+ * of the last applied record).
+ * @param ctx SPT instance.
+ * @param buf Delta.
+ * @param size Delta size in bytes.
+ */
+void spt_apply_delta(
+    spt_context *ctx,
+    const void  *buf,
+    size_t       size);
+
+
+/*
+ * * * * CSV * * * *
+ * Rows are "building,room,container,subsection,item" names, optionally
+ * quoted ("" escapes a quote), separated by LF or CRLF. A first row equal to
+ * those column names is skipped. Names longer than SPT_NAME_SIZE - 1 are
+ * truncated as in spt_add.
+ */
+
+/**
+ * @brief Import CSV rows from a buffer, storing one new item per row.
+ * Location names are resolved like spt_get_id (the previous row's names are
+ * remembered, so runs of rows sharing a location skip the lookups) and
+ * missing ones are added. Empty location names mean SPT_DEFAULT_ID. Items
+ * are always added, names are not unique.
+ * Rows with the wrong number of columns or that can not be stored are
+ * skipped and reported to err_callback with their line number, the import
+ * goes on with the next row.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_FORMAT if any row was rejected.
+ * @param ctx SPT instance.
+ * @param buf CSV text.
+ * @param size Size of buf in bytes.
+ * @param out Optional, receives the import summary.
+ * @return Number of imported rows.
+ */
+size_t spt_import_csv(
+    spt_context     *ctx,
+    const char      *buf,
+    size_t           size,
+    spt_csv_result  *out);
+
+/**
+ * @brief Same as spt_import_csv, reading a file descriptor until its end in
+ * chunks of SPT_CSV_CHUNK bytes.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_IO if a read fails (the rows read
+ * before are kept).
+ * @param ctx SPT instance.
+ * @param fd Readable file descriptor.
+ * @param out Optional, receives the import summary.
+ * @return Number of imported rows.
+ */
+size_t spt_import_csv_fd(
+    spt_context     *ctx,
+    int              fd,
+    spt_csv_result  *out);
+
+/**
+ * @brief Export every stored entry as CSV, in entry slot order and after a
+ * header row (see: spt_import_csv).
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_MEMORY if size is too small, buf then
+ * holds a truncated export.
+ * @param ctx SPT instance.
+ * @param buf Receives the CSV text (not null-terminated), NULL for only
+ * computing its size.
+ * @param size Capacity of buf in bytes.
+ * @return Size of the whole export in bytes.
+ */
+size_t spt_export_csv(
+    spt_context *ctx,
+    char        *buf,
+    size_t       size);
+
+/**
+ * @brief Same as spt_export_csv, writing to a file descriptor in chunks of
+ * SPT_CSV_CHUNK bytes.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param fd Writable file descriptor.
+ * @return Number of exported entries.
+ */
+size_t spt_export_csv_fd(
+    spt_context *ctx,
+    int          fd);
+
+
+/*
+ * * * * Paths * * * *
+ * A path names a location as "building/room/container/subsection", e.g.
+ * "Casa/Cocina/MesaAuxiliar/Estante1". Empty or missing trailing names mean
+ * SPT_DEFAULT_ID ("Casa/Garaje" is subsection and container Default). Names
+ * containing SPT_PATH_SEPARATOR can not be reached through paths.
+ */
+
+/**
+ * @brief Resolve the location IDs of a path.
+ * Every name is resolved like spt_get_id. Recently resolved paths are
+ * remembered in ctx->path_cache, so that a repeated path costs a hash and
+ * a comparison with the cached names instead of four lookups. The cache is
+ * cleared whenever a location is added, renamed or deleted, and by spt_load.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_NOT_FOUND if a name does not exist,
+ * SPT_ERROR_BOUNDS if the path has more than SPT_LOCATION_FIELDS names.
+ * @param ctx SPT instance.
+ * @param path Location path.
+ * @return Entry holding the location IDs, with SPT_UNSPECIFIED_ID as item.
+ */
+spt_entry spt_resolve_path(
+    spt_context *ctx,
+    const char  *path);
+
+/**
+ * @brief Store an item, by name, in the location of a path.
+ * Same as spt_insert with the location resolved by spt_resolve_path and the
+ * item by spt_get_id. An item that does not exist yet is added, an item
+ * already stored is moved.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call.
+ * @param ctx SPT instance.
+ * @param path Location path.
+ * @param item Item name.
+ * @return Resulting entry.
+ */
+spt_entry spt_insert_path(
+    spt_context *ctx,
+    const char  *path,
+    const char  *item);
+
+
+/*
+ * * * * Snapshots * * * *
+ * A snapshot records the state of the context at the time it is taken,
+ * without copying it: the first write to every SPT_UNDO_PAGE bytes page of
+ * the persistent data after the newest snapshot saves that page. Taking a
+ * snapshot costs the same whatever the context size, and its memory grows
+ * with the number of pages edited since.
+ * Snapshots form a bounded undo stack, spt_undo goes back to the newest one
+ * and spt_redo forward again, until the next mutation drops the undone
+ * snapshots. Like spt_load, going back and forth empties the change log.
+ * It can not be written to the journal, so it is refused while one is open.
+ * Every restore takes the context to a new version, versions are never
+ * reused.
+ */
+
+/**
+ * @brief Enable snapshots on ctx.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if built without SPT_UNDO.
+ * @param ctx SPT instance.
+ * @param depth Number of snapshots kept, 0 for SPT_UNDO_DEPTH. Taking one
+ * more drops the oldest.
+ */
+void spt_undo_open(
+    spt_context *ctx,
+    uint32_t     depth);
+
+/**
+ * @brief Drop every snapshot and disable them.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if snapshots were not enabled.
+ * @param ctx SPT instance.
+ */
+void spt_undo_close(
+    spt_context *ctx);
+
+/**
+ * @brief Take a snapshot of the current state, on top of the undo stack.
+ * Undone snapshots (see: spt_redo) are dropped.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_STATE if snapshots are not enabled.
+ * @param ctx SPT instance.
+ * @return Snapshot identifier, 0 on error.
+ */
+uint32_t spt_snapshot(
+    spt_context *ctx);
+
+/**
+ * @brief Go back to the state of a snapshot.
+ * Same as calling spt_undo until the snapshot is undone: it and the newer
+ * ones can be redone.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_NOT_FOUND if the snapshot is no
+ * longer in the undo stack, SPT_ERROR_MEMORY if a page could not be saved
+ * since it was taken, SPT_ERROR_STATE if a journal is open (the state is
+ * unchanged).
+ * @param ctx SPT instance.
+ * @param snapshot Identifier returned by spt_snapshot.
+ */
+void spt_rollback(
+    spt_context *ctx,
+    uint32_t     snapshot);
+
+/**
+ * @brief Go back to the state of the newest snapshot, which is moved to the
+ * redo stack.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if there is no snapshot,
+ * SPT_ERROR_STATE if a journal is open.
+ * @param ctx SPT instance.
+ */
+void spt_undo(
+    spt_context *ctx);
+
+/**
+ * @brief Redo the last undone snapshot: the state goes back to the one it
+ * was undone from.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if there is nothing to redo,
+ * SPT_ERROR_STATE if a journal is open.
+ * @param ctx SPT instance.
+ */
+void spt_redo(
+    spt_context *ctx);
+
+/**
+ * @brief Write the image of a snapshot's state (see: spt_save), e.g. to
+ * run reports on a frozen view (spt_load, spt_open_mmap) while ctx keeps
+ * changing. The current state is copied and the saved pages put back over
+ * it.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_FORMAT if blob is NULL.
+ * @param ctx SPT instance.
+ * @param snapshot Identifier returned by spt_snapshot.
+ * @param blob Receives the image, at least SPT_IMAGE_SIZE bytes.
+ * @return Image size in bytes, 0 on error.
+ */
+size_t spt_snapshot_save(
+    spt_context *ctx,
+    uint32_t     snapshot,
+    void        *blob);
+
+
+
+/*
+ * * * * History * * * *
+ * Every movement of an item (stored, moved, extracted, rehomed or extracted
+ * by a delete cascade) is recorded as a fixed size spt_move in a ring of the
+ * most recent ones, where each record links to the previous one of its item.
+ * Listing the movements of an item only visits that item's records. The
+ * ring is allocated once, recording a movement never allocates. Records can
+ * also be appended to a file, which is never rewritten: its growth is the
+ * application's to bound (e.g. rotate it between spt_history_close and
+ * spt_history_open). spt_load, spt_undo and spt_rollback are not movements
+ * and are not recorded. Deleted item IDs are reused, their history stays.
+ */
+
+/**
+ * @brief Start recording the movements of the items of ctx.
+ * If the file already has records, the newest 'capacity' ones are loaded,
+ * so that the history continues where it was left.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_FORMAT if the file was written by an
+ * incompatible build.
+ * @param ctx SPT instance.
+ * @param capacity Movements kept in memory, 0 for SPT_HISTORY_SIZE. Older
+ * ones are only kept in the file. With a file, it is raised to at least
+ * SPT_HISTORY_BATCH + SPT_MAX_ITEMS: a single call can move every item and
+ * the file is only written between calls.
+ * @param path History file, appended every SPT_HISTORY_BATCH movements. NULL
+ * to keep the history in memory only.
+ */
+void spt_history_open(
+    spt_context *ctx,
+    size_t       capacity,
+    const char  *path);
+
+/**
+ * @brief Write the buffered movements to the history file and sync it.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_NOOP if there is no history file.
+ * @param ctx SPT instance.
+ */
+void spt_history_flush(
+    spt_context *ctx);
+
+/**
+ * @brief Flush and stop recording movements, releasing the history.
+ * @param ctx SPT instance.
+ */
+void spt_history_close(
+    spt_context *ctx);
+
+/**
+ * @brief Movements of an item still in memory, newest first.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_STATE if the history is not enabled.
+ * @param ctx SPT instance.
+ * @param item Item ID.
+ * @param out Receives up to max movements.
+ * @param max Size of out.
+ * @return Number of movements written to out.
+ */
+size_t spt_item_history(
+    spt_context *ctx,
+    uint32_t     item,
+    spt_move    *out,
+    size_t       max);
+
+/**
+ * @brief Movements since a time still in memory, newest first, filtered by
+ * where they come from and go to, e.g. what left a room today.
+ * @note Read ctx->out_error code (see: enum spt_error_codes) for error
+ * checking after this call. SPT_ERROR_STATE if the history is not enabled.
+ * @param ctx SPT instance.
+ * @param from Predicate on spt_move::from (see: spt_predicate_compile), NULL
+ * to match any.
+ * @param to Predicate on spt_move::to, NULL to match any.
+ * @param since Oldest spt_move::time to visit.
+ * @param out Receives up to max movements.
+ * @param max Size of out.
+ * @return Number of movements written to out.
+ */
+size_t spt_history_query(
+    spt_context         *ctx,
+    const spt_predicate *from,
+    const spt_predicate *to,
+    int64_t              since,
+    spt_move            *out,
+    size_t               max);
+
+
+
+/*
+ * * * * Shared memory * * * *
+ * The context is a single position-independent block, so it can live in a
+ * named POSIX shared memory segment: one writer process creates it and
+ * mutates it through the regular API, any number of reader processes map
+ * the same pages read-only and query it with the _r functions (see:
+ * Concurrent readers), seeing every mutation as soon as it is done. There
+ * is a single copy of the context whatever the number of readers. The
+ * seqlock works across processes: readers wait while a mutation is in
+ * progress, so a writer that dies in the middle of one leaves the segment
+ * in that state and every read fails with SPT_ERROR_TIMEOUT until the
+ * segment is recreated.
+ */
+
+/**
+ * @brief Create a shared memory segment holding a new empty context.
+ * Fails if the segment already exists, e.g. left by a previous writer: load
+ * its state with spt_load if needed and remove it with spt_shm_unlink.
+ * Readers attached to a removed segment keep its last state until they
+ * attach again.
+ * @param name Segment name, "/name" (see: shm_open).
+ * @param config Options, NULL for the defaults. SPT_CONFIG_HUGE_PAGES is
+ * ignored. SPT_ERROR_FORMAT if its capacities do not match (see: spt_create).
+ * @param out_error Optional, receives the error code (see: enum spt_error_codes).
+ * @return Writer context or NULL on error. Release it with spt_destroy, the
+ * segment stays until spt_shm_unlink.
+ */
+spt_context *spt_shm_create(
+    const char          *name,
+    const spt_config    *config,
+    int                 *out_error);
+
+/**
+ * @brief Map the context of a shared memory segment read-only, for the _r
+ * functions.
+ * @param name Segment name given to spt_shm_create.
+ * @note If the writer process dies in the middle of a mutation, the _r
+ * functions fail with SPT_ERROR_TIMEOUT (after SPT_READ_TIMEOUT_MS) from
+ * then on. Detach, and attach again once a new writer recreated the
+ * segment (spt_shm_unlink and spt_shm_create).
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes). SPT_ERROR_FORMAT if the segment was created by an
+ * incompatible build or is not initialized yet.
+ * @return Shared context or NULL on error. Release it with spt_shm_detach.
+ */
+const spt_context *spt_shm_attach(
+    const char  *name,
+    int         *out_error);
+
+/**
+ * @brief Unmap a context returned by spt_shm_attach.
+ * @param ctx Shared SPT instance.
+ */
+void spt_shm_detach(
+    const spt_context *ctx);
+
+/**
+ * @brief Remove a shared memory segment. Mapped contexts stay valid, the
+ * memory is released once the last one is unmapped.
+ * @param name Segment name given to spt_shm_create.
+ * @param out_error Optional, receives the error code (see: enum
+ * spt_error_codes). SPT_NOOP if there is no such segment.
+ */
+void spt_shm_unlink(
+    const char  *name,
+    int         *out_error);
 
 
 #endif // __SEPET_H__
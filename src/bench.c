@@ -0,0 +1,520 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sepet/sepet.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * spbench: throughput and latency of the public API at full capacity.
+ * Throughput is the number of calls of a workload over the wall time of its
+ * whole loop. Latency percentiles come from timing calls on their own, only
+ * one call out of BENCH_SAMPLE_EVERY for the cheap ones so that the clock
+ * reads do not weigh on the throughput. Results are written as CSV (default)
+ * or JSON to stdout so that they can be compared between builds.
+ *
+ * Usage: spbench [--json] [--seed N] [--ops N] [--zipf S]
+ */
+
+#define BENCH_NAME_FMT "item-%08u" /* Names of the bench items. */
+#define BENCH_MISS_FMT "missing-%08u"
+#define BENCH_SAMPLE_EVERY 16      /* Latency sampling interval of the cheap workloads. */
+
+typedef struct bench_result {
+    const char *op;
+    size_t      count;
+    double      ops_per_sec;
+    uint64_t    p50_ns;
+    uint64_t    p99_ns;
+    uint64_t    max_ns;
+} bench_result;
+
+typedef struct bench_state {
+    spt_context *ctx;
+    uint64_t    *samples;           /* Sampled latencies of the running workload. */
+    size_t       nsamples;
+    size_t       nops;              /* Calls made by the running workload. */
+    size_t       every;             /* Calls per latency sample. */
+    uint64_t     start_ns;          /* Wall time at the start of the workload. */
+    double      *zipf_cdf;          /* Cumulative item popularity, by rank. */
+    uint32_t    *zipf_items;        /* Item ID of every rank. */
+    uint32_t     nitems;            /* Number of bench items (IDs 2 .. nitems + 1). */
+    uint64_t     rng;
+    bench_result results[32];
+    size_t       nresults;
+} bench_state;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough for picking workload elements. */
+static uint64_t
+rng_next(bench_state *b)
+{
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return b->rng * 2685821657736338717ULL;
+}
+
+static uint32_t
+rng_below(bench_state *b, uint32_t n)
+{
+    return (uint32_t)((rng_next(b) >> 32) * n >> 32);
+}
+
+/* Zipf distributed item: rank drawn by inverting the CDF, ranks are mapped
+ * to shuffled IDs so that popular items are not contiguous. */
+static uint32_t
+zipf_item(bench_state *b)
+{
+    double u = (double)(rng_next(b) >> 11) / (double)(1ULL << 53);
+    uint32_t lo = 0, hi = b->nitems - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (b->zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return b->zipf_items[lo];
+}
+
+static int
+zipf_init(bench_state *b, double s)
+{
+    b->zipf_cdf = malloc(b->nitems * sizeof(*b->zipf_cdf));
+    b->zipf_items = malloc(b->nitems * sizeof(*b->zipf_items));
+    if (!b->zipf_cdf || !b->zipf_items) {
+        return -1;
+    }
+
+    double sum = 0;
+    for (uint32_t i = 0; i < b->nitems; ++i) {
+        sum += 1.0 / pow(i + 1, s);
+        b->zipf_cdf[i] = sum;
+        b->zipf_items[i] = i + 2;
+    }
+    for (uint32_t i = 0; i < b->nitems; ++i) {
+        b->zipf_cdf[i] /= sum;
+    }
+    for (uint32_t i = b->nitems - 1; i > 0; --i) {
+        uint32_t j = rng_below(b, i + 1);
+        uint32_t t = b->zipf_items[i];
+        b->zipf_items[i] = b->zipf_items[j];
+        b->zipf_items[j] = t;
+    }
+    return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Starts a workload whose latency is sampled once every `every` calls. */
+static void
+bench_begin(bench_state *b, size_t every)
+{
+    b->nsamples = 0;
+    b->nops = 0;
+    b->every = every;
+    b->start_ns = now_ns();
+}
+
+/* Start time of the next call, 0 if it is not sampled. */
+static uint64_t
+bench_start(bench_state *b)
+{
+    return b->nops % b->every ? 0 : now_ns();
+}
+
+/* Counts a finished call, start comes from bench_start. */
+static void
+bench_sample(bench_state *b, uint64_t start)
+{
+    if (start) {
+        b->samples[b->nsamples++] = now_ns() - start;
+    }
+    ++b->nops;
+}
+
+/* Summarizes the samples of the finished workload. */
+static void
+bench_end(bench_state *b, const char *op)
+{
+    const uint64_t elapsed = now_ns() - b->start_ns;
+    bench_result *r = &b->results[b->nresults++];
+    r->op = op;
+    r->count = b->nops;
+    r->ops_per_sec = elapsed ? b->nops * 1e9 / elapsed : 0;
+    if (!b->nsamples) {
+        return;
+    }
+
+    qsort(b->samples, b->nsamples, sizeof(*b->samples), cmp_u64);
+    r->p50_ns = b->samples[b->nsamples / 2];
+    r->p99_ns = b->samples[b->nsamples * 99 / 100];
+    r->max_ns = b->samples[b->nsamples - 1];
+}
+
+/* Adds every storage field ID and bench item, so that the context is full. */
+static void
+bench_fill(bench_state *b)
+{
+    char name[64];
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (int field = 0; field < SPT_FIELD_ITEM; ++field) {
+        for (uint32_t id = SPT_DEFAULT_ID + 1; id < SPT_MAX_FIELDS; ++id) {
+            snprintf(name, sizeof(name), "loc-%d-%u", field, id);
+            uint64_t t = bench_start(b);
+            spt_add(b->ctx, field, name);
+            bench_sample(b, t);
+        }
+    }
+    for (uint32_t i = 0; i < b->nitems; ++i) {
+        snprintf(name, sizeof(name), BENCH_NAME_FMT, i + 2);
+        uint64_t t = bench_start(b);
+        spt_add(b->ctx, SPT_FIELD_ITEM, name);
+        bench_sample(b, t);
+    }
+    bench_end(b, "add");
+}
+
+static spt_loc_id
+random_location(bench_state *b)
+{
+    return (spt_loc_id)(SPT_DEFAULT_ID + 1 + rng_below(b, SPT_MAX_FIELDS - 2));
+}
+
+static void
+bench_insert(bench_state *b, size_t ops)
+{
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t item = zipf_item(b);
+        spt_loc_id bld = random_location(b), room = random_location(b);
+        spt_loc_id cont = random_location(b), sub = random_location(b);
+        uint64_t t = bench_start(b);
+        spt_insert(b->ctx, item, bld, room, cont, sub);
+        bench_sample(b, t);
+    }
+    bench_end(b, "insert");
+
+    /* Store every item, the remaining workloads expect a full entry table. */
+    for (uint32_t i = 0; i < b->nitems; ++i) {
+        spt_insert(b->ctx, i + 2, random_location(b), random_location(b),
+                   random_location(b), random_location(b));
+    }
+}
+
+static void
+bench_get_id(bench_state *b, size_t ops)
+{
+    char name[64];
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), BENCH_NAME_FMT, zipf_item(b));
+        uint64_t t = bench_start(b);
+        spt_get_id(b->ctx, SPT_FIELD_ITEM, name);
+        bench_sample(b, t);
+    }
+    bench_end(b, "get_id_hit");
+
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), BENCH_MISS_FMT, rng_below(b, UINT32_MAX));
+        uint64_t t = bench_start(b);
+        spt_get_id(b->ctx, SPT_FIELD_ITEM, name);
+        bench_sample(b, t);
+    }
+    bench_end(b, "get_id_miss");
+
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), BENCH_NAME_FMT, zipf_item(b));
+        uint64_t t = bench_start(b);
+        spt_get_id_r(b->ctx, SPT_FIELD_ITEM, name, NULL);
+        bench_sample(b, t);
+    }
+    bench_end(b, "get_id_r");
+}
+
+static void
+bench_find(bench_state *b, size_t ops)
+{
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t item = zipf_item(b);
+        uint64_t t = bench_start(b);
+        spt_find(b->ctx, item);
+        bench_sample(b, t);
+    }
+    bench_end(b, "find");
+}
+
+/* Extracts and stores back the same item, only the extraction is timed
+ * (the throughput is the rate of whole cycles). */
+static void
+bench_extract(bench_state *b, size_t ops)
+{
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t item = zipf_item(b);
+        spt_entry e = spt_find(b->ctx, item);
+        uint64_t t = bench_start(b);
+        spt_extract(b->ctx, e);
+        bench_sample(b, t);
+        spt_insert(b->ctx, item, e.building, e.room, e.container, e.subsection);
+    }
+    bench_end(b, "extract");
+}
+
+static void
+bench_rename(bench_state *b, size_t ops)
+{
+    char name[64];
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t item = zipf_item(b);
+        /* Alternate between two names so that lookups keep working. */
+        snprintf(name, sizeof(name), i % 2 ? BENCH_NAME_FMT : "renamed-%08u", item);
+        uint64_t t = bench_start(b);
+        spt_rename(b->ctx, SPT_FIELD_ITEM, item, name);
+        bench_sample(b, t);
+    }
+    bench_end(b, "rename");
+
+    for (uint32_t i = 0; i < b->nitems; ++i) {
+        snprintf(name, sizeof(name), BENCH_NAME_FMT, i + 2);
+        spt_rename(b->ctx, SPT_FIELD_ITEM, i + 2, name);
+    }
+}
+
+/* Churn: stored items are deleted and added back (getting the freed ID)
+ * and stored again, both steps are timed separately. They share the wall
+ * time of the loop, so their throughput is the rate of whole cycles. */
+static void
+bench_churn(bench_state *b, size_t ops)
+{
+    char name[64];
+    uint64_t *adds = malloc(ops * sizeof(*adds));
+    size_t nadds = 0;
+    if (!adds) {
+        return;
+    }
+
+    bench_begin(b, BENCH_SAMPLE_EVERY);
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t item = zipf_item(b);
+        uint64_t t = bench_start(b);
+        spt_delete(b->ctx, SPT_FIELD_ITEM, item);
+        bench_sample(b, t);
+
+        snprintf(name, sizeof(name), BENCH_NAME_FMT, item);
+        if (t) {
+            t = now_ns();
+            spt_add(b->ctx, SPT_FIELD_ITEM, name);
+            adds[nadds++] = now_ns() - t;
+        } else {
+            spt_add(b->ctx, SPT_FIELD_ITEM, name);
+        }
+        spt_insert(b->ctx, item, random_location(b), random_location(b),
+                   random_location(b), random_location(b));
+    }
+    const uint64_t loop_ns = now_ns() - b->start_ns;
+    bench_end(b, "delete");
+
+    memcpy(b->samples, adds, nadds * sizeof(*adds));
+    b->nsamples = nadds;
+    b->nops = ops;
+    b->start_ns = now_ns() - loop_ns;
+    bench_end(b, "add_churn");
+    free(adds);
+}
+
+/* Storage deletions with rehoming, every deleted ID is added back (the
+ * throughput is the rate of whole cycles). */
+static void
+bench_delete_storage(bench_state *b, size_t ops)
+{
+    char name[64];
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops; ++i) {
+        int field = (int)rng_below(b, SPT_FIELD_ITEM);
+        uint32_t id = random_location(b);
+        uint64_t t = bench_start(b);
+        spt_delete_ex(b->ctx, field, id, SPT_CASCADE_REHOME);
+        bench_sample(b, t);
+
+        snprintf(name, sizeof(name), "loc-%d-%u", field, id);
+        spt_add(b->ctx, field, name);
+    }
+    bench_end(b, "delete_storage");
+}
+
+static void
+bench_queries(bench_state *b, size_t ops)
+{
+    static spt_entry out[SPT_MAX_ITEMS];
+    uint32_t ids[16];
+    char pattern[16];
+
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops; ++i) {
+        spt_loc_id room = random_location(b);
+        uint64_t t = bench_start(b);
+        spt_cursor cur = spt_query_location(b->ctx, SPT_ANY, room, SPT_ANY, SPT_ANY);
+        while (spt_cursor_next(&cur, NULL));
+        bench_sample(b, t);
+    }
+    bench_end(b, "query_location");
+
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops / 16 + 1; ++i) {
+        spt_predicate pred = spt_predicate_compile(random_location(b), SPT_ANY,
+                SPT_ANY, SPT_ANY, 0, UINT32_MAX);
+        uint64_t t = bench_start(b);
+        spt_scan(b->ctx, &pred, out, SPT_MAX_ITEMS);
+        bench_sample(b, t);
+    }
+    bench_end(b, "scan");
+
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops / 16 + 1; ++i) {
+        snprintf(pattern, sizeof(pattern), "%04u", rng_below(b, 10000));
+        uint64_t t = bench_start(b);
+        spt_search(b->ctx, SPT_FIELD_ITEM, pattern, ids, 16);
+        bench_sample(b, t);
+    }
+    bench_end(b, "search");
+}
+
+static void
+bench_image(bench_state *b, size_t ops)
+{
+    void *blob = malloc(SPT_IMAGE_SIZE);
+    spt_context *copy = spt_create(NULL);
+    if (!blob || !copy) {
+        free(blob);
+        spt_destroy(copy);
+        return;
+    }
+
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t t = bench_start(b);
+        spt_save(b->ctx, blob);
+        bench_sample(b, t);
+    }
+    bench_end(b, "save");
+
+    bench_begin(b, 1);
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t t = bench_start(b);
+        spt_load(copy, blob);
+        bench_sample(b, t);
+    }
+    bench_end(b, "load");
+
+    spt_destroy(copy);
+    free(blob);
+}
+
+static void
+print_results(const bench_state *b, int json, uint64_t seed)
+{
+    if (json) {
+        printf("{\"max_items\": %u, \"max_fields\": %u, \"location_bits\": %d, "
+               "\"seed\": %llu, \"results\": [\n", (unsigned)SPT_MAX_ITEMS,
+               (unsigned)SPT_MAX_FIELDS, SPT_LOCATION_ID_BITS,
+               (unsigned long long)seed);
+    } else {
+        printf("op,count,ops_per_sec,p50_ns,p99_ns,max_ns\n");
+    }
+
+    for (size_t i = 0; i < b->nresults; ++i) {
+        const bench_result *r = &b->results[i];
+        if (json) {
+            printf("  {\"op\": \"%s\", \"count\": %zu, \"ops_per_sec\": %.0f, "
+                   "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}%s\n",
+                   r->op, r->count, r->ops_per_sec,
+                   (unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns,
+                   (unsigned long long)r->max_ns,
+                   i + 1 < b->nresults ? "," : "");
+        } else {
+            printf("%s,%zu,%.0f,%llu,%llu,%llu\n", r->op, r->count,
+                   r->ops_per_sec, (unsigned long long)r->p50_ns,
+                   (unsigned long long)r->p99_ns, (unsigned long long)r->max_ns);
+        }
+    }
+
+    if (json) {
+        printf("]}\n");
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int json = 0;
+    uint64_t seed = 1;
+    size_t ops = 200000;
+    double zipf = 0.99;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--ops") && i + 1 < argc) {
+            ops = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--zipf") && i + 1 < argc) {
+            zipf = strtod(argv[++i], NULL);
+        } else {
+            fprintf(stderr, "Usage: %s [--json] [--seed N] [--ops N] [--zipf S]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    bench_state b = {
+        .ctx = spt_create(NULL),
+        .nitems = SPT_MAX_ITEMS - 2,
+        .rng = seed ? seed : 1,
+    };
+    size_t max_samples = ops > SPT_MAX_ITEMS + 4 * SPT_MAX_FIELDS ?
+                         ops : SPT_MAX_ITEMS + 4 * SPT_MAX_FIELDS;
+    b.samples = malloc(max_samples * sizeof(*b.samples));
+    if (!b.ctx || !b.samples || zipf_init(&b, zipf)) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    bench_fill(&b);
+    bench_insert(&b, ops);
+    bench_get_id(&b, ops);
+    bench_find(&b, ops);
+    bench_extract(&b, ops);
+    bench_rename(&b, ops);
+    bench_churn(&b, ops);
+    bench_delete_storage(&b, ops / 16 + 1);
+    bench_queries(&b, ops / 16 + 1);
+    bench_image(&b, 64);
+    print_results(&b, json, seed);
+
+    free(b.samples);
+    free(b.zipf_cdf);
+    free(b.zipf_items);
+    spt_destroy(b.ctx);
+    return 0;
+}
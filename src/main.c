@@ -1,111 +1,122 @@
 #include <sepet/sepet.h>
 #include <stdio.h>
 
+static void print_names(spt_context *ctx, int field)
+{
+    for (uint32_t id = spt_next(ctx, field, SPT_INVALID_ID);
+         id != SPT_INVALID_ID; id = spt_next(ctx, field, id)) {
+        printf("\t%u: %s\n", id, spt_get_name(ctx, field, id));
+    }
+}
+
+static void print_entries(spt_context *ctx)
+{
+    for (uint32_t item = spt_next(ctx, SPT_FIELD_ITEM, SPT_INVALID_ID);
+         item != SPT_INVALID_ID; item = spt_next(ctx, SPT_FIELD_ITEM, item)) {
+        spt_entry entry = spt_find(ctx, item);
+        if (!entry.item) continue;
+        printf("\tb: %d - r: %d - c: %d - s: %d - i: %d\n",
+               entry.building, entry.room, entry.container,
+               entry.subsection, entry.item);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    spt_context ctx = spt_mkctx();
-
-    spt_add(&ctx, SPT_FIELD_BUILDING,   "Casa");
-    spt_add(&ctx, SPT_FIELD_ROOM,       "Dormitorio");
-    spt_add(&ctx, SPT_FIELD_ROOM,       "Cocina");
-    spt_add(&ctx, SPT_FIELD_CONTAINER,  "Mesita");
-    spt_add(&ctx, SPT_FIELD_CONTAINER,  "MesaAuxiliar");
-    uint8_t subsec = spt_add(&ctx, SPT_FIELD_SUBSECTION, "Cagarro");
-    spt_add(&ctx, SPT_FIELD_SUBSECTION, "Estante1");
-    spt_add(&ctx, SPT_FIELD_SUBSECTION, "Estante2");
-    spt_add(&ctx, SPT_FIELD_SUBSECTION, "Superficie");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "Condones");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "LlavesDenia");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "EBook");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "Pasaporte");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "Microondas");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "OllaPresion");
-    spt_add(&ctx, SPT_FIELD_ITEM,  "Cafetera");
-
-    spt_rename(&ctx, SPT_FIELD_SUBSECTION, subsec, "Cajon1");
+    const spt_config config = SPT_CONFIG_INIT;
+    spt_context *ctx = spt_create(&config);
+    if (!ctx) {
+        return 1;
+    }
+
+    spt_add(ctx, SPT_FIELD_BUILDING,   "Casa");
+    spt_add(ctx, SPT_FIELD_ROOM,       "Dormitorio");
+    spt_add(ctx, SPT_FIELD_ROOM,       "Cocina");
+    spt_add(ctx, SPT_FIELD_CONTAINER,  "Mesita");
+    spt_add(ctx, SPT_FIELD_CONTAINER,  "MesaAuxiliar");
+    uint32_t subsec = spt_add(ctx, SPT_FIELD_SUBSECTION, "Cagarro");
+    spt_add(ctx, SPT_FIELD_SUBSECTION, "Estante1");
+    spt_add(ctx, SPT_FIELD_SUBSECTION, "Estante2");
+    spt_add(ctx, SPT_FIELD_SUBSECTION, "Superficie");
+    spt_add(ctx, SPT_FIELD_ITEM,  "Condones");
+    spt_add(ctx, SPT_FIELD_ITEM,  "LlavesDenia");
+    spt_add(ctx, SPT_FIELD_ITEM,  "EBook");
+    spt_add(ctx, SPT_FIELD_ITEM,  "Pasaporte");
+    spt_add(ctx, SPT_FIELD_ITEM,  "Microondas");
+    spt_add(ctx, SPT_FIELD_ITEM,  "OllaPresion");
+    spt_add(ctx, SPT_FIELD_ITEM,  "Cafetera");
+
+    spt_rename(ctx, SPT_FIELD_SUBSECTION, subsec, "Cajon1");
 
     printf("\n--- User-defined aliases ---\n");
     printf("\nBuildings:\n");
-    for (spt_name *name = ctx.building_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.building_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_BUILDING);
 
     printf("\nRooms:\n");
-    for (spt_name *name = ctx.room_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.room_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_ROOM);
 
     printf("\nContainers:\n");
-    for (spt_name *name = ctx.container_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.container_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_CONTAINER);
 
     printf("\nSubsections:\n");
-    for (spt_name *name = ctx.subsec_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.subsec_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_SUBSECTION);
 
     printf("\nItems:\n");
-    for (spt_name *name = ctx.item_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.item_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_ITEM);
 
     printf("--------------------------------\n");
 
     spt_entry passport = spt_insert(
-            &ctx,
-            spt_get_id(&ctx, SPT_FIELD_ITEM, "Pasaporte"),
-            spt_get_id(&ctx, SPT_FIELD_BUILDING, "Casa"),
-            spt_get_id(&ctx, SPT_FIELD_ROOM, "Dormitorio"),
-            spt_get_id(&ctx, SPT_FIELD_CONTAINER, "Mesita"),
-            spt_get_id(&ctx, SPT_FIELD_SUBSECTION, "Cajon1"));
-
-    spt_insert(&ctx,
-               spt_get_id(&ctx, SPT_FIELD_ITEM, "Microondas"),
-               spt_get_id(&ctx, SPT_FIELD_BUILDING, "Casa"),
-               spt_get_id(&ctx, SPT_FIELD_ROOM, "Cocina"),
-               spt_get_id(&ctx, SPT_FIELD_CONTAINER, "MesaAuxiliar"),
-               spt_get_id(&ctx, SPT_FIELD_SUBSECTION, "Estante1"));
-
-    spt_insert(&ctx,
-               spt_get_id(&ctx, SPT_FIELD_ITEM, "Cafetera"),
-               spt_get_id(&ctx, SPT_FIELD_BUILDING, "Casa"),
-               spt_get_id(&ctx, SPT_FIELD_ROOM, "Cocina"),
-               spt_get_id(&ctx, SPT_FIELD_CONTAINER, "MesaAuxiliar"),
-               spt_get_id(&ctx, SPT_FIELD_SUBSECTION, "Superficie"));
+            ctx,
+            spt_get_id(ctx, SPT_FIELD_ITEM, "Pasaporte"),
+            spt_get_id(ctx, SPT_FIELD_BUILDING, "Casa"),
+            spt_get_id(ctx, SPT_FIELD_ROOM, "Dormitorio"),
+            spt_get_id(ctx, SPT_FIELD_CONTAINER, "Mesita"),
+            spt_get_id(ctx, SPT_FIELD_SUBSECTION, "Cajon1"));
+
+    spt_insert_path(ctx, "Casa/Cocina/MesaAuxiliar/Estante1", "Microondas");
+    spt_insert_path(ctx, "Casa/Cocina/MesaAuxiliar/Superficie", "Cafetera");
 
     printf("\n--- Inventory entries ---\n");
-    for (spt_entry *entry = ctx.entries; *(uint64_t*)entry; ++entry) {
-       printf("\t%ld: b: %d - r: %d - c: %d - s: %d - i: %d\n",
-             entry - ctx.entries, entry->building, entry->room,
-             entry->container, entry->subsection, entry->item);
+    print_entries(ctx);
+
+    printf("\n--- Casa/Cocina/MesaAuxiliar ---\n");
+    spt_cursor cur = spt_query_location(ctx,
+            spt_get_id(ctx, SPT_FIELD_BUILDING, "Casa"),
+            spt_get_id(ctx, SPT_FIELD_ROOM, "Cocina"),
+            spt_get_id(ctx, SPT_FIELD_CONTAINER, "MesaAuxiliar"),
+            SPT_ANY);
+    for (spt_entry entry; spt_cursor_next(&cur, &entry);) {
+        printf("\t%s (s: %d)\n", spt_get_name(ctx, SPT_FIELD_ITEM, entry.item), entry.subsection);
+    }
+
+    spt_predicate in_kitchen = spt_predicate_compile(SPT_ANY,
+            spt_get_id(ctx, SPT_FIELD_ROOM, "Cocina"), SPT_ANY, SPT_ANY,
+            0, UINT32_MAX);
+    printf("\nItems in any Cocina: %zu\n", spt_scan(ctx, &in_kitchen, NULL, 0));
+
+    uint32_t found[4];
+    size_t nfound = spt_search(ctx, SPT_FIELD_ITEM, "ca", found, 4);
+    printf("\nItems matching \"ca\":\n");
+    for (size_t i = 0; i < nfound; ++i) {
+        printf("\t%s\n", spt_get_name(ctx, SPT_FIELD_ITEM, found[i]));
     }
 
     /* Extracting passport from inventory. */
-    spt_extract(&ctx, passport);
+    spt_extract(ctx, passport);
 
     printf("\n--- Inventory entries ---\n");
-    for (spt_entry *entry = ctx.entries; *(uint64_t*)entry; ++entry) {
-        if (!entry->building) continue;
-        printf("\t%ld: b: %d - r: %d - c: %d - s: %d - i: %d\n",
-               entry - ctx.entries, entry->building, entry->room,
-               entry->container, entry->subsection, entry->item);
-    }
+    print_entries(ctx);
 
-    spt_delete(&ctx, SPT_FIELD_ROOM, spt_get_id(&ctx, SPT_FIELD_ROOM, "Dormitorio"));
+    spt_delete(ctx, SPT_FIELD_ROOM, spt_get_id(ctx, SPT_FIELD_ROOM, "Dormitorio"));
 
     printf("\n--- Inventory entries ---\n");
-    for (spt_entry *entry = ctx.entries; *(uint64_t*)entry; ++entry) {
-        if (!entry->building) continue;
-        printf("\t%ld: b: %d - r: %d - c: %d - s: %d - i: %d\n",
-               entry - ctx.entries, entry->building, entry->room,
-               entry->container, entry->subsection, entry->item);
-    }
+    print_entries(ctx);
 
     printf("\nRooms:\n");
-    for (spt_name *name = ctx.room_names; name->buf[0]; ++name) {
-        printf("\t%ld: %s\n", name - ctx.room_names, (char*)name);
-    }
+    print_names(ctx, SPT_FIELD_ROOM);
 
-    return ctx.out_error;
+    int err = ctx->out_error;
+    spt_destroy(ctx);
+    return err;
 }
@@ -1,45 +1,11 @@
 #include "sepet.h"
+#include "sepet_internal.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-
-/* Empty macro argument placeholder. */
-#define _SPT_ARG_PH
-
-/* Max index value depending on field type. */
-#define _SPT_MAX_IDX(FLD) \
-    ((FLD) == SPT_FIELD_ITEM ? SPT_MAX_ITEMS : SPT_MAX_FIELDS)
-
-/* Macro capturing the error handling boilerplate code. */
-#define _SPT_ERR(CTX, ERR, FMT, ...) do {                                      \
-    (CTX)->out_error = (ERR);                                                  \
-    snprintf((CTX)->out_err_msg, SPT_MSG_SIZE, FMT, __VA_ARGS__);       \
-    if ((CTX)->err_callback) {                                                 \
-        (CTX)->err_callback((CTX)->usr_data,                                   \
-                (CTX)->out_error, (CTX)->out_err_msg);                         \
-    }} while (0)
-
-/* Field arg value check. */
-#define _SPT_CHECK_FIELD(CTX, FLD, RET) do {                                   \
-    if ((FLD) < 0 || (FLD) >= SPT_FIELD_COUNT) {                               \
-        _SPT_ERR((CTX), SPT_ERROR_BOUNDS,                                      \
-                "Field (%d) out of bounds. Range: [0, %d)",                    \
-                (FLD), SPT_FIELD_COUNT);                                       \
-        return RET;                                                            \
-    }} while (0)
-
-/* Element index arg value check, */
-#define _SPT_CHECK_ELEM(CTX, FLD, ELEM, RET) do {                              \
-    if ((ELEM) <= SPT_DEFAULT_ID || (ELEM) >= _SPT_MAX_IDX((FLD))) {                         \
-        _SPT_ERR((CTX), SPT_ERROR_BOUNDS,                                      \
-                "Element (%d) out of bounds. Range: [0, %d)",                  \
-                (ELEM), _SPT_MAX_IDX((FLD)));                                  \
-        return RET;                                                            \
-    }} while (0)
-
-/* Arg context checking. Done at the beginning of every function. */
-#define _SPT_CHECK_CTX(CTX, RET) do {if (!(CTX)) {return RET;}} while (0)
+#include <sys/mman.h>
 
 /* 'enum spt_fields' to string (enum values and this indices have to match). */
 static const char* SPT_FIELD_NAMES[SPT_FIELD_COUNT] = {
@@ -50,98 +16,734 @@ static const char* SPT_FIELD_NAMES[SPT_FIELD_COUNT] = {
     "Item"
 };
 
-/* Check if name is empty string, i.e. buf[0] == '\0'. */
-static int _spt_empty(spt_name *n) { return !*n->buf; }
+/* First name handle of the field's array. */
+static uint32_t *
+_spt_names(spt_context *ctx, int field)
+{
+    return ctx->building_names + field * SPT_MAX_FIELDS;
+}
+
+/* Arena bytes taken by a record of len chars. */
+static uint32_t
+_spt_rec_size(uint32_t len)
+{
+    return (_SPT_REC_HEAD + len + 2) & ~1U;
+}
+
+/* Reference count of the record. */
+static uint16_t
+_spt_rec_refs(const char *arena, uint32_t handle)
+{
+    uint16_t refs;
+    memcpy(&refs, arena + handle, sizeof(refs));
+    return refs;
+}
+
+static void
+_spt_rec_refs_set(char *arena, uint32_t handle, uint16_t refs)
+{
+    memcpy(arena + handle, &refs, sizeof(refs));
+}
+
+/* Name of the element, empty string if its ID is free. */
+static const char *
+_spt_name(spt_context *ctx, int field, uint32_t element)
+{
+    uint32_t handle = _spt_names(ctx, field)[element];
+    return handle ? ctx->names_arena + handle + _SPT_REC_HEAD : "";
+}
+
+/* Search signatures of the field. */
+static uint64_t *
+_spt_grams(spt_context *ctx, int field)
+{
+    return ctx->building_grams + field * SPT_MAX_FIELDS;
+}
+
+/* First slot of the field's name index. */
+static spt_slot *
+_spt_index(spt_context *ctx, int field)
+{
+    return ctx->building_index + field * SPT_INDEX_FIELDS;
+}
+
+/* Index mask (slot count - 1) depending on field type. */
+static uint32_t
+_spt_index_mask(int field)
+{
+    return (field == SPT_FIELD_ITEM ? SPT_INDEX_ITEMS : SPT_INDEX_FIELDS) - 1;
+}
+
+/* Allocation bitmap of the field. */
+static uint64_t *
+_spt_free(spt_context *ctx, int field)
+{
+    return ctx->building_free + field * SPT_SLOTS_FIELDS;
+}
+
+/* Allocation bitmap summary of the field. */
+static uint64_t *
+_spt_summary(spt_context *ctx, int field)
+{
+    return ctx->building_summary + field * SPT_SUMMARY_FIELDS;
+}
+
+/* Check if the element ID is allocated. */
+static int
+_spt_live(spt_context *ctx, int field, uint32_t element)
+{
+    return element < (uint32_t)_SPT_MAX_IDX(field) &&
+           !(_spt_free(ctx, field)[element / 64] & (1ULL << (element % 64)));
+}
+
+/* Marks the element ID as used or free, keeping the summary up to date. */
+static void
+_spt_slot_set(spt_context *ctx, int field, uint32_t element, int free)
+{
+    uint64_t *word = _spt_free(ctx, field) + element / 64;
+    uint64_t *sum = _spt_summary(ctx, field) + element / 4096;
+    _spt_cow(ctx, word, sizeof(*word));
+    _spt_cow(ctx, sum, sizeof(*sum));
+    if (free) {
+        *word |= 1ULL << (element % 64);
+    } else {
+        *word &= ~(1ULL << (element % 64));
+    }
+
+    if (*word) {
+        *sum |= 1ULL << (element / 64 % 64);
+    } else {
+        *sum &= ~(1ULL << (element / 64 % 64));
+    }
+}
+
+/* Lowest free ID of the field or SPT_INVALID_ID if full. */
+static uint32_t
+_spt_slot_alloc(spt_context *ctx, int field)
+{
+    const int nsum = field == SPT_FIELD_ITEM ? SPT_SUMMARY_ITEMS : SPT_SUMMARY_FIELDS;
+    uint64_t *sum = _spt_summary(ctx, field);
+    for (int i = 0; i < nsum; ++i) {
+        if (sum[i]) {
+            uint32_t word = i * 64 + _spt_ffs(sum[i]);
+            uint32_t id = word * 64 + _spt_ffs(_spt_free(ctx, field)[word]);
+            _spt_slot_set(ctx, field, id, 0);
+            return id;
+        }
+    }
+    return SPT_INVALID_ID;
+}
+
+/* FNV-1a over the first SPT_NAME_SIZE - 1 chars of str (same range as strncmp). */
+static uint32_t
+_spt_hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < SPT_NAME_SIZE - 1 && str[i]; ++i) {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Adds the element's current name to the field's index. */
+static void
+_spt_index_insert(spt_context *ctx, int field, uint32_t element)
+{
+    spt_slot *index = _spt_index(ctx, field);
+    const uint32_t mask = _spt_index_mask(field);
+    uint32_t i = _spt_hash(_spt_name(ctx, field, element)) & mask;
+    uint32_t n = 1;
+    for (; index[i]; i = (i + 1) & mask, ++n);
+    _spt_cow(ctx, index + i, sizeof(*index));
+    index[i] = element + 1;
+    _SPT_STAT_PROBES(ctx, n);
+}
+
+/* Removes the element from the field's index. Hash is the one of the name
+ * the element was inserted with. */
+static void
+_spt_index_remove(spt_context *ctx, int field, uint32_t element, uint32_t hash)
+{
+    spt_slot *index = _spt_index(ctx, field);
+    const uint32_t mask = _spt_index_mask(field);
+    uint32_t i = hash & mask;
+    uint32_t n = 1;
+    for (; index[i] != element + 1; i = (i + 1) & mask, ++n) {
+        if (!index[i]) {
+            _SPT_STAT_PROBES(ctx, n);
+            return;
+        }
+    }
+
+    /* Backward shift deletion: move back every following slot of the
+     * cluster that would become unreachable through the emptied one. */
+    for (uint32_t j = (i + 1) & mask; index[j]; j = (j + 1) & mask, ++n) {
+        uint32_t home = _spt_hash(_spt_name(ctx, field, index[j] - 1)) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            _spt_cow(ctx, index + i, sizeof(*index));
+            index[i] = index[j];
+            i = j;
+        }
+    }
+    _spt_cow(ctx, index + i, sizeof(*index));
+    index[i] = 0;
+    _SPT_STAT_PROBES(ctx, n);
+}
+
+/* Moves the referenced records down over the unreferenced ones, updating
+ * every handle. Returns SPT_SUCCESS, SPT_NOOP or SPT_ERROR_MEMORY. */
+static int
+_spt_names_compact(spt_context *ctx)
+{
+    if (!ctx->arena_garbage) {
+        return SPT_NOOP;
+    }
+
+    char *old = malloc(ctx->arena_used);
+    if (!old) {
+        return SPT_ERROR_MEMORY;
+    }
+    memcpy(old, ctx->names_arena, ctx->arena_used);
+    _spt_cow(ctx, ctx->building_names,
+             (char *)(ctx->item_names + SPT_MAX_ITEMS) - (char *)ctx->building_names);
+    _spt_cow(ctx, &ctx->arena_used,
+             ctx->names_arena + ctx->arena_used - (char *)&ctx->arena_used);
+
+    /* Records are copied the first time one of their handles is visited,
+     * then the old copy is marked with 0 references (referenced records
+     * always have some) and its string replaced by the new handle. Every
+     * record is at least 6 bytes long, so the handle fits. */
+    uint32_t used = _SPT_ARENA_BASE;
+    for (int field = 0; field < SPT_FIELD_COUNT; ++field) {
+        uint32_t *names = _spt_names(ctx, field);
+        const uint32_t maxidx = _SPT_MAX_IDX(field);
+        for (uint32_t id = 0; id < maxidx; ++id) {
+            uint32_t handle = names[id];
+            if (!handle) {
+                continue;
+            }
+
+            if (_spt_rec_refs(old, handle)) {
+                uint32_t size = _spt_rec_size((unsigned char)old[handle + 2]);
+                memcpy(ctx->names_arena + used, old + handle, size);
+                _spt_rec_refs_set(old, handle, 0);
+                memcpy(old + handle + 2, &used, sizeof(used));
+                used += size;
+            }
+            memcpy(names + id, old + handle + 2, sizeof(uint32_t));
+        }
+    }
+
+    ctx->arena_used = used;
+    ctx->arena_garbage = 0;
+    free(old);
+    return SPT_SUCCESS;
+}
+
+/* Appends a record with a single reference, compacting the arena if it is
+ * full. Returns its handle or 0 if there is no space left. */
+static uint32_t
+_spt_name_alloc(spt_context *ctx, const char *str, uint32_t len)
+{
+    const uint32_t size = _spt_rec_size(len);
+    if (ctx->arena_used + size > SPT_NAME_ARENA_SIZE) {
+        _spt_names_compact(ctx);
+        if (ctx->arena_used + size > SPT_NAME_ARENA_SIZE) {
+            return 0;
+        }
+    }
+
+    uint32_t handle = ctx->arena_used;
+    char *rec = ctx->names_arena + handle;
+    _spt_cow(ctx, &ctx->arena_used, sizeof(ctx->arena_used));
+    _spt_cow(ctx, rec, size);
+    _spt_rec_refs_set(rec, 0, 1);
+    rec[2] = (char)len;
+    memcpy(rec + _SPT_REC_HEAD, str, len);
+    memset(rec + _SPT_REC_HEAD + len, 0, size - _SPT_REC_HEAD - len);
+    ctx->arena_used += size;
+    return handle;
+}
+
+/* Drops a reference to the record, its space is garbage once unreferenced. */
+static void
+_spt_name_release(spt_context *ctx, uint32_t handle)
+{
+    uint16_t refs = _spt_rec_refs(ctx->names_arena, handle) - 1;
+    _spt_cow(ctx, ctx->names_arena + handle, sizeof(refs));
+    _spt_cow(ctx, &ctx->arena_garbage, sizeof(ctx->arena_garbage));
+    _spt_rec_refs_set(ctx->names_arena, handle, refs);
+    if (!refs) {
+        ctx->arena_garbage +=
+            _spt_rec_size((unsigned char)ctx->names_arena[handle + 2]);
+    }
+}
+
+/* Sets the element's name, interned with the other elements of the field.
+ * NULL or empty names are replaced by the ID as ascii, longer names are
+ * truncated to SPT_NAME_SIZE - 1 chars. The field's index is not updated.
+ * Returns SPT_SUCCESS or SPT_ERROR_MEMORY (name unchanged). */
+static int
+_spt_name_set(spt_context *ctx, int field, uint32_t element, const char *name)
+{
+    /* Copied first: name may point to the arena, which can be compacted. */
+    char buf[SPT_NAME_SIZE];
+    uint32_t len;
+    if (name && *name) {
+        len = strnlen(name, SPT_NAME_SIZE - 1);
+        memcpy(buf, name, len);
+        buf[len] = '\0';
+    } else {
+        len = snprintf(buf, sizeof(buf), "%u", element);
+    }
+
+    uint32_t *names = _spt_names(ctx, field);
+    if (names[element] && !strcmp(_spt_name(ctx, field, element), buf)) {
+        return SPT_SUCCESS;
+    }
+
+    /* Share the record of another element with the same name. */
+    spt_slot *index = _spt_index(ctx, field);
+    const uint32_t mask = _spt_index_mask(field);
+    uint32_t handle = 0;
+    for (uint32_t i = _spt_hash(buf) & mask; index[i]; i = (i + 1) & mask) {
+        uint32_t h = names[index[i] - 1];
+        if (_spt_rec_refs(ctx->names_arena, h) < _SPT_REC_MAX_REFS &&
+            !strcmp(ctx->names_arena + h + _SPT_REC_HEAD, buf)) {
+            handle = h;
+            _spt_cow(ctx, ctx->names_arena + h, sizeof(uint16_t));
+            _spt_rec_refs_set(ctx->names_arena, h,
+                    _spt_rec_refs(ctx->names_arena, h) + 1);
+            break;
+        }
+    }
+
+    if (!handle && !(handle = _spt_name_alloc(ctx, buf, len))) {
+        return SPT_ERROR_MEMORY;
+    }
+
+    if (names[element]) {
+        _spt_name_release(ctx, names[element]);
+    }
+    _spt_cow(ctx, names + element, sizeof(*names));
+    _spt_cow(ctx, _spt_grams(ctx, field) + element, sizeof(uint64_t));
+    names[element] = handle;
+    _spt_grams(ctx, field)[element] = _spt_name_grams(buf, len);
+    return SPT_SUCCESS;
+}
+
+/* Bumps the context version and records the mutation in the change log and
+ * the journal. Called after a successful mutation, once out_error has been
+ * set. Arg is the operation argument (cascade mode of deletes). */
+static void
+_spt_commit(spt_context *ctx, int op, int field, uint32_t element,
+            spt_entry entry, uint32_t arg)
+{
+    _spt_cow(ctx, &ctx->version, sizeof(ctx->version));
+    _spt_cow(ctx, &ctx->chain, sizeof(ctx->chain));
+    ++ctx->version;
+    if (field != SPT_FIELD_ITEM) {
+        /* A location was added, renamed or deleted. */
+        _spt_path_cache_clear(ctx);
+    }
+    const char *name = op == _SPT_OP_ADD || op == _SPT_OP_RENAME ?
+                       _spt_name(ctx, field, element) : NULL;
+    _spt_delta_record(ctx, op, field, element, entry, name, arg);
+    if (ctx->journal) {
+        _spt_journal_append(ctx, op, field, element, entry, name, arg);
+    }
+    if (ctx->history) {
+        _spt_history_commit(ctx);
+    }
+}
+
+void
+_spt_init(spt_context *ctx)
+{
+    ctx->chain = _SPT_CHAIN_BASIS;
+
+    /* Reserved names are shared by every field. */
+    ctx->arena_used = _SPT_ARENA_BASE;
+    uint32_t unspecified = _spt_name_alloc(ctx, "Unspecified", 11);
+    uint32_t def = _spt_name_alloc(ctx, "Default", 7);
+    _spt_rec_refs_set(ctx->names_arena, unspecified, SPT_FIELD_COUNT);
+    _spt_rec_refs_set(ctx->names_arena, def, SPT_FIELD_COUNT);
+
+    for (int field = 0; field < SPT_FIELD_COUNT; ++field) {
+        _spt_names(ctx, field)[SPT_UNSPECIFIED_ID] = unspecified;
+        _spt_names(ctx, field)[SPT_DEFAULT_ID] = def;
+        _spt_grams(ctx, field)[SPT_UNSPECIFIED_ID] = _spt_name_grams("Unspecified", 11);
+        _spt_grams(ctx, field)[SPT_DEFAULT_ID] = _spt_name_grams("Default", 7);
+    }
+
+    for (int field = 0; field < SPT_FIELD_COUNT; ++field) {
+        const uint32_t maxidx = _SPT_MAX_IDX(field);
+        for (uint32_t id = SPT_DEFAULT_ID + 1; id < maxidx; ++id) {
+            _spt_slot_set(ctx, field, id, 1);
+        }
+        _spt_index_insert(ctx, field, SPT_UNSPECIFIED_ID);
+        _spt_index_insert(ctx, field, SPT_DEFAULT_ID);
+    }
+
+    /* Lowest slots on top of the stack. */
+    for (uint32_t i = 0; i < SPT_MAX_ITEMS; ++i) {
+        ctx->entry_stack[i] = SPT_MAX_ITEMS - 1 - i;
+    }
+    ctx->entry_stack_top = SPT_MAX_ITEMS;
+}
 
 spt_context *
 spt_reset(spt_context *ctx)
 {
     _SPT_CHECK_CTX(ctx, ctx);
-    /* Name arrays rely on first char being 0 on unused ones. */
-    memset(ctx, 0, sizeof(*ctx));
-
-    ctx->building_names [SPT_UNSPECIFIED_ID] = (spt_name){"Unspecified"};
-    ctx->room_names     [SPT_UNSPECIFIED_ID] = (spt_name){"Unspecified"};
-    ctx->container_names[SPT_UNSPECIFIED_ID] = (spt_name){"Unspecified"};
-    ctx->subsec_names   [SPT_UNSPECIFIED_ID] = (spt_name){"Unspecified"};
-    ctx->item_names     [SPT_UNSPECIFIED_ID] = (spt_name){"Unspecified"};
-    ctx->building_names [SPT_DEFAULT_ID]     = (spt_name){"Default"};
-    ctx->room_names     [SPT_DEFAULT_ID]     = (spt_name){"Default"};
-    ctx->container_names[SPT_DEFAULT_ID]     = (spt_name){"Default"};
-    ctx->subsec_names   [SPT_DEFAULT_ID]     = (spt_name){"Default"};
-    ctx->item_names     [SPT_DEFAULT_ID]     = (spt_name){"Default"};
+    /* The previous state is gone, so are the records about it. */
+    if (ctx->journal) {
+        spt_journal_close(ctx);
+    }
+    if (ctx->changelog) {
+        spt_changelog_close(ctx);
+    }
+    if (ctx->undo) {
+        spt_undo_close(ctx);
+    }
+    if (ctx->history) {
+        spt_history_close(ctx);
+    }
+
+    /* Name handles rely on being 0 on unused IDs. The arena is not cleared,
+     * only its used part is ever read. The runtime part (callbacks,
+     * allocation, seqlock and statistics) is kept. */
+    _spt_write_begin(ctx);
+    memset(ctx, 0, offsetof(spt_context, names_arena));
+    _spt_init(ctx);
+    _spt_write_end(ctx);
+    _spt_path_cache_clear(ctx);
+    ctx->out_error = SPT_SUCCESS;
+    return ctx;
+}
 
+int
+_spt_config_mismatch(const spt_config *config)
+{
+    return (config->max_items && config->max_items != SPT_MAX_ITEMS) ||
+           (config->max_fields && config->max_fields != SPT_MAX_FIELDS) ||
+           (config->location_id_bits &&
+            config->location_id_bits != SPT_LOCATION_ID_BITS) ||
+           (config->context_size && config->context_size != sizeof(spt_context));
+}
+
+/* Huge page size assumed for SPT_CONFIG_HUGE_PAGES allocations. */
+#define _SPT_HUGE_PAGE (2U << 20)
+
+spt_context *
+spt_create(const spt_config *config)
+{
+    const spt_config defaults = {0};
+    config = config ? config : &defaults;
+    if (_spt_config_mismatch(config)) {
+        return NULL;
+    }
+
+    /* Anonymous mappings are zeroed and page aligned, and their pages are
+     * not committed until touched. */
+    size_t size = sizeof(spt_context);
+    if (config->flags & SPT_CONFIG_HUGE_PAGES) {
+        size = (size + _SPT_HUGE_PAGE - 1) & ~(size_t)(_SPT_HUGE_PAGE - 1);
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+#if defined(MADV_HUGEPAGE)
+    if (config->flags & SPT_CONFIG_HUGE_PAGES) {
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    spt_context *ctx = mem;
+    _spt_init(ctx);
+    ctx->err_callback = config->err_callback;
+    ctx->usr_data = config->usr_data;
+#if SPT_STATS
+    ctx->trace_callback = config->trace_callback;
+#endif
+    ctx->alloc_size = size;
     ctx->out_error = SPT_SUCCESS;
     return ctx;
 }
 
+void
+spt_destroy(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (ctx->journal) {
+        spt_journal_close(ctx);
+    }
+    if (ctx->changelog) {
+        spt_changelog_close(ctx);
+    }
+    if (ctx->undo) {
+        spt_undo_close(ctx);
+    }
+    if (ctx->history) {
+        spt_history_close(ctx);
+    }
+    if (ctx->alloc_size) {
+        munmap(ctx, ctx->alloc_size);
+    }
+}
+
 uint32_t
-spt_add(spt_context *ctx, int field, const char *alias)
+_SPT_API(spt_add)(spt_context *ctx, int field, const char *alias)
 {
     /* Context and field checks. */
     _SPT_CHECK_CTX(ctx, SPT_INVALID_ID);
     _SPT_CHECK_FIELD(ctx, field, SPT_INVALID_ID);
 
-    const int maxidx = field == SPT_FIELD_ITEM ? SPT_MAX_ITEMS : SPT_MAX_FIELDS;
-    /* Get a char ptr pointing at the first empty alias
-     * element and assume it's really unused. */
-    spt_name *name = ctx->building_names + field * SPT_MAX_FIELDS;
-    int idx = 0;
-    for (; idx < maxidx && !_spt_empty(name + idx); ++idx);
+    /* Take the lowest free ID, released ones included. */
+    _spt_write_begin(ctx);
+    uint32_t idx = _spt_slot_alloc(ctx, field);
 
     /* Check if field's names buffer is full. */
-    if (idx >= maxidx) {
+    if (idx == SPT_INVALID_ID) {
+        _spt_write_end(ctx);
         _SPT_ERR(ctx, SPT_ERROR_MEMORY,
                 "%s aliases array reached its limit of %d elements.",
-                SPT_FIELD_NAMES[field], maxidx);
+                SPT_FIELD_NAMES[field], _SPT_MAX_IDX(field));
         return SPT_INVALID_ID;
     }
 
     /* Set name data and return the element index. */
-    if (alias && *alias) {
-        /* Alias has data: copy it into name. */
-        strncpy(name[idx].buf, alias, SPT_NAME_SIZE);
-    } else {
-        /* Alias is NULL or empty: set the internal index as ascii. */
-        snprintf(name[idx].buf, SPT_NAME_SIZE, "%d", idx);
+    if (_spt_name_set(ctx, field, idx, alias) != SPT_SUCCESS) {
+        _spt_slot_set(ctx, field, idx, 1);
+        _spt_write_end(ctx);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY,
+                "Names arena reached its limit of %u bytes.",
+                (unsigned)SPT_NAME_ARENA_SIZE);
+        return SPT_INVALID_ID;
     }
+    _spt_index_insert(ctx, field, idx);
+    _spt_write_end(ctx);
 
     ctx->out_error = SPT_SUCCESS;
+    _spt_commit(ctx, _SPT_OP_ADD, field, idx, (spt_entry){0}, 0);
     return idx;
 }
 
+/* Location ID of the entry for the given storage field. */
+static uint32_t
+_spt_entry_location(const spt_entry *e, int field)
+{
+    switch (field) {
+    case SPT_FIELD_BUILDING:    return e->building;
+    case SPT_FIELD_ROOM:        return e->room;
+    case SPT_FIELD_CONTAINER:   return e->container;
+    default:                    return e->subsection;
+    }
+}
+
+/* Sets the location ID of the entry for the given storage field. */
+static void
+_spt_entry_location_set(spt_entry *e, int field, uint32_t location)
+{
+    switch (field) {
+    case SPT_FIELD_BUILDING:    e->building = location; break;
+    case SPT_FIELD_ROOM:        e->room = location; break;
+    case SPT_FIELD_CONTAINER:   e->container = location; break;
+    default:                    e->subsection = location; break;
+    }
+}
+
+/* Location ID stored in the entry slot for the given storage field. */
+static uint32_t
+_spt_slot_location(const spt_context *ctx, uint32_t slot, int field)
+{
+#if SPT_ENTRY_COLUMNS
+    return ctx->entry_locations[field][slot];
+#else
+    return _spt_entry_location(ctx->entries + slot, field);
+#endif
+}
+
+/* Pushes the entry slot, holding quantity units, to the front of the
+ * location's list. */
+static void
+_spt_location_link(spt_context *ctx, int field, uint32_t location, uint32_t slot,
+                   uint32_t quantity)
+{
+    spt_slot *head = &ctx->location_heads[field][location];
+    if (ctx->undo) {
+        _spt_cow(ctx, head, sizeof(*head));
+        _spt_cow(ctx, &ctx->location_counts[field][location], sizeof(spt_slot));
+        _spt_cow(ctx, &ctx->location_quantities[field][location], sizeof(uint64_t));
+        _spt_cow(ctx, &ctx->location_prev[field][slot], sizeof(spt_slot));
+        _spt_cow(ctx, &ctx->location_next[field][slot], sizeof(spt_slot));
+        if (*head) {
+            _spt_cow(ctx, &ctx->location_prev[field][*head - 1], sizeof(spt_slot));
+        }
+    }
+    ctx->location_prev[field][slot] = 0;
+    ctx->location_next[field][slot] = *head;
+    if (*head) {
+        ctx->location_prev[field][*head - 1] = slot + 1;
+    }
+    *head = slot + 1;
+    ++ctx->location_counts[field][location];
+    ctx->location_quantities[field][location] += quantity;
+}
+
+/* Removes the entry slot, holding quantity units, from the location's list. */
+static void
+_spt_location_unlink(spt_context *ctx, int field, uint32_t location, uint32_t slot,
+                     uint32_t quantity)
+{
+    spt_slot next = ctx->location_next[field][slot];
+    spt_slot prev = ctx->location_prev[field][slot];
+    if (ctx->undo) {
+        _spt_cow(ctx, prev ? &ctx->location_next[field][prev - 1] :
+                             &ctx->location_heads[field][location],
+                 sizeof(spt_slot));
+        if (next) {
+            _spt_cow(ctx, &ctx->location_prev[field][next - 1], sizeof(spt_slot));
+        }
+        _spt_cow(ctx, &ctx->location_counts[field][location], sizeof(spt_slot));
+        _spt_cow(ctx, &ctx->location_quantities[field][location], sizeof(uint64_t));
+    }
+    if (prev) {
+        ctx->location_next[field][prev - 1] = next;
+    } else {
+        ctx->location_heads[field][location] = next;
+    }
+    if (next) {
+        ctx->location_prev[field][next - 1] = prev;
+    }
+    --ctx->location_counts[field][location];
+    ctx->location_quantities[field][location] -= quantity;
+}
+
+/* Removes the item's entry (if any) and frees its slot. */
+static int
+_spt_entry_remove(spt_context *ctx, uint32_t item)
+{
+    uint32_t slot = ctx->item_entries[item];
+    if (!slot--) {
+        return 0;
+    }
+
+    if (ctx->history) {
+        _spt_history_record(ctx, _spt_entry_get(ctx, slot),
+                            (spt_entry){.item = item});
+    }
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        _spt_location_unlink(ctx, field, _spt_slot_location(ctx, slot, field),
+                             slot, ctx->item_quantities[item]);
+    }
+    _spt_entry_put(ctx, slot, (spt_entry){0});
+    if (ctx->undo) {
+        _spt_cow(ctx, &ctx->item_quantities[item], sizeof(uint32_t));
+        _spt_cow(ctx, &ctx->item_entries[item], sizeof(spt_slot));
+        _spt_cow(ctx, &ctx->entry_stack[ctx->entry_stack_top], sizeof(spt_slot));
+        _spt_cow(ctx, &ctx->entry_stack_top, sizeof(ctx->entry_stack_top));
+    }
+    ctx->item_quantities[item] = 0;
+    ctx->item_entries[item] = 0;
+    ctx->entry_stack[ctx->entry_stack_top++] = slot;
+    return 1;
+}
+
 spt_entry
-spt_insert(spt_context *ctx, uint32_t item, uint8_t building, uint8_t room,
-           uint8_t container, uint8_t subsec)
+_SPT_API(spt_insert)(spt_context *ctx, uint32_t item, spt_loc_id building,
+                     spt_loc_id room, spt_loc_id container, spt_loc_id subsec)
 {
     _SPT_CHECK_CTX(ctx, (spt_entry){0});
     _SPT_CHECK_ELEM(ctx, SPT_FIELD_ITEM, item, (spt_entry){-1L});
 
+    if (!_spt_live(ctx, SPT_FIELD_ITEM, item)) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE,
+                "Trying to insert an uninit item, id:%u.", item);
+        return (spt_entry){0};
+    }
+
+    if (building >= SPT_MAX_FIELDS || room >= SPT_MAX_FIELDS ||
+        container >= SPT_MAX_FIELDS || subsec >= SPT_MAX_FIELDS) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "Location (%u, %u, %u, %u) out of "
+                "bounds. Range: [0, %d)", building, room, container, subsec,
+                SPT_MAX_FIELDS);
+        return (spt_entry){0};
+    }
+
+    if (!_spt_live(ctx, SPT_FIELD_BUILDING, building) ||
+        !_spt_live(ctx, SPT_FIELD_ROOM, room) ||
+        !_spt_live(ctx, SPT_FIELD_CONTAINER, container) ||
+        !_spt_live(ctx, SPT_FIELD_SUBSECTION, subsec)) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "Trying to insert into an uninit "
+                "location (%u, %u, %u, %u).", building, room, container, subsec);
+        return (spt_entry){0};
+    }
+
+    /* Already stored items are moved, reusing their entry. */
     spt_entry e = {.building = building, .room = room, .container = container,
                    .subsection = subsec, .item = item};
-    int i = 0;
-    for (;i < SPT_MAX_ITEMS && ctx->entries[i].item; ++i);
-    ctx->entries[i] = e;
+    _spt_write_begin(ctx);
+    uint32_t slot = ctx->item_entries[item];
+    if (ctx->history && (slot || ctx->entry_stack_top)) {
+        _spt_history_record(ctx, slot ? _spt_entry_get(ctx, slot - 1) :
+                                        (spt_entry){.item = item}, e);
+    }
+    if (slot) {
+        --slot;
+        for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+            uint32_t from = _spt_slot_location(ctx, slot, field);
+            uint32_t to = _spt_entry_location(&e, field);
+            if (from != to) {
+                _spt_location_unlink(ctx, field, from, slot,
+                                     ctx->item_quantities[item]);
+                _spt_location_link(ctx, field, to, slot,
+                                   ctx->item_quantities[item]);
+            }
+        }
+    } else if (ctx->entry_stack_top) {
+        if (ctx->undo) {
+            _spt_cow(ctx, &ctx->entry_stack_top, sizeof(ctx->entry_stack_top));
+            _spt_cow(ctx, &ctx->item_entries[item], sizeof(spt_slot));
+            _spt_cow(ctx, &ctx->item_quantities[item], sizeof(uint32_t));
+        }
+        slot = ctx->entry_stack[--ctx->entry_stack_top];
+        ctx->item_entries[item] = slot + 1;
+        ctx->item_quantities[item] = 1;
+        for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+            _spt_location_link(ctx, field, _spt_entry_location(&e, field),
+                               slot, 1);
+        }
+    } else {
+        _spt_write_end(ctx);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY,
+                "Entry list reached its limit of %d elements.", SPT_MAX_ITEMS);
+        return (spt_entry){0};
+    }
+
+    _spt_entry_put(ctx, slot, e);
+    _spt_write_end(ctx);
     ctx->out_error = SPT_SUCCESS;
+    _spt_commit(ctx, _SPT_OP_INSERT, SPT_FIELD_ITEM, item, e, 0);
 
     return e;
 }
 
 uint32_t
-spt_extract(spt_context *ctx, spt_entry entry)
+_SPT_API(spt_extract)(spt_context *ctx, spt_entry entry)
 {
     _SPT_CHECK_CTX(ctx, -1);
     _SPT_CHECK_ELEM(ctx, SPT_FIELD_ITEM, entry.item, -1);
 
-    for (int i = 0; i < SPT_MAX_ITEMS; ++i) {
-        if (ctx->entries[i].item == entry.item) {
-            ctx->entries[i].building = SPT_UNSPECIFIED_ID;
-            ctx->entries[i].room = SPT_UNSPECIFIED_ID;
-            ctx->entries[i].container = SPT_UNSPECIFIED_ID;
-            ctx->entries[i].subsection = SPT_UNSPECIFIED_ID;
-            ctx->out_error = SPT_SUCCESS;
-            return entry.item;
-        }
+    _spt_write_begin(ctx);
+    int removed = _spt_entry_remove(ctx, entry.item);
+    _spt_write_end(ctx);
+    if (removed) {
+        ctx->out_error = SPT_SUCCESS;
+        _spt_commit(ctx, _SPT_OP_EXTRACT, SPT_FIELD_ITEM, entry.item, entry, 0);
+        return entry.item;
     }
 
     _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "ItemID: %d.\n"
@@ -151,58 +753,647 @@ spt_extract(spt_context *ctx, spt_entry entry)
 }
 
 void
-spt_rename(spt_context *ctx, int field, uint32_t element, const char *new_name)
+_SPT_API(spt_set_quantity)(spt_context *ctx, uint32_t item, uint32_t quantity)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    _SPT_CHECK_ELEM(ctx, SPT_FIELD_ITEM, item, _SPT_ARG_PH);
+
+    uint32_t slot = ctx->item_entries[item];
+    if (!slot--) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "ItemID: %u.\n"
+                "The specified item is not stored.", item);
+        return;
+    }
+    const uint32_t old = ctx->item_quantities[item];
+    if (quantity == old) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    /* Sums wrap modulo 2^64, adding the difference is exact. */
+    _spt_write_begin(ctx);
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        uint64_t *sum =
+            &ctx->location_quantities[field][_spt_slot_location(ctx, slot, field)];
+        _spt_cow(ctx, sum, sizeof(*sum));
+        *sum += (uint64_t)quantity - old;
+    }
+    _spt_cow(ctx, &ctx->item_quantities[item], sizeof(uint32_t));
+    ctx->item_quantities[item] = quantity;
+    _spt_write_end(ctx);
+    ctx->out_error = SPT_SUCCESS;
+    _spt_commit(ctx, _SPT_OP_QUANTITY, SPT_FIELD_ITEM, item,
+                _spt_entry_get(ctx, slot), quantity);
+}
+
+spt_entry
+_SPT_API(spt_find)(spt_context *ctx, uint32_t item)
+{
+    _SPT_CHECK_CTX(ctx, (spt_entry){0});
+    _SPT_CHECK_ELEM(ctx, SPT_FIELD_ITEM, item, (spt_entry){0});
+
+    uint32_t slot = ctx->item_entries[item];
+    if (!slot) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "ItemID: %u.\n"
+                "The specified item is not stored.", item);
+        return (spt_entry){0};
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    return _spt_entry_get(ctx, slot - 1);
+}
+
+spt_entry
+_SPT_API(spt_get_entry)(spt_context *ctx, uint32_t slot)
+{
+    _SPT_CHECK_CTX(ctx, (spt_entry){0});
+    if (slot >= SPT_MAX_ITEMS) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "Entry slot (%u) out of bounds. "
+                "Range: [0, %d)", slot, SPT_MAX_ITEMS);
+        return (spt_entry){0};
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    return _spt_entry_get(ctx, slot);
+}
+
+uint64_t
+_SPT_API(spt_count)(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    _SPT_CHECK_FIELD(ctx, field, 0);
+    if (element >= _SPT_MAX_IDX(field)) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "Element (%u) out of bounds. "
+                "Range: [0, %d)", element, _SPT_MAX_IDX(field));
+        return 0;
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    return field == SPT_FIELD_ITEM ? ctx->item_quantities[element] :
+                                     ctx->location_quantities[field][element];
+}
+
+void
+_SPT_API(spt_counts)(spt_context *ctx, int field, uint64_t *out)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (field < 0 || field >= SPT_LOCATION_FIELDS || !out) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "Field (%d) is not a storage field or "
+                "the output is NULL.", field);
+        return;
+    }
+
+    memcpy(out, ctx->location_quantities[field],
+           sizeof(ctx->location_quantities[field]));
+    ctx->out_error = SPT_SUCCESS;
+}
+
+/* Index of the first out of bounds location ID of the filter, -1 if every
+ * one is valid. */
+static int
+_spt_query_check(const int *filter)
+{
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        if (filter[field] != SPT_ANY &&
+            (filter[field] < 0 || filter[field] >= SPT_MAX_FIELDS)) {
+            return field;
+        }
+    }
+    return -1;
+}
+
+/* Points the cursor to the shortest list among the specified IDs. */
+static void
+_spt_query_start(spt_cursor *cur)
+{
+    spt_context *ctx = cur->ctx;
+    uint32_t shortest = SPT_MAX_ITEMS;
+    cur->field = SPT_ANY;
+    cur->slot = 1;
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        int id = cur->filter[field];
+        if (id != SPT_ANY && ctx->location_counts[field][id] <= shortest) {
+            shortest = ctx->location_counts[field][id];
+            cur->field = field;
+            cur->slot = ctx->location_heads[field][id];
+        }
+    }
+}
+
+spt_cursor
+_SPT_API(spt_query_location)(spt_context *ctx, int building, int room,
+                             int container, int subsection)
+{
+    spt_cursor cur = {.ctx = ctx, .field = SPT_ANY,
+                      .filter = {building, room, container, subsection}};
+    _SPT_CHECK_CTX(ctx, cur);
+
+    int field = _spt_query_check(cur.filter);
+    if (field >= 0) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "%s (%d) out of bounds. "
+                "Range: [0, %d)", SPT_FIELD_NAMES[field], cur.filter[field],
+                SPT_MAX_FIELDS);
+        return cur;
+    }
+
+    _spt_query_start(&cur);
+    ctx->out_error = SPT_SUCCESS;
+    return cur;
+}
+
+/* spt_cursor_next visiting at most *steps slots if steps is not NULL, so
+ * that readers racing with a writer never follow a cycle forever. Links
+ * out of the table end the walk, they can only be read mid-mutation. */
+static int
+_spt_cursor_advance(spt_cursor *cur, spt_entry *out, uint32_t *steps)
+{
+    spt_context *ctx = cur->ctx;
+
+    while (cur->slot) {
+        if ((steps && !(*steps)--) || cur->slot > SPT_MAX_ITEMS) {
+            cur->slot = 0;
+            return 0;
+        }
+
+        const uint32_t slot = cur->slot - 1;
+        if (cur->field == SPT_ANY) {
+            cur->slot = cur->slot < SPT_MAX_ITEMS ? cur->slot + 1 : 0;
+            if (!_spt_entry_item(ctx, slot)) {
+                continue;
+            }
+        } else {
+            cur->slot = ctx->location_next[cur->field][slot];
+        }
+
+        int match = 1;
+        for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+            match &= cur->filter[field] == SPT_ANY ||
+                     (uint32_t)cur->filter[field] == _spt_slot_location(ctx, slot, field);
+        }
+
+        if (match) {
+            if (out) {
+                *out = _spt_entry_get(ctx, slot);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+_SPT_API(spt_cursor_next)(spt_cursor *cur, spt_entry *out)
+{
+    _SPT_CHECK_CTX(cur, 0);
+#if SPT_STATS
+    /* The budget only measures the visited slots, it is never exhausted. */
+    uint32_t steps = UINT32_MAX;
+    int found = _spt_cursor_advance(cur, out, &steps);
+    _SPT_STAT_PROBES(cur->ctx, UINT32_MAX - steps);
+    return found;
+#else
+    return _spt_cursor_advance(cur, out, NULL);
+#endif
+}
+
+void
+_SPT_API(spt_rename)(spt_context *ctx, int field, uint32_t element,
+                     const char *new_name)
 {
     _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
     _SPT_CHECK_FIELD(ctx, field, _SPT_ARG_PH);
-    spt_name *name = ctx->building_names + field * SPT_MAX_FIELDS;
+    _SPT_CHECK_ELEM(ctx, field, element, _SPT_ARG_PH);
 
     /* Check if field:element is active i.e., created. */
-    if (_spt_empty(name + element)) {
+    if (!_spt_live(ctx, field, element)) {
         _SPT_ERR(ctx, SPT_ERROR_STATE,
                 "Trying to rename an uninit element, field:%d, id:%d, name().",
                 field, element);
         return;
     }
 
-    if (new_name && *new_name) {
-        /* New name has data: copy it into name. */
-        strncpy(name[element].buf, new_name, SPT_NAME_SIZE);
-    } else {
-        /* New name is NULL or empty: set the internal index as ascii. */
-        snprintf(name[element].buf, SPT_NAME_SIZE, "%d", element);
+    /* The index is only touched once the new name is stored. */
+    uint32_t hash = _spt_hash(_spt_name(ctx, field, element));
+    _spt_write_begin(ctx);
+    if (_spt_name_set(ctx, field, element, new_name) != SPT_SUCCESS) {
+        _spt_write_end(ctx);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY,
+                "Names arena reached its limit of %u bytes.",
+                (unsigned)SPT_NAME_ARENA_SIZE);
+        return;
     }
+    _spt_index_remove(ctx, field, element, hash);
+    _spt_index_insert(ctx, field, element);
+    _spt_write_end(ctx);
 
     ctx->out_error = SPT_SUCCESS;
+    _spt_commit(ctx, _SPT_OP_RENAME, field, element, (spt_entry){0}, 0);
+}
+
+/* Check if any entry references the element: the item is stored or the
+ * storage element contains items. */
+static int
+_spt_referenced(spt_context *ctx, int field, uint32_t element)
+{
+    return field == SPT_FIELD_ITEM ? ctx->item_entries[element] != 0 :
+                                     ctx->location_counts[field][element] != 0;
+}
+
+/* Deletes an active element, cascading to the entries that reference it.
+ * Only the entries stored in the element are visited (location index). */
+static void
+_spt_delete(spt_context *ctx, int field, uint32_t element, int mode)
+{
+    if (field == SPT_FIELD_ITEM) {
+        _spt_entry_remove(ctx, element);
+    } else {
+        spt_slot *head = &ctx->location_heads[field][element];
+        while (*head) {
+            uint32_t slot = *head - 1;
+            if (mode == SPT_CASCADE_REHOME) {
+                spt_entry e = _spt_entry_get(ctx, slot);
+                const uint32_t quantity = ctx->item_quantities[e.item];
+                _spt_location_unlink(ctx, field, element, slot, quantity);
+                _spt_entry_location_set(&e, field, SPT_DEFAULT_ID);
+                if (ctx->history) {
+                    _spt_history_record(ctx, _spt_entry_get(ctx, slot), e);
+                }
+                _spt_entry_put(ctx, slot, e);
+                _spt_location_link(ctx, field, SPT_DEFAULT_ID, slot, quantity);
+            } else {
+                _spt_entry_remove(ctx, _spt_entry_item(ctx, slot));
+            }
+        }
+    }
+
+    _spt_index_remove(ctx, field, element,
+                      _spt_hash(_spt_name(ctx, field, element)));
+    _spt_name_release(ctx, _spt_names(ctx, field)[element]);
+    _spt_cow(ctx, _spt_names(ctx, field) + element, sizeof(uint32_t));
+    _spt_cow(ctx, _spt_grams(ctx, field) + element, sizeof(uint64_t));
+    _spt_names(ctx, field)[element] = 0;
+    _spt_grams(ctx, field)[element] = 0;
+    _spt_slot_set(ctx, field, element, 1);
 }
 
 void
 spt_delete(spt_context *ctx, int field, uint32_t element)
+{
+    spt_delete_ex(ctx, field, element, SPT_CASCADE_EXTRACT);
+}
+
+void
+_SPT_API(spt_delete_ex)(spt_context *ctx, int field, uint32_t element,
+                        int mode)
 {
     _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
     _SPT_CHECK_FIELD(ctx, field, _SPT_ARG_PH);
     _SPT_CHECK_ELEM(ctx, field, element, _SPT_ARG_PH);
+    _SPT_CHECK_MODE(ctx, mode, _SPT_ARG_PH);
+
+    if (!_spt_live(ctx, field, element)) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    if (mode == SPT_CASCADE_REFUSE && _spt_referenced(ctx, field, element)) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s %u is still referenced by stored "
+                "entries.", SPT_FIELD_NAMES[field], element);
+        return;
+    }
+
+    _spt_write_begin(ctx);
+    _spt_delete(ctx, field, element, mode);
+    _spt_write_end(ctx);
+    ctx->out_error = SPT_SUCCESS;
+    _spt_commit(ctx, _SPT_OP_DELETE, field, element, (spt_entry){0}, mode);
+}
 
-    spt_name *name = ctx->building_names + field * SPT_MAX_FIELDS;
-    /* TODO: Remove this useless branch. */
-    if (_spt_empty(name + element)) {
+void
+_SPT_API(spt_delete_batch)(spt_context *ctx, int field,
+                           const uint32_t *elements, size_t count, int mode)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    _SPT_CHECK_FIELD(ctx, field, _SPT_ARG_PH);
+    _SPT_CHECK_MODE(ctx, mode, _SPT_ARG_PH);
+
+    /* Validate everything first so that the batch is all or nothing. */
+    for (size_t i = 0; i < count; ++i) {
+        _SPT_CHECK_ELEM(ctx, field, elements[i], _SPT_ARG_PH);
+        if (mode == SPT_CASCADE_REFUSE && _spt_live(ctx, field, elements[i]) &&
+            _spt_referenced(ctx, field, elements[i])) {
+            _SPT_ERR(ctx, SPT_ERROR_STATE, "%s %u is still referenced by "
+                    "stored entries, nothing was deleted.",
+                    SPT_FIELD_NAMES[field], elements[i]);
+            return;
+        }
+    }
+
+    /* The batch deletes the first occurrence of every live element. The
+     * bitmap is on the heap, it grows with SPT_MAX_ITEMS. */
+    uint64_t *doomed = calloc(_SPT_BATCH_WORDS, sizeof(uint64_t));
+    if (!doomed) {
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "%s", "Could not allocate a delete batch.");
+        return;
+    }
+    size_t last = count;
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t e = elements[i];
+        if (_spt_live(ctx, field, e) && !(doomed[e / 64] & (1ULL << (e % 64)))) {
+            doomed[e / 64] |= 1ULL << (e % 64);
+            last = i;
+        }
+    }
+    if (last == count) {
+        free(doomed);
         ctx->out_error = SPT_NOOP;
         return;
     }
 
-    spt_name_release(name + element);
+    /* A single write section, concurrent readers see all of the batch or
+     * none of it. */
+    _spt_write_begin(ctx);
+    for (size_t i = 0; i <= last; ++i) {
+        if (_spt_live(ctx, field, elements[i])) {
+            _spt_delete(ctx, field, elements[i], mode);
+        }
+    }
+    _spt_write_end(ctx);
+
+    /* One record per element, all but the last one flagged so that a replay
+     * applies the group whole or not at all (see: _SPT_OP_MORE). */
+    int err = SPT_SUCCESS;
+    for (size_t i = 0; i <= last; ++i) {
+        const uint32_t e = elements[i];
+        if (!(doomed[e / 64] & (1ULL << (e % 64)))) {
+            continue;
+        }
+        doomed[e / 64] &= ~(1ULL << (e % 64));
+        ctx->out_error = SPT_SUCCESS;
+        _spt_commit(ctx, _SPT_OP_DELETE, field, e, (spt_entry){0},
+                    mode | (i < last ? _SPT_OP_MORE : 0));
+        if (ctx->out_error != SPT_SUCCESS) {
+            err = ctx->out_error;
+        }
+    }
+    free(doomed);
+    ctx->out_error = err;
+}
+
+uint32_t
+_SPT_API(spt_next)(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_CHECK_CTX(ctx, SPT_INVALID_ID);
+    _SPT_CHECK_FIELD(ctx, field, SPT_INVALID_ID);
+
+    const uint32_t maxidx = _SPT_MAX_IDX(field);
+    const uint64_t *free = _spt_free(ctx, field);
     ctx->out_error = SPT_SUCCESS;
+    uint32_t id = element + 1;
+    if (id >= maxidx) {
+        return SPT_INVALID_ID;
+    }
 
-    /* TODO: entries pass extracting the ones who reference the deleted elem */
+    /* Live IDs are the clear bits, skip whole words of free ones. */
+    uint64_t live = ~free[id / 64] & (~0ULL << (id % 64));
+    for (uint32_t word = id / 64; ; live = ~free[word]) {
+        if (live) {
+            id = word * 64 + _spt_ffs(live);
+            return id < maxidx ? id : SPT_INVALID_ID;
+        }
+        if (++word * 64 >= maxidx) {
+            return SPT_INVALID_ID;
+        }
+    }
+}
+
+/* Lowest ID with the given name, SPT_INVALID_ID if there is none. Keeps
+ * probing until the end of the cluster in order to return the lowest ID
+ * when names are duplicated, never more than the whole table. The number of
+ * probed slots is stored in probes. Index slots and name handles are range
+ * checked, spt_get_id_r may read them in the middle of a mutation. */
+static uint32_t
+_spt_lookup(spt_context *ctx, int field, const char *name, uint32_t *probes)
+{
+    spt_slot *index = _spt_index(ctx, field);
+    const uint32_t *names = _spt_names(ctx, field);
+    const uint32_t mask = _spt_index_mask(field);
+    const uint32_t capacity = _SPT_MAX_IDX(field);
+    uint32_t id = SPT_INVALID_ID;
+    uint32_t i = _spt_hash(name) & mask;
+    uint32_t n = 0;
+    for (; n <= mask && index[i]; ++n, i = (i + 1) & mask) {
+        uint32_t elem = index[i] - 1;
+        if (elem < id && elem < capacity &&
+            names[elem] < SPT_NAME_ARENA_SIZE - _SPT_REC_HEAD &&
+            !strncmp(_spt_name(ctx, field, elem), name, SPT_NAME_SIZE - 1)) {
+            id = elem;
+        }
+    }
+    *probes = n;
+    return id;
 }
 
 uint32_t
-spt_get_id(spt_context *ctx, int field, const char *name)
+_SPT_API(spt_get_id)(spt_context *ctx, int field, const char *name)
 {
     _SPT_CHECK_CTX(ctx, -1);
     _SPT_CHECK_FIELD(ctx, field, -1);
 
-    spt_name *it = ctx->building_names + field * SPT_MAX_FIELDS;
-    for (; strncmp((char*)it, name, SPT_NAME_SIZE); ++it);
-    return it - (ctx->building_names + field * SPT_MAX_FIELDS);
+    if (!name) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "%s name is NULL.",
+                SPT_FIELD_NAMES[field]);
+        return SPT_INVALID_ID;
+    }
+
+    uint32_t probes;
+    uint32_t id = _spt_lookup(ctx, field, name, &probes);
+    _SPT_STAT_PROBES(ctx, probes);
+    if (id == SPT_INVALID_ID) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "%s name: %.*s.\n"
+                "There is no element with the specified name.",
+                SPT_FIELD_NAMES[field], SPT_NAME_SIZE - 1, name);
+        return SPT_INVALID_ID;
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    return id;
+}
+
+const char *
+_SPT_API(spt_get_name)(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_CHECK_CTX(ctx, "");
+    _SPT_CHECK_FIELD(ctx, field, "");
+
+    if (!_spt_live(ctx, field, element)) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s %u is not active.",
+                SPT_FIELD_NAMES[field], element);
+        return "";
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    return _spt_name(ctx, field, element);
+}
+
+void
+_SPT_API(spt_compact_names)(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+
+    _spt_write_begin(ctx);
+    int err = _spt_names_compact(ctx);
+    _spt_write_end(ctx);
+    if (err == SPT_ERROR_MEMORY) {
+        _SPT_ERR(ctx, err, "Could not allocate %u bytes for compacting the "
+                "names arena.", ctx->arena_used);
+        return;
+    }
+    ctx->out_error = err;
+}
+
+
+/*
+ * Concurrent readers. Nothing is written to the context: the reads are
+ * repeated until they did not overlap a mutation (see: _spt_read_begin).
+ * Data read in the middle of a mutation can be inconsistent, so every loop
+ * is bounded and every index checked before being used.
+ * The helpers take non-const contexts, but they only read.
+ */
+
+/* Stores the error code if the caller asked for it. */
+static void
+_spt_set_error(int *out_error, int err)
+{
+    if (out_error) {
+        *out_error = err;
+    }
+}
+
+/* Starts a read attempt, the call fails with SPT_ERROR_TIMEOUT if the
+ * writer does not end its mutation (see: _spt_read_begin). */
+#define _SPT_READ_BEGIN(CTX, SEQ, OUT_ERROR, RET) do {                      \
+    if (_spt_read_begin((CTX), &(SEQ))) {                                   \
+        _spt_set_error((OUT_ERROR), SPT_ERROR_TIMEOUT);                     \
+        return RET;                                                         \
+    }} while (0)
+
+uint32_t
+spt_get_id_r(const spt_context *ctx, int field, const char *name, int *out_error)
+{
+    if (!ctx || field < 0 || field >= SPT_FIELD_COUNT || !name) {
+        _spt_set_error(out_error, !ctx ? SPT_ERROR_CTX :
+                       !name ? SPT_ERROR_NOT_FOUND : SPT_ERROR_BOUNDS);
+        return SPT_INVALID_ID;
+    }
+
+    uint32_t id, seq, probes;
+    do {
+        _SPT_READ_BEGIN(ctx, seq, out_error, SPT_INVALID_ID);
+        id = _spt_lookup((spt_context *)ctx, field, name, &probes);
+    } while (_spt_read_retry(ctx, seq));
+
+    _spt_set_error(out_error, id == SPT_INVALID_ID ? SPT_ERROR_NOT_FOUND :
+                                                     SPT_SUCCESS);
+    return id;
+}
+
+size_t
+spt_get_name_r(const spt_context *ctx, int field, uint32_t element, char *buf,
+               size_t size, int *out_error)
+{
+    if (!ctx || field < 0 || field >= SPT_FIELD_COUNT || !buf || !size) {
+        _spt_set_error(out_error, !ctx ? SPT_ERROR_CTX : SPT_ERROR_BOUNDS);
+        return 0;
+    }
+
+    size_t len;
+    uint32_t seq;
+    buf[0] = '\0';
+    do {
+        _SPT_READ_BEGIN(ctx, seq, out_error, 0);
+        spt_context *c = (spt_context *)ctx;
+        uint32_t handle = _spt_live(c, field, element) ?
+                          _spt_names(c, field)[element] : 0;
+        len = 0;
+        if (handle && handle < SPT_NAME_ARENA_SIZE - _SPT_REC_HEAD) {
+            len = (unsigned char)ctx->names_arena[handle + 2];
+            len = len < size - 1 ? len : size - 1;
+            len = len < SPT_NAME_ARENA_SIZE - _SPT_REC_HEAD - handle ?
+                  len : SPT_NAME_ARENA_SIZE - _SPT_REC_HEAD - handle;
+            memcpy(buf, ctx->names_arena + handle + _SPT_REC_HEAD, len);
+        }
+        buf[len] = '\0';
+    } while (_spt_read_retry(ctx, seq));
+
+    _spt_set_error(out_error, len ? SPT_SUCCESS : SPT_ERROR_STATE);
+    return len;
+}
+
+spt_entry
+spt_find_r(const spt_context *ctx, uint32_t item, int *out_error)
+{
+    if (!ctx || item <= SPT_DEFAULT_ID || item >= SPT_MAX_ITEMS) {
+        _spt_set_error(out_error, !ctx ? SPT_ERROR_CTX : SPT_ERROR_BOUNDS);
+        return (spt_entry){0};
+    }
+
+    spt_entry e;
+    uint32_t seq;
+    do {
+        _SPT_READ_BEGIN(ctx, seq, out_error, (spt_entry){0});
+        uint32_t slot = ctx->item_entries[item];
+        e = slot && slot <= SPT_MAX_ITEMS ? _spt_entry_get(ctx, slot - 1) :
+                                            (spt_entry){0};
+    } while (_spt_read_retry(ctx, seq));
+
+    _spt_set_error(out_error, e.item ? SPT_SUCCESS : SPT_ERROR_NOT_FOUND);
+    return e;
+}
+
+size_t
+spt_query_location_r(const spt_context *ctx, int building, int room,
+                     int container, int subsection, spt_entry *out,
+                     size_t max, int *out_error)
+{
+    spt_cursor cur = {.ctx = (spt_context *)ctx,
+                      .filter = {building, room, container, subsection}};
+    if (!ctx || _spt_query_check(cur.filter) >= 0) {
+        _spt_set_error(out_error, !ctx ? SPT_ERROR_CTX : SPT_ERROR_BOUNDS);
+        return 0;
+    }
+
+    size_t n;
+    uint32_t seq;
+    do {
+        _SPT_READ_BEGIN(ctx, seq, out_error, 0);
+        _spt_query_start(&cur);
+        uint32_t steps = SPT_MAX_ITEMS;
+        spt_entry e;
+        for (n = 0; _spt_cursor_advance(&cur, &e, &steps); ++n) {
+            if (out && n < max) {
+                out[n] = e;
+            }
+        }
+    } while (_spt_read_retry(ctx, seq));
+
+    _spt_set_error(out_error, SPT_SUCCESS);
+    return n;
+}
+
+void
+spt_counts_r(const spt_context *ctx, int field, uint64_t *out, int *out_error)
+{
+    if (!ctx || field < 0 || field >= SPT_LOCATION_FIELDS || !out) {
+        _spt_set_error(out_error, !ctx ? SPT_ERROR_CTX : SPT_ERROR_BOUNDS);
+        return;
+    }
+
+    uint32_t seq;
+    do {
+        _SPT_READ_BEGIN(ctx, seq, out_error, _SPT_ARG_PH);
+        memcpy(out, ctx->location_quantities[field],
+               sizeof(ctx->location_quantities[field]));
+    } while (_spt_read_retry(ctx, seq));
+    _spt_set_error(out_error, SPT_SUCCESS);
 }
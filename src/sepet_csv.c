@@ -0,0 +1,409 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* Columns of a row, indexed by enum spt_fields. */
+static const char *const _SPT_CSV_COLUMNS[SPT_FIELD_COUNT] = {
+    "building", "room", "container", "subsection", "item"
+};
+
+/* Incremental CSV parser, fed with chunks of any size. */
+typedef struct _spt_csv_reader {
+    char        fields[SPT_FIELD_COUNT][SPT_NAME_SIZE];
+    uint32_t    len[SPT_FIELD_COUNT];
+    int         nfields;            /* Columns of the current row so far. */
+    int         quoted;             /* Inside a quoted column. */
+    int         quote;              /* Quote seen inside a quoted column: escape or closing quote. */
+    int         blank;              /* Nothing but line terminators in the current row. */
+    int         first;              /* Next row is the first one (maybe a header). */
+    size_t      line;               /* Current line, 1-based. */
+    size_t      row_line;           /* Line where the current row started. */
+
+    /* Names and IDs of the previous row's locations, lengths of
+     * SPT_NAME_SIZE mean none. */
+    char        cache[SPT_LOCATION_FIELDS][SPT_NAME_SIZE];
+    uint32_t    cache_len[SPT_LOCATION_FIELDS];
+    uint32_t    cache_id[SPT_LOCATION_FIELDS];
+
+    ErrCb       err_callback;       /* User callback, disabled in ctx while importing. */
+    spt_csv_result res;
+} _spt_csv_reader;
+
+static void
+_spt_csv_begin(spt_context *ctx, _spt_csv_reader *rd)
+{
+    rd->nfields = 0;
+    rd->quoted = rd->quote = 0;
+    rd->blank = rd->first = 1;
+    rd->line = rd->row_line = 1;
+    memset(rd->len, 0, sizeof(rd->len));
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        rd->cache_len[field] = SPT_NAME_SIZE;
+    }
+    rd->res = (spt_csv_result){0};
+
+    /* Failed calls are reported once, as rejected rows (see: _spt_csv_reject). */
+    rd->err_callback = ctx->err_callback;
+    ctx->err_callback = NULL;
+}
+
+/* Reports the rejected row with err as code, prefixing the message of the
+ * failed call (if any) with the line. */
+static void
+_spt_csv_reject(spt_context *ctx, _spt_csv_reader *rd, int err, const char *why)
+{
+    char msg[SPT_MSG_SIZE];
+    /* The prefix takes at most 32 bytes, the rest of the message is cut. */
+    snprintf(msg, sizeof(msg), "CSV line %zu: %.*s", rd->row_line,
+             (int)sizeof(msg) - 32, why ? why : ctx->out_err_msg);
+    memcpy(ctx->out_err_msg, msg, sizeof(msg));
+    ctx->out_error = err;
+    if (rd->err_callback) {
+        rd->err_callback(ctx->usr_data, err, ctx->out_err_msg);
+    }
+
+    if (!rd->res.rejected++) {
+        rd->res.first_error_line = rd->row_line;
+    }
+}
+
+/* Location ID of the name, added if missing. Returns SPT_INVALID_ID on error. */
+static uint32_t
+_spt_csv_location(spt_context *ctx, _spt_csv_reader *rd, int field)
+{
+    const char *name = rd->fields[field];
+    const uint32_t len = rd->len[field];
+    if (!len) {
+        return SPT_DEFAULT_ID;
+    }
+    if (rd->cache_len[field] == len && !memcmp(rd->cache[field], name, len)) {
+        return rd->cache_id[field];
+    }
+
+    uint32_t id = spt_get_id(ctx, field, name);
+    if (id == SPT_INVALID_ID && ctx->out_error == SPT_ERROR_NOT_FOUND) {
+        id = spt_add(ctx, field, name);
+    }
+    if (id == SPT_INVALID_ID) {
+        return SPT_INVALID_ID;
+    }
+
+    memcpy(rd->cache[field], name, len);
+    rd->cache_len[field] = len;
+    rd->cache_id[field] = id;
+    return id;
+}
+
+/* Stores the parsed row. */
+static void
+_spt_csv_row(spt_context *ctx, _spt_csv_reader *rd)
+{
+    for (int field = 0; field <= rd->nfields && field < SPT_FIELD_COUNT; ++field) {
+        rd->fields[field][rd->len[field]] = '\0';
+    }
+
+    if (rd->first) {
+        rd->first = 0;
+        int header = rd->nfields == SPT_FIELD_COUNT - 1;
+        for (int field = 0; header && field < SPT_FIELD_COUNT; ++field) {
+            header = !strcasecmp(rd->fields[field], _SPT_CSV_COLUMNS[field]);
+        }
+        if (header) {
+            return;
+        }
+    }
+
+    ++rd->res.rows;
+    if (rd->nfields != SPT_FIELD_COUNT - 1) {
+        char why[64];
+        snprintf(why, sizeof(why), "%d columns, expected %d.",
+                 rd->nfields + 1, SPT_FIELD_COUNT);
+        _spt_csv_reject(ctx, rd, SPT_ERROR_FORMAT, why);
+        return;
+    }
+
+    uint32_t loc[SPT_LOCATION_FIELDS];
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        if ((loc[field] = _spt_csv_location(ctx, rd, field)) == SPT_INVALID_ID) {
+            _spt_csv_reject(ctx, rd, ctx->out_error, NULL);
+            return;
+        }
+    }
+
+    uint32_t item = spt_add(ctx, SPT_FIELD_ITEM, rd->fields[SPT_FIELD_ITEM]);
+    if (item == SPT_INVALID_ID) {
+        _spt_csv_reject(ctx, rd, ctx->out_error, NULL);
+        return;
+    }
+
+    spt_insert(ctx, item, loc[SPT_FIELD_BUILDING], loc[SPT_FIELD_ROOM],
+               loc[SPT_FIELD_CONTAINER], loc[SPT_FIELD_SUBSECTION]);
+    if (ctx->out_error != SPT_SUCCESS) {
+        int err = ctx->out_error;
+        char why[SPT_MSG_SIZE];
+        memcpy(why, ctx->out_err_msg, sizeof(why));
+        spt_delete(ctx, SPT_FIELD_ITEM, item);
+        _spt_csv_reject(ctx, rd, err, why);
+        return;
+    }
+    ++rd->res.imported;
+}
+
+/* Ends the current row (if not blank) and starts the next one. */
+static void
+_spt_csv_row_end(spt_context *ctx, _spt_csv_reader *rd)
+{
+    if (!rd->blank) {
+        _spt_csv_row(ctx, rd);
+    }
+    rd->nfields = 0;
+    rd->quoted = rd->quote = 0;
+    rd->blank = 1;
+    memset(rd->len, 0, sizeof(rd->len));
+    rd->row_line = rd->line;
+}
+
+static void
+_spt_csv_feed(spt_context *ctx, _spt_csv_reader *rd, const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        const char c = data[i];
+        if (rd->quoted) {
+            if (rd->quote) {
+                /* "" is an escaped quote, anything else follows the
+                 * closing quote. */
+                rd->quote = 0;
+                if (c != '"') {
+                    rd->quoted = 0;
+                    goto unquoted;
+                }
+            } else if (c == '"') {
+                rd->quote = 1;
+                continue;
+            }
+            rd->line += c == '\n';
+            goto append;
+        }
+
+unquoted:
+        if (c == '\n') {
+            ++rd->line;
+            _spt_csv_row_end(ctx, rd);
+            continue;
+        }
+        if (c == '\r') {
+            continue;
+        }
+        rd->blank = 0;
+        if (c == ',') {
+            ++rd->nfields;
+            continue;
+        }
+        if (c == '"' && rd->nfields < SPT_FIELD_COUNT && !rd->len[rd->nfields]) {
+            rd->quoted = 1;
+            continue;
+        }
+
+append:
+        rd->blank = 0;
+        /* Extra columns are only counted, long names truncated. */
+        if (rd->nfields < SPT_FIELD_COUNT &&
+            rd->len[rd->nfields] < SPT_NAME_SIZE - 1) {
+            rd->fields[rd->nfields][rd->len[rd->nfields]++] = c;
+        }
+    }
+}
+
+/* Stores the last row and restores the error callback. */
+static size_t
+_spt_csv_end(spt_context *ctx, _spt_csv_reader *rd, spt_csv_result *out)
+{
+    if (rd->quoted && !rd->quote) {
+        rd->first = 0;
+        ++rd->res.rows;
+        _spt_csv_reject(ctx, rd, SPT_ERROR_FORMAT, "Unterminated quote.");
+    } else {
+        _spt_csv_row_end(ctx, rd);
+    }
+
+    ctx->err_callback = rd->err_callback;
+    if (out) {
+        *out = rd->res;
+    }
+    if (rd->res.rejected) {
+        ctx->out_error = SPT_ERROR_FORMAT;
+        snprintf(ctx->out_err_msg, SPT_MSG_SIZE, "%zu of %zu CSV rows "
+                 "rejected, the first one at line %zu.", rd->res.rejected,
+                 rd->res.rows, rd->res.first_error_line);
+    } else {
+        ctx->out_error = SPT_SUCCESS;
+    }
+    return rd->res.imported;
+}
+
+size_t
+_SPT_API(spt_import_csv)(spt_context *ctx, const char *buf, size_t size,
+                         spt_csv_result *out)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    if (!buf && size) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "CSV buffer is NULL.");
+        return 0;
+    }
+
+    _spt_csv_reader rd;
+    _spt_csv_begin(ctx, &rd);
+    _spt_csv_feed(ctx, &rd, buf, size);
+    return _spt_csv_end(ctx, &rd, out);
+}
+
+size_t
+_SPT_API(spt_import_csv_fd)(spt_context *ctx, int fd, spt_csv_result *out)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+
+    _spt_csv_reader rd;
+    char chunk[SPT_CSV_CHUNK];
+    _spt_csv_begin(ctx, &rd);
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int err = errno;
+            size_t imported = _spt_csv_end(ctx, &rd, out);
+            _SPT_ERR(ctx, SPT_ERROR_IO, "CSV read failed after line %zu: %s.",
+                    rd.line, strerror(err));
+            return imported;
+        }
+        if (!n) {
+            break;
+        }
+        _spt_csv_feed(ctx, &rd, chunk, n);
+    }
+    return _spt_csv_end(ctx, &rd, out);
+}
+
+/* CSV output to a buffer or, through a chunk, to a file descriptor. */
+typedef struct _spt_csv_writer {
+    char       *buf;
+    size_t      size;               /* Capacity of buf. */
+    size_t      used;               /* Bytes in buf. */
+    size_t      total;              /* Bytes of the whole export. */
+    int         fd;                 /* -1 for buffer output. */
+    int         error;              /* errno of a failed write, 0 if none. */
+} _spt_csv_writer;
+
+static void
+_spt_csv_flush(_spt_csv_writer *w)
+{
+    if (w->used && !w->error && _spt_write_all(w->fd, w->buf, w->used)) {
+        w->error = errno;
+    }
+    w->used = 0;
+}
+
+static void
+_spt_csv_put(_spt_csv_writer *w, const char *data, size_t n)
+{
+    w->total += n;
+    while (n) {
+        if (w->used == w->size) {
+            if (w->fd < 0) {
+                return;
+            }
+            _spt_csv_flush(w);
+        }
+        size_t part = n < w->size - w->used ? n : w->size - w->used;
+        memcpy(w->buf + w->used, data, part);
+        w->used += part;
+        data += part;
+        n -= part;
+    }
+}
+
+/* Writes a name, quoted if it has separators, quotes or line breaks. */
+static void
+_spt_csv_put_name(_spt_csv_writer *w, const char *name, size_t len)
+{
+    if (!memchr(name, ',', len) && !memchr(name, '"', len) &&
+        !memchr(name, '\n', len) && !memchr(name, '\r', len)) {
+        _spt_csv_put(w, name, len);
+        return;
+    }
+
+    _spt_csv_put(w, "\"", 1);
+    for (const char *q; (q = memchr(name, '"', len)); ) {
+        _spt_csv_put(w, name, q - name + 1);
+        _spt_csv_put(w, "\"", 1);
+        len -= q - name + 1;
+        name = q + 1;
+    }
+    _spt_csv_put(w, name, len);
+    _spt_csv_put(w, "\"", 1);
+}
+
+/* Writes the header and every entry, returns the number of entries. */
+static size_t
+_spt_csv_write(const spt_context *ctx, _spt_csv_writer *w)
+{
+    static const char header[] = "building,room,container,subsection,item\n";
+    _spt_csv_put(w, header, sizeof(header) - 1);
+
+    size_t rows = 0;
+    for (uint32_t slot = 0; slot < SPT_MAX_ITEMS; ++slot) {
+        spt_entry e = _spt_entry_get(ctx, slot);
+        if (!e.item) {
+            continue;
+        }
+
+        const uint32_t ids[SPT_FIELD_COUNT] = {e.building, e.room, e.container,
+                                               e.subsection, e.item};
+        for (int field = 0; field < SPT_FIELD_COUNT; ++field) {
+            /* The name arrays of the fields are contiguous. */
+            const uint32_t *names = ctx->building_names + field * SPT_MAX_FIELDS;
+            uint32_t handle = names[ids[field]];
+            _spt_csv_put_name(w, ctx->names_arena + handle + _SPT_REC_HEAD,
+                              (unsigned char)ctx->names_arena[handle + 2]);
+            _spt_csv_put(w, field == SPT_FIELD_ITEM ? "\n" : ",", 1);
+        }
+        ++rows;
+    }
+    return rows;
+}
+
+size_t
+_SPT_API(spt_export_csv)(spt_context *ctx, char *buf, size_t size)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    _spt_csv_writer w = {.buf = buf, .size = buf ? size : 0, .fd = -1};
+    _spt_csv_write(ctx, &w);
+    if (buf && w.total > size) {
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "The CSV export takes %zu bytes, the "
+                "buffer has %zu.", w.total, size);
+        return w.total;
+    }
+    ctx->out_error = SPT_SUCCESS;
+    return w.total;
+}
+
+size_t
+_SPT_API(spt_export_csv_fd)(spt_context *ctx, int fd)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    char chunk[SPT_CSV_CHUNK];
+    _spt_csv_writer w = {.buf = chunk, .size = sizeof(chunk), .fd = fd};
+    size_t rows = _spt_csv_write(ctx, &w);
+    _spt_csv_flush(&w);
+    if (w.error) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "CSV write failed: %s.", strerror(w.error));
+        return 0;
+    }
+    ctx->out_error = SPT_SUCCESS;
+    return rows;
+}
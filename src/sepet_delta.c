@@ -0,0 +1,460 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Longest record: operation byte, varint element, name length and name. */
+#define _SPT_DELTA_RECORD_MAX (1 + 5 + 1 + SPT_NAME_SIZE)
+
+/* Change log: the records of versions (base, base + count], oldest first,
+ * in a byte ring. Records are stored in their delta encoding, so exporting
+ * them is a copy. */
+struct spt_changelog {
+    uint8_t    *ring;
+    size_t      capacity;
+    uint64_t    head;               /* Position of the oldest record, ring offset modulo capacity. */
+    uint64_t    tail;               /* Position after the newest record. */
+    uint64_t    base;               /* Context version before the oldest record. */
+    uint64_t    base_chain;         /* Context chain at base. */
+    uint64_t    count;              /* Number of records. */
+};
+
+/* Decoded delta record. */
+typedef struct _spt_delta_op {
+    int         op;                 /* enum _spt_ops. */
+    int         field;
+    uint32_t    arg;
+    uint32_t    element;
+    spt_entry   entry;
+    char        name[SPT_NAME_SIZE];
+} _spt_delta_op;
+
+static const char _spt_delta_magic[4] = {'S', 'P', 'T', 'D'};
+
+static uint32_t
+_spt_delta_checksum(const uint8_t *data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+uint64_t
+_spt_chain_step(uint64_t chain, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; ++i) {
+        chain = (chain ^ p[i]) * 1099511628211ULL;
+    }
+    return chain;
+}
+
+/* LEB128: 7 bits per byte, lowest first, high bit set if more follow. */
+static uint8_t *
+_spt_varint_put(uint8_t *p, uint32_t v)
+{
+    for (; v >= 0x80; v >>= 7) {
+        *p++ = (uint8_t)(v | 0x80);
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Returns the position after the varint, NULL if it is truncated. */
+static const uint8_t *
+_spt_varint_get(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Encodes a mutation (see: _spt_journal_append) after its operation and
+ * field byte: element and name of additions and renames, item and location
+ * of insertions, item of extractions, element and mode of deletions, item
+ * and quantity of quantity changes. Returns the record size. */
+static size_t
+_spt_delta_encode(uint8_t *buf, int op, int field, uint32_t element,
+                  spt_entry entry, const char *name, uint32_t arg)
+{
+    uint8_t *p = buf;
+    *p++ = (uint8_t)(op | field << 4);
+    switch (op) {
+    case _SPT_OP_ADD:
+    case _SPT_OP_RENAME: {
+        size_t len = name ? strnlen(name, SPT_NAME_SIZE - 1) : 0;
+        p = _spt_varint_put(p, element);
+        *p++ = (uint8_t)len;
+        if (len) {
+            memcpy(p, name, len);
+            p += len;
+        }
+        break;
+    }
+    case _SPT_OP_INSERT:
+        p = _spt_varint_put(p, entry.item);
+        p = _spt_varint_put(p, entry.building);
+        p = _spt_varint_put(p, entry.room);
+        p = _spt_varint_put(p, entry.container);
+        p = _spt_varint_put(p, entry.subsection);
+        break;
+    case _SPT_OP_EXTRACT:
+        p = _spt_varint_put(p, entry.item);
+        break;
+    case _SPT_OP_QUANTITY:
+        p = _spt_varint_put(p, element);
+        p = _spt_varint_put(p, arg);
+        break;
+    default:
+        p = _spt_varint_put(p, element);
+        *p++ = (uint8_t)arg;
+        break;
+    }
+    return p - buf;
+}
+
+/* Decodes the record at p, returns the position after it or NULL if it is
+ * truncated or invalid. */
+static const uint8_t *
+_spt_delta_decode(const uint8_t *p, const uint8_t *end, _spt_delta_op *out)
+{
+    if (p >= end) {
+        return NULL;
+    }
+
+    *out = (_spt_delta_op){.op = *p & 0x0F, .field = *p >> 4};
+    ++p;
+    if (out->field >= SPT_FIELD_COUNT) {
+        return NULL;
+    }
+
+    uint32_t v[5];
+    switch (out->op) {
+    case _SPT_OP_ADD:
+    case _SPT_OP_RENAME:
+        if (!(p = _spt_varint_get(p, end, &out->element)) || p >= end ||
+            end - p - 1 < *p) {
+            return NULL;
+        }
+        memcpy(out->name, p + 1, *p);
+        out->name[*p] = '\0';
+        return p + 1 + *p;
+    case _SPT_OP_INSERT:
+        for (int i = 0; i < 5; ++i) {
+            if (!(p = _spt_varint_get(p, end, v + i)) ||
+                (i && v[i] > (spt_loc_id)~0U)) {
+                return NULL;
+            }
+        }
+        out->entry = (spt_entry){.item = v[0], .building = v[1], .room = v[2],
+                                 .container = v[3], .subsection = v[4]};
+        return p;
+    case _SPT_OP_EXTRACT:
+        if (!(p = _spt_varint_get(p, end, &out->entry.item))) {
+            return NULL;
+        }
+        return p;
+    case _SPT_OP_DELETE:
+        if (!(p = _spt_varint_get(p, end, &out->element)) || p >= end) {
+            return NULL;
+        }
+        out->arg = *p;
+        return p + 1;
+    case _SPT_OP_QUANTITY:
+        if (!(p = _spt_varint_get(p, end, &out->element)) ||
+            !(p = _spt_varint_get(p, end, v))) {
+            return NULL;
+        }
+        out->arg = v[0];
+        return p;
+    default:
+        return NULL;
+    }
+}
+
+/* Copies n bytes of the ring from position pos. */
+static void
+_spt_ring_read(const struct spt_changelog *log, uint64_t pos, uint8_t *dst,
+               size_t n)
+{
+    size_t at = pos % log->capacity;
+    size_t first = n < log->capacity - at ? n : log->capacity - at;
+    memcpy(dst, log->ring + at, first);
+    memcpy(dst + first, log->ring, n - first);
+}
+
+static void
+_spt_ring_write(struct spt_changelog *log, uint64_t pos, const uint8_t *src,
+                size_t n)
+{
+    size_t at = pos % log->capacity;
+    size_t first = n < log->capacity - at ? n : log->capacity - at;
+    memcpy(log->ring + at, src, first);
+    memcpy(log->ring, src + first, n - first);
+}
+
+/* Size of the record at position pos of the ring, chained into chain. */
+static size_t
+_spt_ring_record_size(const struct spt_changelog *log, uint64_t pos,
+                      uint64_t *chain)
+{
+    uint8_t buf[_SPT_DELTA_RECORD_MAX];
+    size_t n = log->tail - pos < sizeof(buf) ? log->tail - pos : sizeof(buf);
+    _spt_ring_read(log, pos, buf, n);
+    _spt_delta_op op;
+    n = _spt_delta_decode(buf, buf + n, &op) - buf;
+    *chain = _spt_chain_step(*chain, buf, n);
+    return n;
+}
+
+void
+_spt_changelog_reset(spt_context *ctx)
+{
+    struct spt_changelog *log = ctx->changelog;
+    log->head = log->tail;
+    log->base = ctx->version;
+    log->base_chain = ctx->chain;
+    log->count = 0;
+}
+
+void
+_spt_delta_record(spt_context *ctx, int op, int field, uint32_t element,
+                  spt_entry entry, const char *name, uint32_t arg)
+{
+    uint8_t buf[_SPT_DELTA_RECORD_MAX];
+    size_t n = _spt_delta_encode(buf, op, field, element, entry, name, arg);
+    const uint64_t chain = ctx->chain;
+    ctx->chain = _spt_chain_step(chain, buf, n);
+
+    struct spt_changelog *log = ctx->changelog;
+    if (!log) {
+        return;
+    }
+
+    /* Records have to follow each other, the version is the one produced
+     * by this record. */
+    if (log->base + log->count + 1 != ctx->version) {
+        log->head = log->tail;
+        log->base = ctx->version - 1;
+        log->base_chain = chain;
+        log->count = 0;
+    }
+
+    /* Drop the oldest records until it fits (capacity >= any record). */
+    while (log->tail - log->head + n > log->capacity) {
+        log->head += _spt_ring_record_size(log, log->head, &log->base_chain);
+        ++log->base;
+        --log->count;
+    }
+
+    _spt_ring_write(log, log->tail, buf, n);
+    log->tail += n;
+    ++log->count;
+}
+
+void
+spt_changelog_open(spt_context *ctx, size_t capacity)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (ctx->changelog) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The context already has an open change log.");
+        return;
+    }
+
+    /* Bounded by the 32-bit size of delta headers. */
+    capacity = capacity ? capacity : SPT_CHANGELOG_SIZE;
+    capacity = capacity < _SPT_DELTA_RECORD_MAX ? _SPT_DELTA_RECORD_MAX : capacity;
+    capacity = capacity > UINT32_MAX ? UINT32_MAX : capacity;
+
+    struct spt_changelog *log = malloc(sizeof(*log));
+    uint8_t *ring = malloc(capacity);
+    if (!log || !ring) {
+        free(log);
+        free(ring);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "Could not allocate a change log of "
+                "%zu bytes.", capacity);
+        return;
+    }
+
+    *log = (struct spt_changelog){.ring = ring, .capacity = capacity,
+                                  .base = ctx->version,
+                                  .base_chain = ctx->chain};
+    ctx->changelog = log;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+void
+spt_changelog_close(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!ctx->changelog) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    free(ctx->changelog->ring);
+    free(ctx->changelog);
+    ctx->changelog = NULL;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+size_t
+_SPT_API(spt_export_delta)(spt_context *ctx, uint64_t since_version,
+                           void *buf, size_t size)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    const struct spt_changelog *log = ctx->changelog;
+    if (!log) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The context has no open change log.");
+        return 0;
+    }
+
+    if (since_version < log->base || since_version > ctx->version) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "Version %llu is not covered by the "
+                "change log (versions %llu to %llu), a full image is needed.",
+                (unsigned long long)since_version,
+                (unsigned long long)log->base,
+                (unsigned long long)ctx->version);
+        return 0;
+    }
+
+    /* Skip the records the replica already has. */
+    uint64_t pos = log->head;
+    uint64_t chain = log->base_chain;
+    for (uint64_t v = log->base; v < since_version; ++v) {
+        pos += _spt_ring_record_size(log, pos, &chain);
+    }
+
+    const size_t bytes = log->tail - pos;
+    const size_t total = sizeof(spt_delta_header) + bytes;
+    if (!buf) {
+        ctx->out_error = SPT_SUCCESS;
+        return total;
+    }
+    if (size < total) {
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "The delta takes %zu bytes, the "
+                "buffer has %zu.", total, size);
+        return total;
+    }
+
+    uint8_t *records = (uint8_t *)buf + sizeof(spt_delta_header);
+    _spt_ring_read(log, pos, records, bytes);
+    spt_delta_header h = {
+        .version = SPT_DELTA_VERSION,
+        .endian = SPT_IMAGE_ENDIAN,
+        .size = (uint32_t)bytes,
+        .from_version = since_version,
+        .to_version = ctx->version,
+        .checksum = _spt_delta_checksum(records, bytes),
+        .from_chain = chain,
+    };
+    memcpy(h.magic, _spt_delta_magic, sizeof(h.magic));
+    memcpy(buf, &h, sizeof(h));
+    ctx->out_error = SPT_SUCCESS;
+    return total;
+}
+
+void
+_SPT_API(spt_apply_delta)(spt_context *ctx, const void *buf, size_t size)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    spt_delta_header h;
+    if (!buf || size < sizeof(h)) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Delta of %zu bytes is too short.", size);
+        return;
+    }
+
+    memcpy(&h, buf, sizeof(h));
+    const uint8_t *p = (const uint8_t *)buf + sizeof(h);
+    if (memcmp(h.magic, _spt_delta_magic, sizeof(h.magic)) ||
+        h.version != SPT_DELTA_VERSION || h.endian != SPT_IMAGE_ENDIAN ||
+        h.size > size - sizeof(h) || h.to_version < h.from_version ||
+        h.checksum != _spt_delta_checksum(p, h.size)) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Not a valid delta for this "
+                "build (header, size or checksum).");
+        return;
+    }
+
+    /* Every record has to decode before any is applied. */
+    const uint8_t *end = p + h.size;
+    _spt_delta_op op;
+    uint64_t count = 0;
+    int open_batch = 0;
+    for (const uint8_t *q = p; q < end; ++count) {
+        if (!(q = _spt_delta_decode(q, end, &op))) {
+            _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Delta record %llu is malformed.",
+                    (unsigned long long)count);
+            return;
+        }
+        open_batch = op.op == _SPT_OP_DELETE && (op.arg & _SPT_OP_MORE);
+    }
+    if (open_batch) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Delta ends inside a delete batch.");
+        return;
+    }
+    if (count != h.to_version - h.from_version) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Delta has %llu records for versions "
+                "%llu to %llu.", (unsigned long long)count,
+                (unsigned long long)h.from_version,
+                (unsigned long long)h.to_version);
+        return;
+    }
+
+    if (ctx->version > h.to_version) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+    if (ctx->version < h.from_version) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "Delta starts at version %llu, the "
+                "context is at %llu, a full image is needed.",
+                (unsigned long long)h.from_version,
+                (unsigned long long)ctx->version);
+        return;
+    }
+
+    /* The context has to be where the writer was at the same version, not
+     * somewhere else that got the same number (another writer, or a local
+     * mutation). Skip the records it already has. */
+    uint64_t chain = h.from_chain;
+    for (uint64_t version = h.from_version; version < ctx->version; ++version) {
+        const uint8_t *next = _spt_delta_decode(p, end, &op);
+        chain = _spt_chain_step(chain, p, next - p);
+        p = next;
+    }
+    if (chain != ctx->chain) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "The context state at version %llu is "
+                "not the one the delta was written from, a full image is "
+                "needed.", (unsigned long long)ctx->version);
+        return;
+    }
+    if (ctx->version == h.to_version) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    _spt_op_batch batch = {0};
+    for (uint64_t version = ctx->version + 1; p < end; ++version) {
+        p = _spt_delta_decode(p, end, &op);
+
+        _spt_op_apply(ctx, &batch, op.op, op.field, op.element, op.entry,
+                      op.name, op.arg);
+        if (ctx->out_error != SPT_SUCCESS) {
+            int err = ctx->out_error;
+            _SPT_ERR(ctx, SPT_ERROR_STATE, "Delta record %llu could not be "
+                    "applied (error %d).", (unsigned long long)version, err);
+            free(batch.elements);
+            return;
+        }
+    }
+    free(batch.elements);
+    ctx->out_error = SPT_SUCCESS;
+}
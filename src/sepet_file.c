@@ -0,0 +1,296 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* FNV-1a over 64-bit words, then over the trailing bytes. */
+static uint64_t
+_spt_checksum(uint64_t h, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; size; ++p, --size) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Mapped contexts start right after the header, keep their entry tables
+ * cache line aligned (see: SPT_CACHE_ALIGNED). */
+typedef char _spt_header_size_check[
+    sizeof(spt_image_header) % 64 == 0 ? 1 : -1];
+
+/* Context bytes stored in images: everything up to the used part of the
+ * names arena. data holds the bytes of a context, e.g. right after the
+ * header of a caller's blob, which is not aligned like spt_context (see:
+ * SPT_CACHE_ALIGNED), so arena_used is copied out instead of being read
+ * through a context pointer. */
+static size_t
+_spt_data_size(const void *data)
+{
+    uint32_t used;
+    memcpy(&used, (const char *)data + offsetof(spt_context, arena_used),
+           sizeof(used));
+    return offsetof(spt_context, names_arena) + used;
+}
+
+/* Checksum of the stored context bytes. */
+static uint64_t
+_spt_context_checksum(const void *data)
+{
+    return _spt_checksum(14695981039346656037ULL, data, _spt_data_size(data));
+}
+
+spt_image_header
+_spt_layout_header(void)
+{
+    return (spt_image_header){
+        .magic = {'S', 'E', 'P', 'T'},
+        .version = SPT_IMAGE_VERSION,
+        .endian = SPT_IMAGE_ENDIAN,
+        .header_size = sizeof(spt_image_header),
+        .max_fields = SPT_MAX_FIELDS,
+        .max_items = SPT_MAX_ITEMS,
+        .name_size = SPT_NAME_SIZE,
+        .location_bits = SPT_LOCATION_ID_BITS,
+        .entry_columns = SPT_ENTRY_COLUMNS != 0,
+        .context_size = sizeof(spt_context),
+    };
+}
+
+spt_image_header
+_spt_header(const void *data)
+{
+    spt_image_header h = _spt_layout_header();
+    h.checksum = _spt_context_checksum(data);
+    h.data_size = _spt_data_size(data);
+    return h;
+}
+
+/* Validates an image header, returns SPT_SUCCESS or the error code and
+ * writes the error description in msg. The data size is checked against
+ * the stored context bytes and their checksum is only verified if
+ * 'verify'. */
+static int
+_spt_header_check(const spt_image_header *h, const void *data,
+                  int verify, char *msg, size_t msg_size)
+{
+    if (memcmp(h->magic, "SEPT", 4)) {
+        snprintf(msg, msg_size, "Not a sepet image (bad magic).");
+    } else if (h->endian != SPT_IMAGE_ENDIAN) {
+        snprintf(msg, msg_size, "Image byte order does not match the host.");
+    } else if (h->version != SPT_IMAGE_VERSION) {
+        snprintf(msg, msg_size, "Image version %u, expected %d.",
+                 h->version, SPT_IMAGE_VERSION);
+    } else if (h->header_size != sizeof(spt_image_header) ||
+               h->max_fields != SPT_MAX_FIELDS ||
+               h->max_items != SPT_MAX_ITEMS ||
+               h->name_size != SPT_NAME_SIZE ||
+               h->location_bits != SPT_LOCATION_ID_BITS ||
+               h->entry_columns != (SPT_ENTRY_COLUMNS != 0) ||
+               h->context_size != sizeof(spt_context)) {
+        snprintf(msg, msg_size, "Image capacities (fields: %u, items: %u, "
+                 "name: %u, location bits: %u, entry columns: %u, size: %llu) "
+                 "do not match this build.", h->max_fields, h->max_items,
+                 h->name_size, h->location_bits, h->entry_columns,
+                 (unsigned long long)h->context_size);
+    } else if (h->data_size > _SPT_PERSISTENT_SIZE ||
+               h->data_size != _spt_data_size(data)) {
+        snprintf(msg, msg_size, "Image data size %llu is not valid.",
+                 (unsigned long long)h->data_size);
+    } else if (verify && h->checksum != _spt_context_checksum(data)) {
+        snprintf(msg, msg_size, "Image checksum mismatch.");
+    } else {
+        return SPT_SUCCESS;
+    }
+    return SPT_ERROR_FORMAT;
+}
+
+void
+_SPT_API(spt_load)(spt_context *ctx, const void *blob)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!blob) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Image blob is NULL.");
+        return;
+    }
+
+    spt_image_header h;
+    memcpy(&h, blob, sizeof(h));
+    const char *src = (const char *)blob + sizeof(spt_image_header);
+    char msg[256];
+    int err = _spt_header_check(&h, src, 1, msg, sizeof(msg));
+    if (err != SPT_SUCCESS) {
+        _SPT_ERR(ctx, err, "%s", msg);
+        return;
+    }
+
+    /* The unused part of the arena is left as is, it is never read. */
+    _spt_write_begin(ctx);
+    _spt_cow(ctx, ctx, h.data_size > _spt_data_size(ctx) ?
+                       h.data_size : _spt_data_size(ctx));
+    memcpy(ctx, src, h.data_size);
+    _spt_write_end(ctx);
+    _spt_path_cache_clear(ctx);
+    if (ctx->changelog) {
+        _spt_changelog_reset(ctx);
+    }
+    ctx->out_error = SPT_SUCCESS;
+}
+
+size_t
+_SPT_API(spt_save)(spt_context *ctx, void *blob)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    if (!blob) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Image blob is NULL.");
+        return 0;
+    }
+
+    spt_image_header h = _spt_header(ctx);
+    char *dst = blob;
+    memcpy(dst, &h, sizeof(h));
+    memcpy(dst + sizeof(h), ctx, h.data_size);
+    ctx->out_error = SPT_SUCCESS;
+    return sizeof(h) + h.data_size;
+}
+
+int
+_spt_write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+void
+_SPT_API(spt_save_file)(spt_context *ctx, const char *path)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+
+    char tmp[4096];
+    if (!path || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Invalid image path: %s.", path ? path : "NULL");
+        return;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not create %.1024s: %s.", tmp, strerror(errno));
+        return;
+    }
+
+    /* The file is extended to SPT_IMAGE_SIZE without writing the rest, so
+     * that it can be mapped (see: spt_open_mmap) but only takes the space of
+     * the data on file systems with sparse file support. */
+    spt_image_header h = _spt_header(ctx);
+    if (_spt_write_all(fd, &h, sizeof(h)) ||
+        _spt_write_all(fd, ctx, h.data_size) ||
+        ftruncate(fd, SPT_IMAGE_SIZE) ||
+        fsync(fd)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not write %.1024s: %s.", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+
+    if (rename(tmp, path)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not rename %.1024s: %s.", tmp, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    ctx->out_error = SPT_SUCCESS;
+}
+
+spt_context *
+spt_open_mmap(const char *path, int flags, int *out_error)
+{
+    int err = SPT_ERROR_IO;
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd < 0) {
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        goto fail;
+    }
+    if ((size_t)st.st_size < SPT_IMAGE_SIZE) {
+        err = SPT_ERROR_FORMAT;
+        close(fd);
+        goto fail;
+    }
+
+    /* Private writable mapping: the context stays usable (out_error and the
+     * rest of runtime utils are written on every call) but only the touched
+     * pages are copied, and never written back. */
+    char *base = mmap(NULL, SPT_IMAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        goto fail;
+    }
+
+    spt_context *ctx = (spt_context *)(base + sizeof(spt_image_header));
+    char msg[256];
+    err = _spt_header_check((const spt_image_header *)base, ctx,
+                            flags & SPT_MAP_VERIFY, msg, sizeof(msg));
+    if (err != SPT_SUCCESS) {
+        munmap(base, SPT_IMAGE_SIZE);
+        goto fail;
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    ctx->err_callback = NULL;
+    ctx->usr_data = NULL;
+    ctx->journal = NULL;
+    ctx->changelog = NULL;
+    ctx->undo = NULL;
+    ctx->history = NULL;
+    ctx->alloc_size = 0;
+    ctx->seq = 0;
+    _spt_path_cache_clear(ctx);
+#if SPT_STATS
+    ctx->trace_callback = NULL;
+    ctx->stats_probes = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+    if (out_error) {
+        *out_error = SPT_SUCCESS;
+    }
+    return ctx;
+
+fail:
+    if (out_error) {
+        *out_error = err;
+    }
+    return NULL;
+}
+
+void
+spt_close_mmap(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    munmap((char *)ctx - sizeof(spt_image_header), SPT_IMAGE_SIZE);
+}
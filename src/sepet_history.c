@@ -0,0 +1,308 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* History file header, followed by the records. */
+typedef struct _spt_history_header {
+    char        magic[4];           /* "SPTH". */
+    uint32_t    version;            /* SPT_HISTORY_VERSION. */
+    uint32_t    endian;             /* SPT_IMAGE_ENDIAN. */
+    uint32_t    record_size;        /* sizeof(_spt_move_rec). */
+} _spt_history_header;
+
+/* History record. Records are numbered in recording order from the start of
+ * the file (or of the history if there is none), that number is their
+ * sequence. */
+typedef struct _spt_move_rec {
+    spt_move    move;
+    uint64_t    prev;               /* Sequence + 1 of the item's previous record, 0 if none. */
+} _spt_move_rec;
+
+/* Ring of the newest capacity records: record seq is at seq % capacity while
+ * next - seq <= capacity. Records [written, next) are not in the file yet,
+ * fewer than SPT_HISTORY_BATCH between calls, so with a file the capacity
+ * leaves room for a call moving every item (see: spt_history_open). */
+struct spt_history {
+    _spt_move_rec *ring;
+    uint64_t   *last;               /* Sequence + 1 of the newest record of every item, 0 if none. */
+    uint64_t    capacity;
+    uint64_t    next;               /* Sequence of the next record. */
+    uint64_t    written;
+    int         fd;                 /* History file, -1 if none. */
+    int         error;              /* errno of a failed write not reported yet, 0 if none. */
+};
+
+static const _spt_history_header _spt_hheader = {
+    .magic = {'S', 'P', 'T', 'H'},
+    .version = SPT_HISTORY_VERSION,
+    .endian = SPT_IMAGE_ENDIAN,
+    .record_size = sizeof(_spt_move_rec),
+};
+
+/* Record of the sequence if it is still in the ring, NULL otherwise. */
+static const _spt_move_rec *
+_spt_history_at(const struct spt_history *h, uint64_t seq)
+{
+    return seq < h->next && h->next - seq <= h->capacity ?
+           h->ring + seq % h->capacity : NULL;
+}
+
+/* Appends the records not written yet to the file, in at most two writes
+ * (the ring wraps). They are dropped from the file if the write fails. */
+static void
+_spt_history_write(struct spt_history *h)
+{
+    while (h->written < h->next) {
+        const uint64_t at = h->written % h->capacity;
+        uint64_t n = h->next - h->written;
+        n = n < h->capacity - at ? n : h->capacity - at;
+        if (_spt_write_all(h->fd, h->ring + at, n * sizeof(_spt_move_rec))) {
+            h->error = errno;
+            h->written = h->next;
+            return;
+        }
+        h->written += n;
+    }
+}
+
+void
+_spt_history_record(spt_context *ctx, spt_entry from, spt_entry to)
+{
+    if (!memcmp(&from, &to, _SPT_LOC_SIZE)) {
+        return;
+    }
+
+    /* Called inside write sections: never blocks on the file, the records
+     * are written by _spt_history_commit. */
+    struct spt_history *h = ctx->history;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    _spt_move_rec *rec = h->ring + h->next % h->capacity;
+    rec->move.time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    rec->move.from = from;
+    rec->move.to = to;
+    rec->prev = h->last[to.item];
+    h->last[to.item] = ++h->next;
+}
+
+void
+_spt_history_commit(spt_context *ctx)
+{
+    struct spt_history *h = ctx->history;
+    if (h->fd >= 0 && h->next - h->written >= SPT_HISTORY_BATCH) {
+        _spt_history_write(h);
+    }
+    if (h->error) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "History write failed: %s.",
+                strerror(h->error));
+        h->error = 0;
+    }
+}
+
+/* Checks the header of a non-empty history file, drops a torn last record
+ * and loads the newest records into the ring. Returns SPT_SUCCESS or the
+ * error code. */
+static int
+_spt_history_load(spt_context *ctx, struct spt_history *h, const char *path,
+                  off_t size)
+{
+    _spt_history_header hdr;
+    if (pread(h->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(&hdr, &_spt_hheader, sizeof(hdr))) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "History %.1024s has an invalid "
+                "header or was written by an incompatible build.", path);
+        return SPT_ERROR_FORMAT;
+    }
+
+    const uint64_t count = (size - sizeof(hdr)) / sizeof(_spt_move_rec);
+    const off_t whole = sizeof(hdr) + count * sizeof(_spt_move_rec);
+    if (whole != size && ftruncate(h->fd, whole)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not truncate history %.1024s: %s.",
+                path, strerror(errno));
+        return SPT_ERROR_IO;
+    }
+
+    /* Read in at most two parts, the ring wraps. */
+    uint64_t seq = count > h->capacity ? count - h->capacity : 0;
+    while (seq < count) {
+        const uint64_t at = seq % h->capacity;
+        uint64_t n = count - seq;
+        n = n < h->capacity - at ? n : h->capacity - at;
+        const size_t bytes = n * sizeof(_spt_move_rec);
+        if (pread(h->fd, h->ring + at, bytes,
+                  sizeof(hdr) + seq * sizeof(_spt_move_rec)) != (ssize_t)bytes) {
+            _SPT_ERR(ctx, SPT_ERROR_IO, "Could not read history %.1024s: %s.",
+                    path, strerror(errno));
+            return SPT_ERROR_IO;
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            const uint32_t item = h->ring[at + i].move.to.item;
+            if (item < SPT_MAX_ITEMS) {
+                h->last[item] = seq + i + 1;
+            }
+        }
+        seq += n;
+    }
+    h->next = h->written = count;
+    return SPT_SUCCESS;
+}
+
+void
+spt_history_open(spt_context *ctx, size_t capacity, const char *path)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (ctx->history) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The history is already enabled.");
+        return;
+    }
+
+    capacity = capacity ? capacity : SPT_HISTORY_SIZE;
+    if (path && capacity < SPT_HISTORY_BATCH + SPT_MAX_ITEMS) {
+        /* Records are only written between write sections, and one section
+         * can move every item on top of a pending batch. */
+        capacity = SPT_HISTORY_BATCH + SPT_MAX_ITEMS;
+    }
+    struct spt_history *h = malloc(sizeof(*h));
+    _spt_move_rec *ring = malloc(capacity * sizeof(*ring));
+    uint64_t *last = calloc(SPT_MAX_ITEMS, sizeof(*last));
+    if (!h || !ring || !last) {
+        free(h);
+        free(ring);
+        free(last);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "Could not allocate a history of %zu "
+                "movements.", capacity);
+        return;
+    }
+    *h = (struct spt_history){.ring = ring, .last = last, .capacity = capacity,
+                              .fd = -1};
+
+    int code = SPT_SUCCESS;
+    if (path) {
+        struct stat st;
+        h->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (h->fd < 0 || fstat(h->fd, &st)) {
+            _SPT_ERR(ctx, SPT_ERROR_IO, "Could not open history %.1024s: %s.",
+                    path, strerror(errno));
+            code = SPT_ERROR_IO;
+        } else if (st.st_size == 0) {
+            if (_spt_write_all(h->fd, &_spt_hheader, sizeof(_spt_hheader))) {
+                _SPT_ERR(ctx, SPT_ERROR_IO, "Could not write history "
+                        "%.1024s: %s.", path, strerror(errno));
+                code = SPT_ERROR_IO;
+            }
+        } else {
+            code = _spt_history_load(ctx, h, path, st.st_size);
+        }
+    }
+    if (code != SPT_SUCCESS) {
+        if (h->fd >= 0) {
+            close(h->fd);
+        }
+        free(ring);
+        free(last);
+        free(h);
+        return;
+    }
+
+    ctx->history = h;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+void
+spt_history_flush(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    struct spt_history *h = ctx->history;
+    if (!h || h->fd < 0) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    _spt_history_write(h);
+    if (!h->error && fsync(h->fd)) {
+        h->error = errno;
+    }
+    ctx->out_error = SPT_SUCCESS;
+    _spt_history_commit(ctx);
+}
+
+void
+spt_history_close(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    struct spt_history *h = ctx->history;
+    if (!h) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    if (h->fd >= 0) {
+        spt_history_flush(ctx);
+        close(h->fd);
+    }
+    free(h->ring);
+    free(h->last);
+    free(h);
+    ctx->history = NULL;
+}
+
+size_t
+_SPT_API(spt_item_history)(spt_context *ctx, uint32_t item, spt_move *out,
+                           size_t max)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    _SPT_CHECK_ELEM(ctx, SPT_FIELD_ITEM, item, 0);
+    const struct spt_history *h = ctx->history;
+    if (!h) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The history is not enabled.");
+        return 0;
+    }
+
+    /* Links only go back, a damaged file can not make the walk loop. */
+    size_t n = 0;
+    uint64_t link = h->last[item];
+    const _spt_move_rec *rec;
+    while (n < max && link && (rec = _spt_history_at(h, link - 1)) &&
+           rec->move.to.item == item) {
+        out[n++] = rec->move;
+        link = rec->prev < link ? rec->prev : 0;
+    }
+    ctx->out_error = SPT_SUCCESS;
+    return n;
+}
+
+size_t
+_SPT_API(spt_history_query)(spt_context *ctx, const spt_predicate *from,
+                            const spt_predicate *to, int64_t since,
+                            spt_move *out, size_t max)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    const struct spt_history *h = ctx->history;
+    if (!h) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The history is not enabled.");
+        return 0;
+    }
+
+    /* Newest first, until the first record older than since. */
+    size_t n = 0;
+    for (uint64_t seq = h->next; seq-- > 0 && n < max; ) {
+        const _spt_move_rec *rec = _spt_history_at(h, seq);
+        if (!rec || rec->move.time < since) {
+            break;
+        }
+        if ((!from || _spt_pred_match(from, &rec->move.from)) &&
+            (!to || _spt_pred_match(to, &rec->move.to))) {
+            out[n++] = rec->move;
+        }
+    }
+    ctx->out_error = SPT_SUCCESS;
+    return n;
+}
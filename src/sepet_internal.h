@@ -0,0 +1,357 @@
+#ifndef __SEPET_INTERNAL_H__
+#define __SEPET_INTERNAL_H__
+
+/* Library-private helpers shared by the sepet translation units. */
+
+#include "sepet.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* Size of the persistent part of the context, runtime utils come after it. */
+#define _SPT_PERSISTENT_SIZE offsetof(spt_context, out_error)
+
+/* Name arena records: 16-bit reference count, 8-bit length and the
+ * null-terminated string, padded to 2 bytes. Handles are record offsets,
+ * records start at _SPT_ARENA_BASE so that 0 is never a valid handle. */
+#define _SPT_REC_HEAD       (3)
+#define _SPT_REC_MAX_REFS   (0xFFFF)
+#define _SPT_ARENA_BASE     (2)
+
+/* Public functions counted by SPT_STATS are defined under an internal name
+ * and wrapped by sepet_stats.c, which times them. Probes of the running call
+ * are accumulated with _SPT_STAT_PROBES. */
+#if SPT_STATS
+#define _SPT_API(NAME) _##NAME##_impl
+#define _SPT_STAT_PROBES(CTX, N) ((CTX)->stats_probes += (N))
+#else
+#define _SPT_API(NAME) NAME
+#define _SPT_STAT_PROBES(CTX, N) ((void)(CTX), (void)(N))
+#endif
+
+/* Empty macro argument placeholder. */
+#define _SPT_ARG_PH
+
+/* Max index value depending on field type. */
+#define _SPT_MAX_IDX(FLD) \
+    ((FLD) == SPT_FIELD_ITEM ? SPT_MAX_ITEMS : SPT_MAX_FIELDS)
+
+/* Macro capturing the error handling boilerplate code. */
+#define _SPT_ERR(CTX, ERR, FMT, ...) do {                                      \
+    (CTX)->out_error = (ERR);                                                  \
+    snprintf((CTX)->out_err_msg, SPT_MSG_SIZE, FMT, __VA_ARGS__);       \
+    if ((CTX)->err_callback) {                                                 \
+        (CTX)->err_callback((CTX)->usr_data,                                   \
+                (CTX)->out_error, (CTX)->out_err_msg);                         \
+    }} while (0)
+
+/* Field arg value check. */
+#define _SPT_CHECK_FIELD(CTX, FLD, RET) do {                                   \
+    if ((FLD) < 0 || (FLD) >= SPT_FIELD_COUNT) {                               \
+        _SPT_ERR((CTX), SPT_ERROR_BOUNDS,                                      \
+                "Field (%d) out of bounds. Range: [0, %d)",                    \
+                (FLD), SPT_FIELD_COUNT);                                       \
+        return RET;                                                            \
+    }} while (0)
+
+/* Element index arg value check, */
+#define _SPT_CHECK_ELEM(CTX, FLD, ELEM, RET) do {                              \
+    if ((ELEM) <= SPT_DEFAULT_ID || (ELEM) >= _SPT_MAX_IDX((FLD))) {                         \
+        _SPT_ERR((CTX), SPT_ERROR_BOUNDS,                                      \
+                "Element (%d) out of bounds. Range: [0, %d)",                  \
+                (ELEM), _SPT_MAX_IDX((FLD)));                                  \
+        return RET;                                                            \
+    }} while (0)
+
+/* Cascade mode arg value check. */
+#define _SPT_CHECK_MODE(CTX, MODE, RET) do {                                   \
+    if ((MODE) < SPT_CASCADE_EXTRACT || (MODE) > SPT_CASCADE_REFUSE) {         \
+        _SPT_ERR((CTX), SPT_ERROR_BOUNDS,                                      \
+                "Cascade mode (%d) out of bounds.", (MODE));                   \
+        return RET;                                                            \
+    }} while (0)
+
+/* Arg context checking. Done at the beginning of every function. */
+#define _SPT_CHECK_CTX(CTX, RET) do {if (!(CTX)) {return RET;}} while (0)
+
+/* Index of the lowest set bit, x can not be 0. */
+static inline int
+_spt_ffs(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+/* Entry of the slot, independent of the table layout (see: SPT_ENTRY_COLUMNS). */
+static inline spt_entry
+_spt_entry_get(const spt_context *ctx, uint32_t slot)
+{
+#if SPT_ENTRY_COLUMNS
+    return (spt_entry){
+        .building = ctx->entry_locations[SPT_FIELD_BUILDING][slot],
+        .room = ctx->entry_locations[SPT_FIELD_ROOM][slot],
+        .container = ctx->entry_locations[SPT_FIELD_CONTAINER][slot],
+        .subsection = ctx->entry_locations[SPT_FIELD_SUBSECTION][slot],
+        .item = ctx->entry_items[slot],
+    };
+#else
+    return ctx->entries[slot];
+#endif
+}
+
+/* Size of the location part of spt_entry. */
+#define _SPT_LOC_SIZE offsetof(spt_entry, item)
+
+/* Whether the entry passes the predicate (see: spt_predicate_compile). */
+static inline int
+_spt_pred_match(const spt_predicate *pred, const spt_entry *e)
+{
+    uint64_t loc = 0;
+    memcpy(&loc, e, _SPT_LOC_SIZE);
+    return (loc & pred->loc_mask) == pred->loc_value &&
+           e->item >= pred->item_min && e->item <= pred->item_max;
+}
+
+/* Saves the pages of the newest snapshot that [offset, offset + size) of the
+ * persistent part is about to overwrite (sepet_undo.c). */
+void _spt_undo_touch(
+    spt_context *ctx,
+    size_t       offset,
+    size_t       size);
+
+/* Copy-on-write barrier, called before every write to the persistent part
+ * of the context (see: spt_snapshot). */
+static inline void
+_spt_cow(spt_context *ctx, const void *ptr, size_t size)
+{
+#if SPT_UNDO
+    if (ctx->undo) {
+        _spt_undo_touch(ctx, (const char *)ptr - (const char *)ctx, size);
+    }
+#else
+    (void)ctx, (void)ptr, (void)size;
+#endif
+}
+
+static inline void
+_spt_entry_put(spt_context *ctx, uint32_t slot, spt_entry e)
+{
+#if SPT_ENTRY_COLUMNS
+    if (ctx->undo) {
+        for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+            _spt_cow(ctx, &ctx->entry_locations[field][slot], sizeof(spt_loc_id));
+        }
+        _spt_cow(ctx, &ctx->entry_items[slot], sizeof(uint32_t));
+    }
+    ctx->entry_locations[SPT_FIELD_BUILDING][slot] = e.building;
+    ctx->entry_locations[SPT_FIELD_ROOM][slot] = e.room;
+    ctx->entry_locations[SPT_FIELD_CONTAINER][slot] = e.container;
+    ctx->entry_locations[SPT_FIELD_SUBSECTION][slot] = e.subsection;
+    ctx->entry_items[slot] = e.item;
+#else
+    _spt_cow(ctx, &ctx->entries[slot], sizeof(spt_entry));
+    ctx->entries[slot] = e;
+#endif
+}
+
+/* Item ID of the slot, 0 if it is free. */
+static inline uint32_t
+_spt_entry_item(const spt_context *ctx, uint32_t slot)
+{
+#if SPT_ENTRY_COLUMNS
+    return ctx->entry_items[slot];
+#else
+    return ctx->entries[slot].item;
+#endif
+}
+
+/* Seqlock (see: spt_context::seq). A single writer makes the sequence odd
+ * while it mutates the context, readers retry if it was odd or changed
+ * during their read. */
+static inline void
+_spt_write_begin(spt_context *ctx)
+{
+    __atomic_store_n(&ctx->seq, ctx->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+_spt_write_end(spt_context *ctx)
+{
+    __atomic_store_n(&ctx->seq, ctx->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Spins between two clock reads of a waiting reader. */
+#define _SPT_READ_SPINS     (1U << 12)
+
+/* Waits until no write section is in progress and stores the sequence in
+ * *seq. Returns -1 if the writer is still inside after SPT_READ_TIMEOUT_MS,
+ * e.g. a writer process that died mid-mutation leaves seq odd for good. */
+static inline int
+_spt_read_begin(const spt_context *ctx, uint32_t *seq)
+{
+    int64_t deadline = 0;
+    for (uint32_t spins = 1;
+         (*seq = __atomic_load_n(&ctx->seq, __ATOMIC_ACQUIRE)) & 1; ++spins) {
+        if (!(spins % _SPT_READ_SPINS)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            const int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            if (!deadline) {
+                deadline = now + SPT_READ_TIMEOUT_MS;
+            } else if (now >= deadline) {
+                return -1;
+            }
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    return 0;
+}
+
+static inline int
+_spt_read_retry(const spt_context *ctx, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ctx->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Writes the whole buffer, retrying on partial writes and interruptions.
+ * Returns 0 on success, -1 on error (see errno). */
+int _spt_write_all(
+    int          fd,
+    const void  *data,
+    size_t       size);
+
+/* Search signature of a name (sepet_search.c, see: spt_search). */
+uint64_t _spt_name_grams(
+    const char  *str,
+    size_t       len);
+
+/* Mutating operations, as recorded in the journal. */
+enum _spt_ops {
+    _SPT_OP_ADD = 1,
+    _SPT_OP_RENAME,
+    _SPT_OP_INSERT,
+    _SPT_OP_EXTRACT,
+    _SPT_OP_DELETE,
+    _SPT_OP_QUANTITY,
+};
+
+/* Flag of the arg of every delete record of a spt_delete_batch but the last
+ * one. Replays gather the group and apply it once complete, a group cut
+ * short by a crash is dropped. */
+#define _SPT_OP_MORE (0x80)
+
+/* Bitmap words covering the IDs of any field. */
+#define _SPT_BATCH_WORDS \
+    (SPT_SLOTS_ITEMS > SPT_SLOTS_FIELDS ? SPT_SLOTS_ITEMS : SPT_SLOTS_FIELDS)
+
+/* Delete batch gathered by a replay (see: _SPT_OP_MORE). */
+typedef struct _spt_op_batch {
+    uint32_t   *elements;           /* _SPT_BATCH_WORDS * 64 IDs, allocated on first use. */
+    uint32_t    count;
+    int         field;
+    int         mode;
+} _spt_op_batch;
+
+/* Appends a record to ctx->journal (sepet_journal.c). Name is only used by
+ * add and rename records, it is read up to SPT_NAME_SIZE - 1 chars. Arg is the
+ * cascade mode of delete records and the quantity of quantity records. */
+void _spt_journal_append(
+    spt_context *ctx,
+    int          op,
+    int          field,
+    uint32_t     element,
+    spt_entry    entry,
+    const char  *name,
+    uint32_t     arg);
+
+/* Applies a mutation through the public API, the arguments are the ones of
+ * _spt_journal_append (sepet_journal.c). Delete batch records are gathered
+ * in batch until the last one, free its elements once done. */
+void _spt_op_apply(
+    spt_context *ctx,
+    _spt_op_batch *batch,
+    int          op,
+    int          field,
+    uint32_t     element,
+    spt_entry    entry,
+    const char  *name,
+    uint32_t     arg);
+
+/* spt_context::chain of a new context. */
+#define _SPT_CHAIN_BASIS (14695981039346656037ULL)
+
+/* Chain following the given one once size bytes of data are recorded
+ * (FNV-1a, sepet_delta.c). */
+uint64_t _spt_chain_step(
+    uint64_t     chain,
+    const void  *data,
+    size_t       size);
+
+/* Chains a committed record into ctx->chain and appends it to ctx->changelog
+ * if open, same arguments as _spt_journal_append (sepet_delta.c). */
+void _spt_delta_record(
+    spt_context *ctx,
+    int          op,
+    int          field,
+    uint32_t     element,
+    spt_entry    entry,
+    const char  *name,
+    uint32_t     arg);
+
+/* Empties ctx->changelog, for when the context version no longer follows
+ * its records (sepet_delta.c). */
+void _spt_changelog_reset(
+    spt_context *ctx);
+
+/* Image header of the stored context bytes, which need not be aligned like
+ * spt_context (sepet_file.c). */
+spt_image_header _spt_header(
+    const void  *data);
+
+/* Image header fields describing this build: everything but the checksum
+ * and the data size, which are 0 (sepet_file.c). */
+spt_image_header _spt_layout_header(void);
+
+/* Initializes a zeroed context (sepet.c). */
+void _spt_init(
+    spt_context *ctx);
+
+/* Non-zero if the capacities of config are set and differ from the ones the
+ * library was built with (sepet.c). */
+int _spt_config_mismatch(
+    const spt_config *config);
+
+/* Empties ctx->path_cache, for when location names or IDs change
+ * (sepet_path.c). */
+void _spt_path_cache_clear(
+    spt_context *ctx);
+
+/* Records a movement of an item in ctx->history, unless from and to have
+ * the same location. Called inside write sections, never does I/O
+ * (sepet_history.c). */
+void _spt_history_record(
+    spt_context *ctx,
+    spt_entry    from,
+    spt_entry    to);
+
+/* Appends the buffered movements to the history file once there are
+ * SPT_HISTORY_BATCH of them, and reports failed writes. Called after the
+ * write section, once the mutation has set out_error (sepet_history.c). */
+void _spt_history_commit(
+    spt_context *ctx);
+
+#endif // __SEPET_INTERNAL_H__
@@ -0,0 +1,403 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _SPT_JOURNAL_VERSION 3
+
+/* Journal file header, followed by the records. */
+typedef struct _spt_journal_header {
+    char        magic[4];           /* "SPTJ". */
+    uint32_t    version;            /* _SPT_JOURNAL_VERSION. */
+    uint32_t    endian;             /* SPT_IMAGE_ENDIAN. */
+    uint32_t    record_size;        /* sizeof(_spt_record), fixed part of the records. */
+} _spt_journal_header;
+
+/* Journal record, one per mutating call. Followed by name_len name bytes. */
+typedef struct _spt_record {
+    uint64_t    version;            /* Context version after applying the record. */
+    spt_entry   entry;              /* Inserted or extracted entry. */
+    uint32_t    element;            /* Element ID. */
+    uint32_t    checksum;           /* FNV-1a of the record and its name, computed with this field set to 0. */
+    uint8_t     op;                 /* enum _spt_ops. */
+    uint8_t     field;              /* enum spt_fields. */
+    uint8_t     arg;                /* Cascade mode of delete records (see: enum spt_cascade_modes), with _SPT_OP_MORE. */
+    uint8_t     name_len;           /* Length of the resulting name of add and rename records, 0 otherwise. */
+    uint32_t    quantity;           /* Quantity of quantity records, 0 otherwise. */
+} _spt_record;
+
+struct spt_journal {
+    int         fd;
+    uint32_t    batch;              /* Records per fsync. */
+    uint32_t    pending;            /* Records written since the last fsync. */
+};
+
+static const _spt_journal_header _spt_jheader = {
+    .magic = {'S', 'P', 'T', 'J'},
+    .version = _SPT_JOURNAL_VERSION,
+    .endian = SPT_IMAGE_ENDIAN,
+    .record_size = sizeof(_spt_record),
+};
+
+/* FNV-1a of the record members and the name, checksum counted as 0. The
+ * members are laid out at their offsets in a zeroed buffer: copies of the
+ * record do not have to preserve its padding, which is never hashed. */
+static uint32_t
+_spt_record_checksum(const _spt_record *rec, const char *name)
+{
+    unsigned char buf[sizeof(_spt_record)];
+    memset(buf, 0, sizeof(buf));
+#define _SPT_REC_PUT(M) \
+    memcpy(buf + offsetof(_spt_record, M), &rec->M, sizeof(rec->M))
+    _SPT_REC_PUT(version);
+    _SPT_REC_PUT(entry.building);
+    _SPT_REC_PUT(entry.room);
+    _SPT_REC_PUT(entry.container);
+    _SPT_REC_PUT(entry.subsection);
+    _SPT_REC_PUT(entry.item);
+    _SPT_REC_PUT(element);
+    _SPT_REC_PUT(op);
+    _SPT_REC_PUT(field);
+    _SPT_REC_PUT(arg);
+    _SPT_REC_PUT(name_len);
+    _SPT_REC_PUT(quantity);
+#undef _SPT_REC_PUT
+
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        h = (h ^ buf[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < rec->name_len; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Reads the next record and its null-terminated name (SPT_NAME_SIZE bytes
+ * buffer). Returns 0 at the end of the file or on a torn or corrupted
+ * record. */
+static int
+_spt_record_read(FILE *f, _spt_record *rec, char *name)
+{
+    if (fread(rec, sizeof(*rec), 1, f) != 1 ||
+        rec->name_len >= SPT_NAME_SIZE ||
+        fread(name, 1, rec->name_len, f) != rec->name_len) {
+        return 0;
+    }
+    name[rec->name_len] = '\0';
+    return rec->checksum == _spt_record_checksum(rec, name);
+}
+
+void
+_spt_journal_append(spt_context *ctx, int op, int field, uint32_t element,
+                    spt_entry entry, const char *name, uint32_t arg)
+{
+    struct spt_journal *j = ctx->journal;
+    /* Written with a single call, so that appends are not interleaved. */
+    char buf[sizeof(_spt_record) + SPT_NAME_SIZE];
+    _spt_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.version = ctx->version;
+    rec.entry = entry;
+    rec.element = element;
+    rec.op = op;
+    rec.field = field;
+    if (op == _SPT_OP_QUANTITY) {
+        rec.quantity = arg;
+    } else {
+        rec.arg = arg;
+    }
+    rec.name_len = name ? strnlen(name, SPT_NAME_SIZE - 1) : 0;
+    rec.checksum = _spt_record_checksum(&rec, name);
+    memcpy(buf, &rec, sizeof(rec));
+    if (rec.name_len) {
+        memcpy(buf + sizeof(rec), name, rec.name_len);
+    }
+
+    if (_spt_write_all(j->fd, buf, sizeof(rec) + rec.name_len)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Journal write failed: %s.", strerror(errno));
+        return;
+    }
+
+    if (++j->pending >= j->batch) {
+        j->pending = 0;
+        if (fsync(j->fd)) {
+            _SPT_ERR(ctx, SPT_ERROR_IO, "Journal sync failed: %s.", strerror(errno));
+        }
+    }
+}
+
+void
+spt_journal_open(spt_context *ctx, const char *path, uint32_t batch)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (ctx->journal) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The context already has an open journal.");
+        return;
+    }
+
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_APPEND, 0644) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not open journal %.1024s: %s.",
+                path ? path : "NULL", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    if (st.st_size == 0) {
+        if (_spt_write_all(fd, &_spt_jheader, sizeof(_spt_jheader)) || fsync(fd)) {
+            _SPT_ERR(ctx, SPT_ERROR_IO, "Could not write journal %.1024s: %s.",
+                    path, strerror(errno));
+            close(fd);
+            return;
+        }
+    } else {
+        _spt_journal_header h;
+        FILE *f = fopen(path, "rb");
+        if (!f || fread(&h, sizeof(h), 1, f) != 1 ||
+            memcmp(&h, &_spt_jheader, sizeof(h))) {
+            _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Journal %.1024s has an invalid "
+                    "header or was written by an incompatible build.", path);
+            if (f) {
+                fclose(f);
+            }
+            close(fd);
+            return;
+        }
+
+        /* Drop the torn tail of a crashed append, if any, so that new
+         * records are not appended after garbage, along with an unfinished
+         * delete batch. Records have variable size, so the last valid one is
+         * found by reading them all. */
+        _spt_record rec;
+        char name[SPT_NAME_SIZE];
+        off_t pos = sizeof(h);
+        off_t whole = pos;
+        while (_spt_record_read(f, &rec, name)) {
+            pos += sizeof(rec) + rec.name_len;
+            if (rec.op != _SPT_OP_DELETE || !(rec.arg & _SPT_OP_MORE)) {
+                whole = pos;
+            }
+        }
+        fclose(f);
+        if (whole != st.st_size && ftruncate(fd, whole)) {
+            _SPT_ERR(ctx, SPT_ERROR_IO, "Could not truncate journal %.1024s: %s.",
+                    path, strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+
+    struct spt_journal *j = malloc(sizeof(*j));
+    if (!j) {
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "%s", "Could not allocate the journal.");
+        close(fd);
+        return;
+    }
+    *j = (struct spt_journal){.fd = fd, .batch = batch ? batch : 1};
+    ctx->journal = j;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+void
+spt_journal_sync(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!ctx->journal) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    ctx->journal->pending = 0;
+    if (fsync(ctx->journal->fd)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Journal sync failed: %s.", strerror(errno));
+        return;
+    }
+    ctx->out_error = SPT_SUCCESS;
+}
+
+void
+spt_journal_close(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!ctx->journal) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    spt_journal_sync(ctx);
+    close(ctx->journal->fd);
+    free(ctx->journal);
+    ctx->journal = NULL;
+}
+
+/* Adds a delete record to the gathered batch, applying it on the last one. */
+static void
+_spt_op_batch_add(spt_context *ctx, _spt_op_batch *batch, int field,
+                  uint32_t element, uint32_t arg)
+{
+    const int mode = arg & ~_SPT_OP_MORE;
+    if (batch->count && (field != batch->field || mode != batch->mode)) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Delete batch records of "
+                "different fields or modes.");
+        return;
+    }
+    if (batch->count == _SPT_BATCH_WORDS * 64) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Delete batch of more elements "
+                "than IDs.");
+        return;
+    }
+    if (!batch->elements &&
+        !(batch->elements = malloc(_SPT_BATCH_WORDS * 64 * sizeof(uint32_t)))) {
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "%s", "Could not allocate a delete batch.");
+        return;
+    }
+
+    batch->field = field;
+    batch->mode = mode;
+    batch->elements[batch->count++] = element;
+    if (arg & _SPT_OP_MORE) {
+        ctx->out_error = SPT_SUCCESS;
+        return;
+    }
+    spt_delete_batch(ctx, field, batch->elements, batch->count, mode);
+    batch->count = 0;
+}
+
+void
+_spt_op_apply(spt_context *ctx, _spt_op_batch *batch, int op, int field,
+              uint32_t element, spt_entry entry, const char *name, uint32_t arg)
+{
+    if (batch->count && op != _SPT_OP_DELETE) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Delete batch interrupted by "
+                "another operation.");
+        return;
+    }
+
+    switch (op) {
+    case _SPT_OP_ADD:
+        if (spt_add(ctx, field, name) != element &&
+            ctx->out_error == SPT_SUCCESS) {
+            _SPT_ERR(ctx, SPT_ERROR_STATE, "Add of %s got a different ID "
+                    "than %u.", name, element);
+        }
+        break;
+    case _SPT_OP_RENAME:
+        spt_rename(ctx, field, element, name);
+        break;
+    case _SPT_OP_INSERT:
+        spt_insert(ctx, entry.item, entry.building, entry.room,
+                   entry.container, entry.subsection);
+        break;
+    case _SPT_OP_EXTRACT:
+        spt_extract(ctx, entry);
+        break;
+    case _SPT_OP_DELETE:
+        if (batch->count || (arg & _SPT_OP_MORE)) {
+            _spt_op_batch_add(ctx, batch, field, element, arg);
+        } else {
+            spt_delete_ex(ctx, field, element, arg);
+        }
+        break;
+    case _SPT_OP_QUANTITY:
+        spt_set_quantity(ctx, element, arg);
+        break;
+    default:
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Unknown operation %d.", op);
+        break;
+    }
+}
+
+void
+_SPT_API(spt_journal_replay)(spt_context *ctx, const char *path)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+
+    FILE *f = path ? fopen(path, "rb") : NULL;
+    if (!f) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not open journal %.1024s: %s.",
+                path ? path : "NULL", strerror(errno));
+        return;
+    }
+
+    _spt_journal_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(&h, &_spt_jheader, sizeof(h))) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "Journal %.1024s has an invalid "
+                "header or was written by an incompatible build.", path);
+        fclose(f);
+        return;
+    }
+
+    /* Replayed mutations must not be journaled again, nor their movements
+     * recorded again with the replay's time. */
+    struct spt_journal *journal = ctx->journal;
+    struct spt_history *history = ctx->history;
+    ctx->journal = NULL;
+    ctx->history = NULL;
+    ctx->out_error = SPT_NOOP;
+
+    /* A delete batch left unfinished by a crash is not applied. */
+    _spt_op_batch batch = {0};
+    _spt_record rec;
+    char name[SPT_NAME_SIZE];
+    while (_spt_record_read(f, &rec, name)) {
+        if (rec.version <= ctx->version) {
+            continue;
+        }
+
+        if (rec.version != ctx->version + batch.count + 1) {
+            _SPT_ERR(ctx, SPT_ERROR_STATE, "Journal jumps from version %llu "
+                    "to %llu, records are missing.",
+                    (unsigned long long)(ctx->version + batch.count),
+                    (unsigned long long)rec.version);
+            break;
+        }
+
+        _spt_op_apply(ctx, &batch, rec.op, rec.field, rec.element, rec.entry,
+                      name, rec.op == _SPT_OP_QUANTITY ? rec.quantity :
+                                                         rec.arg);
+        if (ctx->out_error != SPT_SUCCESS) {
+            int err = ctx->out_error;
+            _SPT_ERR(ctx, SPT_ERROR_STATE, "Journal record %llu could not be "
+                    "applied (error %d).", (unsigned long long)rec.version, err);
+            break;
+        }
+    }
+
+    ctx->journal = journal;
+    ctx->history = history;
+    free(batch.elements);
+    fclose(f);
+}
+
+void
+_SPT_API(spt_journal_compact)(spt_context *ctx, const char *image_path)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!ctx->journal) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "The context has no open journal.");
+        return;
+    }
+
+    spt_save_file(ctx, image_path);
+    if (ctx->out_error != SPT_SUCCESS) {
+        return;
+    }
+
+    struct spt_journal *j = ctx->journal;
+    if (ftruncate(j->fd, sizeof(_spt_journal_header)) || fsync(j->fd)) {
+        _SPT_ERR(ctx, SPT_ERROR_IO, "Could not truncate the journal: %s.",
+                strerror(errno));
+        return;
+    }
+    j->pending = 0;
+    ctx->out_error = SPT_SUCCESS;
+}
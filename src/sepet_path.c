@@ -0,0 +1,183 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <string.h>
+
+/* Location names of a path, pointing into it (not null-terminated). */
+typedef struct _spt_path {
+    const char *names[SPT_LOCATION_FIELDS];
+    uint32_t    lens[SPT_LOCATION_FIELDS];  /* Truncated to SPT_NAME_SIZE - 1, 0 for Default. */
+    uint32_t    hash;                       /* FNV-1a of the whole path, never 0. */
+} _spt_path;
+
+/* Splits the path into p. Returns the number of names, SPT_LOCATION_FIELDS + 1
+ * if there are more. */
+static int
+_spt_path_split(const char *path, _spt_path *p)
+{
+    uint32_t h = 2166136261u;
+    int n = 0;
+    const char *name = path;
+    for (const char *c = path; ; ++c) {
+        if (*c == SPT_PATH_SEPARATOR || !*c) {
+            if (n == SPT_LOCATION_FIELDS) {
+                return n + 1;
+            }
+            size_t len = c - name;
+            p->names[n] = name;
+            p->lens[n++] = len < SPT_NAME_SIZE - 1 ? len : SPT_NAME_SIZE - 1;
+            if (!*c) {
+                break;
+            }
+            name = c + 1;
+        }
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+
+    for (int field = n; field < SPT_LOCATION_FIELDS; ++field) {
+        p->names[field] = "";
+        p->lens[field] = 0;
+    }
+    p->hash = h ? h : 1;
+    return n;
+}
+
+/* Whether the cache entry holds the path: same hash and every cached ID
+ * still has the path's name (guards against hash collisions). */
+static int
+_spt_path_match(const spt_context *ctx, const _spt_path *p,
+                const spt_path_slot *slot)
+{
+    if (slot->hash != p->hash) {
+        return 0;
+    }
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        const uint32_t id = slot->locations[field];
+        if (!p->lens[field]) {
+            if (id != SPT_DEFAULT_ID) {
+                return 0;
+            }
+            continue;
+        }
+        /* The name arrays of the fields are contiguous. */
+        const uint32_t *names = ctx->building_names + field * SPT_MAX_FIELDS;
+        const uint32_t handle = names[id];
+        if (!handle ||
+            (unsigned char)ctx->names_arena[handle + 2] != p->lens[field] ||
+            memcmp(ctx->names_arena + handle + _SPT_REC_HEAD, p->names[field],
+                   p->lens[field])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static spt_entry
+_spt_path_entry(const spt_path_slot *slot)
+{
+    return (spt_entry){.building = slot->locations[SPT_FIELD_BUILDING],
+                       .room = slot->locations[SPT_FIELD_ROOM],
+                       .container = slot->locations[SPT_FIELD_CONTAINER],
+                       .subsection = slot->locations[SPT_FIELD_SUBSECTION],
+                       .item = SPT_UNSPECIFIED_ID};
+}
+
+void
+_spt_path_cache_clear(spt_context *ctx)
+{
+    memset(ctx->path_cache, 0, sizeof(ctx->path_cache));
+}
+
+spt_entry
+_SPT_API(spt_resolve_path)(spt_context *ctx, const char *path)
+{
+    _SPT_CHECK_CTX(ctx, (spt_entry){0});
+    if (!path) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "%s", "Path is NULL.");
+        return (spt_entry){0};
+    }
+
+    _spt_path p;
+    if (_spt_path_split(path, &p) > SPT_LOCATION_FIELDS) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "Path: %.1024s.\nPaths have at most "
+                "%d names.", path, SPT_LOCATION_FIELDS);
+        return (spt_entry){0};
+    }
+
+    /* Hits in the second way are moved to the first one, misses evict the
+     * second way. */
+    spt_path_slot *set =
+        ctx->path_cache + (p.hash & (SPT_PATH_CACHE_SIZE / 2 - 1)) * 2;
+    if (_spt_path_match(ctx, &p, set)) {
+        ctx->out_error = SPT_SUCCESS;
+        return _spt_path_entry(set);
+    }
+    if (_spt_path_match(ctx, &p, set + 1)) {
+        spt_path_slot hit = set[1];
+        set[1] = set[0];
+        set[0] = hit;
+        ctx->out_error = SPT_SUCCESS;
+        return _spt_path_entry(set);
+    }
+
+    spt_path_slot slot = {.hash = p.hash};
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        if (!p.lens[field]) {
+            slot.locations[field] = SPT_DEFAULT_ID;
+            continue;
+        }
+        char name[SPT_NAME_SIZE];
+        memcpy(name, p.names[field], p.lens[field]);
+        name[p.lens[field]] = '\0';
+        uint32_t id = spt_get_id(ctx, field, name);
+        if (id == SPT_INVALID_ID) {
+            return (spt_entry){0};
+        }
+        slot.locations[field] = id;
+    }
+
+    set[1] = set[0];
+    set[0] = slot;
+    ctx->out_error = SPT_SUCCESS;
+    return _spt_path_entry(set);
+}
+
+spt_entry
+_SPT_API(spt_insert_path)(spt_context *ctx, const char *path, const char *item)
+{
+    _SPT_CHECK_CTX(ctx, (spt_entry){0});
+    if (!item || !*item) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "%s", "Item name is NULL or empty.");
+        return (spt_entry){0};
+    }
+
+    spt_entry e = spt_resolve_path(ctx, path);
+    if (ctx->out_error != SPT_SUCCESS) {
+        return (spt_entry){0};
+    }
+
+    /* A missing item is not an error, the lookup is not reported. */
+    ErrCb err_callback = ctx->err_callback;
+    ctx->err_callback = NULL;
+    uint32_t id = spt_get_id(ctx, SPT_FIELD_ITEM, item);
+    ctx->err_callback = err_callback;
+    int added = 0;
+    if (id == SPT_INVALID_ID) {
+        if ((id = spt_add(ctx, SPT_FIELD_ITEM, item)) == SPT_INVALID_ID) {
+            return (spt_entry){0};
+        }
+        added = 1;
+    }
+
+    e = spt_insert(ctx, id, e.building, e.room, e.container, e.subsection);
+    if (ctx->out_error != SPT_SUCCESS && added) {
+        /* The item is not left behind, keeping the insertion's error. */
+        int err = ctx->out_error;
+        char msg[SPT_MSG_SIZE];
+        memcpy(msg, ctx->out_err_msg, sizeof(msg));
+        spt_delete(ctx, SPT_FIELD_ITEM, id);
+        ctx->out_error = err;
+        memcpy(ctx->out_err_msg, msg, sizeof(msg));
+    }
+    return e;
+}
@@ -0,0 +1,267 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <string.h>
+
+/* With SPT_ENTRY_COLUMNS, the location columns are compared 16 bytes at a
+ * time. Otherwise the vector kernels read entries as pairs of 32-bit lanes:
+ * location bytes first and item ID second, so they need 8-bit location IDs. */
+#if SPT_ENTRY_COLUMNS
+#if defined(__SSE2__) || defined(_M_X64)
+#define _SPT_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+#elif SPT_LOCATION_ID_BITS == 8
+#if defined(__SSE2__) || defined(_M_X64)
+#define _SPT_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define _SPT_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+typedef char _spt_entry_layout_check[
+    sizeof(spt_entry) == 8 && offsetof(spt_entry, item) == 4 ? 1 : -1];
+#endif
+
+#if SPT_ENTRY_COLUMNS
+/* Bitmask of the 64 column values from col (64-byte aligned) equal to id. */
+static inline uint64_t
+_spt_column_match(const spt_loc_id *col, spt_loc_id id)
+{
+    uint64_t bits = 0;
+#if defined(_SPT_SCAN_SSE2) && SPT_LOCATION_ID_BITS == 8
+    const __m128i v = _mm_set1_epi8((char)id);
+    for (int i = 0; i < 64; i += 16) {
+        __m128i c = _mm_load_si128((const __m128i *)(col + i));
+        bits |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, v)) << i;
+    }
+#elif defined(_SPT_SCAN_SSE2)
+    const __m128i v = _mm_set1_epi16((short)id);
+    for (int i = 0; i < 64; i += 16) {
+        __m128i c0 = _mm_load_si128((const __m128i *)(col + i));
+        __m128i c1 = _mm_load_si128((const __m128i *)(col + i + 8));
+        __m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(c0, v), _mm_cmpeq_epi16(c1, v));
+        bits |= (uint64_t)(unsigned)_mm_movemask_epi8(eq) << i;
+    }
+#else
+    for (int i = 0; i < 64; ++i) {
+        bits |= (uint64_t)(col[i] == id) << i;
+    }
+#endif
+    return bits;
+}
+
+/* Columnar scan: the location columns named by the predicate are compared
+ * 64 slots at a time and only the items of the matching slots are read, so
+ * a single location scan reads one byte (or two) per entry. */
+static size_t
+_spt_scan_columns(const spt_context *ctx, const spt_predicate *pred,
+                  spt_entry *out, size_t max)
+{
+    spt_entry mask = {0};
+    spt_entry value = {0};
+    memcpy(&mask, &pred->loc_mask, _SPT_LOC_SIZE);
+    memcpy(&value, &pred->loc_value, _SPT_LOC_SIZE);
+    const spt_loc_id *m = &mask.building;
+    const spt_loc_id *v = &value.building;
+    int fields[SPT_LOCATION_FIELDS];
+    int nfields = 0;
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        if (m[field]) {
+            fields[nfields++] = field;
+        }
+    }
+
+    size_t n = 0;
+    for (uint32_t base = 0; base < SPT_MAX_ITEMS && (!out || n < max); base += 64) {
+        uint64_t bits = ~0ULL;
+        for (int i = 0; i < nfields && bits; ++i) {
+            bits &= _spt_column_match(ctx->entry_locations[fields[i]] + base,
+                                      v[fields[i]]);
+        }
+
+        for (; bits && (!out || n < max); bits &= bits - 1) {
+            uint32_t slot = base + _spt_ffs(bits);
+            uint32_t item = ctx->entry_items[slot];
+            if (item >= pred->item_min && item <= pred->item_max) {
+                if (out) {
+                    out[n] = _spt_entry_get(ctx, slot);
+                }
+                ++n;
+            }
+        }
+    }
+    return n;
+}
+#else
+/* Matches of entries [begin, end), the shared tail of every kernel. */
+static size_t
+_spt_scan_scalar(const spt_entry *entries, size_t begin, size_t end,
+                 const spt_predicate *pred, spt_entry *out, size_t n, size_t max)
+{
+    for (size_t i = begin; i < end && (!out || n < max); ++i) {
+        if (_spt_pred_match(pred, entries + i)) {
+            if (out) {
+                out[n] = entries[i];
+            }
+            ++n;
+        }
+    }
+    return n;
+}
+
+/* Appends the entries flagged in bits (one bit per entry, from base). */
+static inline size_t
+_spt_scan_emit(const spt_entry *entries, size_t base, unsigned bits,
+               spt_entry *out, size_t n, size_t max)
+{
+    if (!out) {
+        for (; bits; bits &= bits - 1) {
+            ++n;
+        }
+        return n;
+    }
+
+    for (; bits && n < max; bits &= bits - 1) {
+        out[n++] = entries[base + _spt_ffs(bits)];
+    }
+    return n;
+}
+
+#if defined(_SPT_SCAN_SSE2)
+static size_t
+_spt_scan_sse2(const spt_entry *entries, size_t count,
+               const spt_predicate *pred, spt_entry *out, size_t max)
+{
+    /* Lanes: {location, item} per entry. Location lanes compare masked
+     * bytes, item lanes do an unsigned range check (sign flipped). The
+     * neutral values make every lane pass the check it does not need. */
+    const __m128i mask = _mm_set_epi32(0, (int)pred->loc_mask, 0, (int)pred->loc_mask);
+    const __m128i value = _mm_set_epi32(0, (int)pred->loc_value, 0, (int)pred->loc_value);
+    const __m128i sign = _mm_set1_epi32((int)0x80000000u);
+    const __m128i lo = _mm_set_epi32((int)(pred->item_min ^ 0x80000000u), INT32_MIN,
+                                     (int)(pred->item_min ^ 0x80000000u), INT32_MIN);
+    const __m128i hi = _mm_set_epi32((int)(pred->item_max ^ 0x80000000u), INT32_MAX,
+                                     (int)(pred->item_max ^ 0x80000000u), INT32_MAX);
+
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 2 <= count && (!out || n < max); i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+        __m128i x = _mm_xor_si128(v, sign);
+        __m128i ok = _mm_cmpeq_epi32(_mm_and_si128(v, mask), value);
+        ok = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(lo, x),
+                                           _mm_cmpgt_epi32(x, hi)), ok);
+        /* Both lanes of an entry have to pass. */
+        ok = _mm_and_si128(ok, _mm_shuffle_epi32(ok, _MM_SHUFFLE(2, 3, 0, 1)));
+        unsigned bits = _mm_movemask_pd(_mm_castsi128_pd(ok));
+        if (bits) {
+            n = _spt_scan_emit(entries, i, bits, out, n, max);
+        }
+    }
+    return _spt_scan_scalar(entries, i, count, pred, out, n, max);
+}
+#endif
+
+#if defined(_SPT_SCAN_AVX2)
+__attribute__((target("avx2")))
+static size_t
+_spt_scan_avx2(const spt_entry *entries, size_t count,
+               const spt_predicate *pred, spt_entry *out, size_t max)
+{
+    /* Same as the SSE2 kernel with four entries per vector, unrolled twice. */
+    const __m256i mask = _mm256_set1_epi64x(pred->loc_mask);
+    const __m256i value = _mm256_set1_epi64x(pred->loc_value);
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000u);
+    const __m256i lo = _mm256_set1_epi64x(
+        (int64_t)(((uint64_t)(pred->item_min ^ 0x80000000u) << 32) | 0x80000000u));
+    const __m256i hi = _mm256_set1_epi64x(
+        (int64_t)(((uint64_t)(pred->item_max ^ 0x80000000u) << 32) | 0x7FFFFFFFu));
+
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= count && (!out || n < max); i += 8) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(entries + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(entries + i + 4));
+        __m256i x0 = _mm256_xor_si256(v0, sign);
+        __m256i x1 = _mm256_xor_si256(v1, sign);
+        __m256i ok0 = _mm256_cmpeq_epi32(_mm256_and_si256(v0, mask), value);
+        __m256i ok1 = _mm256_cmpeq_epi32(_mm256_and_si256(v1, mask), value);
+        ok0 = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(lo, x0),
+                                                  _mm256_cmpgt_epi32(x0, hi)), ok0);
+        ok1 = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(lo, x1),
+                                                  _mm256_cmpgt_epi32(x1, hi)), ok1);
+        ok0 = _mm256_and_si256(ok0, _mm256_shuffle_epi32(ok0, _MM_SHUFFLE(2, 3, 0, 1)));
+        ok1 = _mm256_and_si256(ok1, _mm256_shuffle_epi32(ok1, _MM_SHUFFLE(2, 3, 0, 1)));
+        unsigned bits = _mm256_movemask_pd(_mm256_castsi256_pd(ok0)) |
+                        _mm256_movemask_pd(_mm256_castsi256_pd(ok1)) << 4;
+        if (bits) {
+            n = _spt_scan_emit(entries, i, bits, out, n, max);
+        }
+    }
+    return _spt_scan_scalar(entries, i, count, pred, out, n, max);
+}
+#endif
+#endif
+
+spt_predicate
+spt_predicate_compile(int building, int room, int container, int subsection,
+                      uint32_t item_min, uint32_t item_max)
+{
+    spt_entry mask = {0};
+    spt_entry value = {0};
+    const int ids[SPT_LOCATION_FIELDS] = {building, room, container, subsection};
+    spt_loc_id *m = &mask.building;
+    spt_loc_id *v = &value.building;
+    for (int field = 0; field < SPT_LOCATION_FIELDS; ++field) {
+        if (ids[field] != SPT_ANY) {
+            m[field] = (spt_loc_id)~0U;
+            v[field] = (spt_loc_id)ids[field];
+        }
+    }
+
+    /* Items below SPT_DEFAULT_ID + 1 can not be stored, excluding them
+     * also excludes the free slots (item 0). */
+    spt_predicate pred = {
+        .item_min = item_min > SPT_DEFAULT_ID ? item_min : SPT_DEFAULT_ID + 1,
+        .item_max = item_max,
+    };
+    memcpy(&pred.loc_mask, &mask, _SPT_LOC_SIZE);
+    memcpy(&pred.loc_value, &value, _SPT_LOC_SIZE);
+    return pred;
+}
+
+size_t
+_SPT_API(spt_scan)(spt_context *ctx, const spt_predicate *pred,
+                   spt_entry *out, size_t max)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    if (!pred) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "Scan predicate is NULL.");
+        return 0;
+    }
+
+    ctx->out_error = SPT_SUCCESS;
+    if (out && !max) {
+        return 0;
+    }
+    _SPT_STAT_PROBES(ctx, SPT_MAX_ITEMS);
+
+#if SPT_ENTRY_COLUMNS
+    return _spt_scan_columns(ctx, pred, out, max);
+#else
+#if defined(_SPT_SCAN_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return _spt_scan_avx2(ctx->entries, SPT_MAX_ITEMS, pred, out, max);
+    }
+#endif
+#if defined(_SPT_SCAN_SSE2)
+    return _spt_scan_sse2(ctx->entries, SPT_MAX_ITEMS, pred, out, max);
+#else
+    return _spt_scan_scalar(ctx->entries, 0, SPT_MAX_ITEMS, pred, out, 0, max);
+#endif
+#endif
+}
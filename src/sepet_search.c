@@ -0,0 +1,178 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Match tiers, lower ranks first. */
+enum _spt_tiers {
+    _SPT_TIER_EXACT = 0,
+    _SPT_TIER_PREFIX,
+    _SPT_TIER_SUBSTRING,
+};
+
+static inline unsigned char
+_spt_lower(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* Signature bit of an n-gram, the gram size salts the hash so that bigrams
+ * and trigrams with the same bytes do not collide on purpose. */
+static inline uint64_t
+_spt_gram_bit(const unsigned char *s, int n)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)n;
+    for (int i = 0; i < n; ++i) {
+        h = (h ^ _spt_lower(s[i])) * 16777619u;
+    }
+    /* FNV bits are poorly mixed for such short inputs. */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return 1ULL << (h & 63);
+}
+
+uint64_t
+_spt_name_grams(const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    uint64_t sig = 0;
+    for (size_t i = 0; i + 2 <= len; ++i) {
+        sig |= _spt_gram_bit(s + i, 2);
+        if (i + 3 <= len) {
+            sig |= _spt_gram_bit(s + i, 3);
+        }
+    }
+    return sig;
+}
+
+/* Position of the first case-insensitive occurrence of pattern in str, -1
+ * if there is none. */
+static int
+_spt_find_ci(const char *str, size_t len, const char *pattern, size_t plen)
+{
+    for (size_t i = 0; i + plen <= len; ++i) {
+        size_t j = 0;
+        for (; j < plen && _spt_lower(str[i + j]) == _spt_lower(pattern[j]); ++j);
+        if (j == plen) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Max-heap of ranking keys, the worst kept result on top. */
+static void
+_spt_heap_sift_down(uint64_t *heap, size_t n, size_t i)
+{
+    for (size_t c; (c = 2 * i + 1) < n; i = c) {
+        if (c + 1 < n && heap[c + 1] > heap[c]) {
+            ++c;
+        }
+        if (heap[i] >= heap[c]) {
+            return;
+        }
+        uint64_t t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+    }
+}
+
+static void
+_spt_heap_push(uint64_t *heap, size_t n, uint64_t key)
+{
+    size_t i = n;
+    heap[i] = key;
+    for (; i && heap[(i - 1) / 2] < heap[i]; i = (i - 1) / 2) {
+        uint64_t t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+    }
+}
+
+size_t
+_SPT_API(spt_search)(spt_context *ctx, int field, const char *pattern,
+                     uint32_t *out_ids, size_t max)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    _SPT_CHECK_FIELD(ctx, field, 0);
+    if (!pattern) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "%s", "Search pattern is NULL.");
+        return 0;
+    }
+
+    const size_t plen = strnlen(pattern, SPT_NAME_SIZE);
+    const uint64_t psig = _spt_name_grams(pattern, plen);
+    const uint32_t maxidx = _SPT_MAX_IDX(field);
+    const uint64_t *slots = ctx->building_free + field * SPT_SLOTS_FIELDS;
+    const uint64_t *grams = ctx->building_grams + field * SPT_MAX_FIELDS;
+    const uint32_t *names = ctx->building_names + field * SPT_MAX_FIELDS;
+
+    /* Ranking keys: tier, match position, name length and ID, so that the
+     * lowest keys are the best results. Only the best 'max' are kept. */
+    uint64_t *heap = NULL;
+    size_t kept = 0, total = 0, checked = 0;
+    if (out_ids && max) {
+        heap = malloc((max < maxidx ? max : maxidx) * sizeof(*heap));
+        if (!heap) {
+            _SPT_ERR(ctx, SPT_ERROR_MEMORY, "Could not allocate %zu search "
+                     "results.", max);
+            return 0;
+        }
+    }
+
+    for (uint32_t word = 0; word * 64 < maxidx; ++word) {
+        for (uint64_t live = ~slots[word]; live; live &= live - 1) {
+            uint32_t id = word * 64 + _spt_ffs(live);
+            if (id >= maxidx || (grams[id] & psig) != psig) {
+                continue;
+            }
+
+            ++checked;
+            const char *name = ctx->names_arena + names[id] + _SPT_REC_HEAD;
+            size_t len = (unsigned char)ctx->names_arena[names[id] + 2];
+            int pos = _spt_find_ci(name, len, pattern, plen);
+            if (pos < 0) {
+                continue;
+            }
+
+            ++total;
+            if (!heap) {
+                continue;
+            }
+
+            uint64_t tier = pos ? _SPT_TIER_SUBSTRING :
+                            len == plen ? _SPT_TIER_EXACT : _SPT_TIER_PREFIX;
+            uint64_t key = tier << 48 | (uint64_t)pos << 40 |
+                           (uint64_t)len << 32 | id;
+            if (kept < max) {
+                _spt_heap_push(heap, kept++, key);
+            } else if (key < heap[0]) {
+                heap[0] = key;
+                _spt_heap_sift_down(heap, kept, 0);
+            }
+        }
+    }
+    _SPT_STAT_PROBES(ctx, checked);
+
+    if (!heap) {
+        ctx->out_error = SPT_SUCCESS;
+        return out_ids ? 0 : total;
+    }
+
+    /* Heap sort, popping the worst result to the back. */
+    for (size_t n = kept; n > 1; --n) {
+        uint64_t t = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = t;
+        _spt_heap_sift_down(heap, n - 1, 0);
+    }
+    for (size_t i = 0; i < kept; ++i) {
+        out_ids[i] = (uint32_t)heap[i];
+    }
+    free(heap);
+
+    ctx->out_error = SPT_SUCCESS;
+    return kept;
+}
@@ -0,0 +1,144 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Segment layout: the context at the start (page aligned, like spt_create
+ * allocations, so that spt_destroy unmaps it), followed by a layout header
+ * (see: _spt_layout_header). The header is written once the context is
+ * initialized, attaching fails until then. */
+#define _SPT_SHM_SIZE (sizeof(spt_context) + sizeof(spt_image_header))
+
+static spt_image_header *
+_spt_shm_header(const spt_context *ctx)
+{
+    return (spt_image_header *)((char *)ctx + sizeof(spt_context));
+}
+
+spt_context *
+spt_shm_create(const char *name, const spt_config *config, int *out_error)
+{
+    const spt_config defaults = {0};
+    config = config ? config : &defaults;
+
+    int err = SPT_ERROR_FORMAT;
+    if (_spt_config_mismatch(config)) {
+        goto fail;
+    }
+
+    err = SPT_ERROR_IO;
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644) : -1;
+    if (fd < 0) {
+        goto fail;
+    }
+
+    /* New segments are zeroed, and their pages are not committed until
+     * touched. */
+    void *mem = MAP_FAILED;
+    if (!ftruncate(fd, _SPT_SHM_SIZE)) {
+        mem = mmap(NULL, _SPT_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(name);
+        goto fail;
+    }
+
+    spt_context *ctx = mem;
+    _spt_init(ctx);
+    ctx->err_callback = config->err_callback;
+    ctx->usr_data = config->usr_data;
+#if SPT_STATS
+    ctx->trace_callback = config->trace_callback;
+#endif
+    ctx->alloc_size = _SPT_SHM_SIZE;
+    ctx->out_error = SPT_SUCCESS;
+
+    /* Readers that see the header see the initialized context. */
+    spt_image_header h = _spt_layout_header();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *_spt_shm_header(ctx) = h;
+    if (out_error) {
+        *out_error = SPT_SUCCESS;
+    }
+    return ctx;
+
+fail:
+    if (out_error) {
+        *out_error = err;
+    }
+    return NULL;
+}
+
+const spt_context *
+spt_shm_attach(const char *name, int *out_error)
+{
+    int err = SPT_ERROR_IO;
+    int fd = name ? shm_open(name, O_RDONLY, 0) : -1;
+    if (fd < 0) {
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        goto fail;
+    }
+    if ((size_t)st.st_size != _SPT_SHM_SIZE) {
+        err = SPT_ERROR_FORMAT;
+        close(fd);
+        goto fail;
+    }
+
+    /* Read-only: readers can not write the writer's context by mistake. */
+    const spt_context *ctx = mmap(NULL, _SPT_SHM_SIZE, PROT_READ, MAP_SHARED,
+                                  fd, 0);
+    close(fd);
+    if (ctx == MAP_FAILED) {
+        goto fail;
+    }
+
+    const spt_image_header expected = _spt_layout_header();
+    if (memcmp(_spt_shm_header(ctx), &expected,
+               offsetof(spt_image_header, checksum))) {
+        err = SPT_ERROR_FORMAT;
+        munmap((void *)ctx, _SPT_SHM_SIZE);
+        goto fail;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (out_error) {
+        *out_error = SPT_SUCCESS;
+    }
+    return ctx;
+
+fail:
+    if (out_error) {
+        *out_error = err;
+    }
+    return NULL;
+}
+
+void
+spt_shm_detach(const spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    munmap((void *)ctx, _SPT_SHM_SIZE);
+}
+
+void
+spt_shm_unlink(const char *name, int *out_error)
+{
+    int err = SPT_SUCCESS;
+    if (!name || shm_unlink(name)) {
+        err = name && errno == ENOENT ? SPT_NOOP : SPT_ERROR_IO;
+    }
+    if (out_error) {
+        *out_error = err;
+    }
+}
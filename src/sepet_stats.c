@@ -0,0 +1,435 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <string.h>
+
+#if SPT_STATS
+#include <time.h>
+
+/* Definitions of the counted functions (see: _SPT_API). */
+uint32_t _spt_add_impl(spt_context *ctx, int field, const char *alias);
+void _spt_rename_impl(spt_context *ctx, int field, uint32_t element,
+                      const char *new_name);
+spt_entry _spt_insert_impl(spt_context *ctx, uint32_t item,
+                           spt_loc_id building, spt_loc_id room,
+                           spt_loc_id container, spt_loc_id subsection);
+uint32_t _spt_extract_impl(spt_context *ctx, spt_entry entry);
+void _spt_delete_ex_impl(spt_context *ctx, int field, uint32_t element,
+                         int mode);
+void _spt_delete_batch_impl(spt_context *ctx, int field,
+                            const uint32_t *elements, size_t count, int mode);
+void _spt_compact_names_impl(spt_context *ctx);
+uint32_t _spt_get_id_impl(spt_context *ctx, int field, const char *name);
+const char *_spt_get_name_impl(spt_context *ctx, int field, uint32_t element);
+spt_entry _spt_find_impl(spt_context *ctx, uint32_t item);
+uint32_t _spt_next_impl(spt_context *ctx, int field, uint32_t element);
+spt_cursor _spt_query_location_impl(spt_context *ctx, int building, int room,
+                                    int container, int subsection);
+int _spt_cursor_next_impl(spt_cursor *cur, spt_entry *out);
+size_t _spt_scan_impl(spt_context *ctx, const spt_predicate *pred,
+                      spt_entry *out, size_t max);
+size_t _spt_search_impl(spt_context *ctx, int field, const char *pattern,
+                        uint32_t *out_ids, size_t max);
+void _spt_load_impl(spt_context *ctx, const void *blob);
+size_t _spt_save_impl(spt_context *ctx, void *blob);
+void _spt_save_file_impl(spt_context *ctx, const char *path);
+void _spt_journal_replay_impl(spt_context *ctx, const char *path);
+size_t _spt_export_delta_impl(spt_context *ctx, uint64_t since_version,
+                              void *buf, size_t size);
+void _spt_apply_delta_impl(spt_context *ctx, const void *buf, size_t size);
+spt_entry _spt_resolve_path_impl(spt_context *ctx, const char *path);
+void _spt_set_quantity_impl(spt_context *ctx, uint32_t item, uint32_t quantity);
+spt_entry _spt_insert_path_impl(spt_context *ctx, const char *path,
+                                const char *item);
+size_t _spt_import_csv_impl(spt_context *ctx, const char *buf, size_t size,
+                            spt_csv_result *out);
+size_t _spt_import_csv_fd_impl(spt_context *ctx, int fd, spt_csv_result *out);
+size_t _spt_export_csv_impl(spt_context *ctx, char *buf, size_t size);
+size_t _spt_export_csv_fd_impl(spt_context *ctx, int fd);
+void _spt_journal_compact_impl(spt_context *ctx, const char *image_path);
+uint32_t _spt_snapshot_impl(spt_context *ctx);
+void _spt_rollback_impl(spt_context *ctx, uint32_t snapshot);
+void _spt_undo_impl(spt_context *ctx);
+void _spt_redo_impl(spt_context *ctx);
+size_t _spt_snapshot_save_impl(spt_context *ctx, uint32_t snapshot, void *blob);
+size_t _spt_item_history_impl(spt_context *ctx, uint32_t item, spt_move *out,
+                              size_t max);
+size_t _spt_history_query_impl(spt_context *ctx, const spt_predicate *from,
+                               const spt_predicate *to, int64_t since,
+                               spt_move *out, size_t max);
+spt_entry _spt_get_entry_impl(spt_context *ctx, uint32_t slot);
+uint64_t _spt_count_impl(spt_context *ctx, int field, uint32_t element);
+void _spt_counts_impl(spt_context *ctx, int field, uint64_t *out);
+
+/* Start of a counted call. */
+typedef struct _spt_stat_frame {
+    struct timespec start;
+    uint64_t        probes;     /* spt_context::stats_probes at the start. */
+} _spt_stat_frame;
+
+static _spt_stat_frame
+_spt_stat_begin(const spt_context *ctx)
+{
+    _spt_stat_frame frame = {.probes = ctx ? ctx->stats_probes : 0};
+    clock_gettime(CLOCK_MONOTONIC, &frame.start);
+    return frame;
+}
+
+/* Accounts the call to op, which returned with code (not read from
+ * out_error, spt_cursor_next does not set it), and calls the trace hook. */
+static void
+_spt_stat_end(spt_context *ctx, int op, const _spt_stat_frame *frame, int code)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!ctx) {
+        return;
+    }
+
+    uint64_t ns = (uint64_t)(now.tv_sec - frame->start.tv_sec) * 1000000000u +
+                  (uint64_t)now.tv_nsec - (uint64_t)frame->start.tv_nsec;
+    int bucket = 0;
+    for (uint64_t v = ns; v > 1 && bucket < SPT_STAT_BUCKETS - 1; v >>= 1) {
+        ++bucket;
+    }
+
+    spt_op_stats *s = ctx->stats.ops + op;
+    ++s->calls;
+    if (code != SPT_SUCCESS) {
+        ++s->errors[SPT_STAT_ERROR_INDEX(code)];
+    }
+    s->probes += ctx->stats_probes - frame->probes;
+    s->total_ns += ns;
+    ++s->latency[bucket];
+
+    if (ctx->trace_callback) {
+        ctx->trace_callback(ctx->usr_data, op, code, ns);
+    }
+}
+
+/* Wraps a call returning RET into 'return RET' with statistics. */
+#define _SPT_STAT_CALL(CTX, OP, TYPE, CALL) do {                               \
+    _spt_stat_frame frame_ = _spt_stat_begin(CTX);                             \
+    TYPE ret_ = CALL;                                                          \
+    _spt_stat_end(CTX, OP, &frame_, (CTX) ? (CTX)->out_error : SPT_ERROR_CTX); \
+    return ret_;                                                               \
+    } while (0)
+
+/* Same as _SPT_STAT_CALL for void calls. */
+#define _SPT_STAT_CALL_VOID(CTX, OP, CALL) do {                                \
+    _spt_stat_frame frame_ = _spt_stat_begin(CTX);                             \
+    CALL;                                                                      \
+    _spt_stat_end(CTX, OP, &frame_, (CTX) ? (CTX)->out_error : SPT_ERROR_CTX); \
+    } while (0)
+
+uint32_t
+spt_add(spt_context *ctx, int field, const char *alias)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_ADD, uint32_t,
+                   _spt_add_impl(ctx, field, alias));
+}
+
+void
+spt_rename(spt_context *ctx, int field, uint32_t element, const char *new_name)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_RENAME,
+                        _spt_rename_impl(ctx, field, element, new_name));
+}
+
+spt_entry
+spt_insert(spt_context *ctx, uint32_t item, spt_loc_id building,
+           spt_loc_id room, spt_loc_id container, spt_loc_id subsection)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_INSERT, spt_entry,
+                   _spt_insert_impl(ctx, item, building, room, container,
+                                    subsection));
+}
+
+uint32_t
+spt_extract(spt_context *ctx, spt_entry entry)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_EXTRACT, uint32_t,
+                   _spt_extract_impl(ctx, entry));
+}
+
+void
+spt_delete_ex(spt_context *ctx, int field, uint32_t element, int mode)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_DELETE,
+                        _spt_delete_ex_impl(ctx, field, element, mode));
+}
+
+void
+spt_delete_batch(spt_context *ctx, int field, const uint32_t *elements,
+                 size_t count, int mode)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_DELETE_BATCH,
+                        _spt_delete_batch_impl(ctx, field, elements, count,
+                                               mode));
+}
+
+void
+spt_compact_names(spt_context *ctx)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_COMPACT_NAMES,
+                        _spt_compact_names_impl(ctx));
+}
+
+uint32_t
+spt_get_id(spt_context *ctx, int field, const char *name)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_GET_ID, uint32_t,
+                   _spt_get_id_impl(ctx, field, name));
+}
+
+const char *
+spt_get_name(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_GET_NAME, const char *,
+                   _spt_get_name_impl(ctx, field, element));
+}
+
+spt_entry
+spt_find(spt_context *ctx, uint32_t item)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_FIND, spt_entry, _spt_find_impl(ctx, item));
+}
+
+uint32_t
+spt_next(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_NEXT, uint32_t,
+                   _spt_next_impl(ctx, field, element));
+}
+
+spt_cursor
+spt_query_location(spt_context *ctx, int building, int room, int container,
+                   int subsection)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_QUERY_LOCATION, spt_cursor,
+                   _spt_query_location_impl(ctx, building, room, container,
+                                            subsection));
+}
+
+int
+spt_cursor_next(spt_cursor *cur, spt_entry *out)
+{
+    spt_context *ctx = cur ? cur->ctx : NULL;
+    _spt_stat_frame frame = _spt_stat_begin(ctx);
+    int found = _spt_cursor_next_impl(cur, out);
+    _spt_stat_end(ctx, SPT_STAT_CURSOR_NEXT, &frame, SPT_SUCCESS);
+    return found;
+}
+
+size_t
+spt_scan(spt_context *ctx, const spt_predicate *pred, spt_entry *out,
+         size_t max)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_SCAN, size_t,
+                   _spt_scan_impl(ctx, pred, out, max));
+}
+
+size_t
+spt_search(spt_context *ctx, int field, const char *pattern, uint32_t *out_ids,
+           size_t max)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_SEARCH, size_t,
+                   _spt_search_impl(ctx, field, pattern, out_ids, max));
+}
+
+void
+spt_load(spt_context *ctx, const void *blob)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_LOAD, _spt_load_impl(ctx, blob));
+}
+
+size_t
+spt_save(spt_context *ctx, void *blob)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_SAVE, size_t, _spt_save_impl(ctx, blob));
+}
+
+void
+spt_save_file(spt_context *ctx, const char *path)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_SAVE_FILE,
+                        _spt_save_file_impl(ctx, path));
+}
+
+void
+spt_journal_replay(spt_context *ctx, const char *path)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_JOURNAL_REPLAY,
+                        _spt_journal_replay_impl(ctx, path));
+}
+
+size_t
+spt_export_delta(spt_context *ctx, uint64_t since_version, void *buf,
+                 size_t size)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_EXPORT_DELTA, size_t,
+                   _spt_export_delta_impl(ctx, since_version, buf, size));
+}
+
+void
+spt_apply_delta(spt_context *ctx, const void *buf, size_t size)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_APPLY_DELTA,
+                        _spt_apply_delta_impl(ctx, buf, size));
+}
+
+spt_entry
+spt_resolve_path(spt_context *ctx, const char *path)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_RESOLVE_PATH, spt_entry,
+                   _spt_resolve_path_impl(ctx, path));
+}
+
+void
+spt_set_quantity(spt_context *ctx, uint32_t item, uint32_t quantity)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_SET_QUANTITY,
+                        _spt_set_quantity_impl(ctx, item, quantity));
+}
+
+spt_entry
+spt_insert_path(spt_context *ctx, const char *path, const char *item)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_INSERT_PATH, spt_entry,
+                   _spt_insert_path_impl(ctx, path, item));
+}
+
+size_t
+spt_import_csv(spt_context *ctx, const char *buf, size_t size,
+               spt_csv_result *out)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_IMPORT_CSV, size_t,
+                   _spt_import_csv_impl(ctx, buf, size, out));
+}
+
+size_t
+spt_import_csv_fd(spt_context *ctx, int fd, spt_csv_result *out)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_IMPORT_CSV, size_t,
+                   _spt_import_csv_fd_impl(ctx, fd, out));
+}
+
+size_t
+spt_export_csv(spt_context *ctx, char *buf, size_t size)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_EXPORT_CSV, size_t,
+                   _spt_export_csv_impl(ctx, buf, size));
+}
+
+size_t
+spt_export_csv_fd(spt_context *ctx, int fd)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_EXPORT_CSV, size_t,
+                   _spt_export_csv_fd_impl(ctx, fd));
+}
+
+void
+spt_journal_compact(spt_context *ctx, const char *image_path)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_JOURNAL_COMPACT,
+                        _spt_journal_compact_impl(ctx, image_path));
+}
+
+uint32_t
+spt_snapshot(spt_context *ctx)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_SNAPSHOT, uint32_t, _spt_snapshot_impl(ctx));
+}
+
+void
+spt_rollback(spt_context *ctx, uint32_t snapshot)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_ROLLBACK,
+                        _spt_rollback_impl(ctx, snapshot));
+}
+
+void
+spt_undo(spt_context *ctx)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_UNDO, _spt_undo_impl(ctx));
+}
+
+void
+spt_redo(spt_context *ctx)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_REDO, _spt_redo_impl(ctx));
+}
+
+size_t
+spt_snapshot_save(spt_context *ctx, uint32_t snapshot, void *blob)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_SNAPSHOT_SAVE, size_t,
+                   _spt_snapshot_save_impl(ctx, snapshot, blob));
+}
+
+size_t
+spt_item_history(spt_context *ctx, uint32_t item, spt_move *out, size_t max)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_ITEM_HISTORY, size_t,
+                   _spt_item_history_impl(ctx, item, out, max));
+}
+
+size_t
+spt_history_query(spt_context *ctx, const spt_predicate *from,
+                  const spt_predicate *to, int64_t since, spt_move *out,
+                  size_t max)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_HISTORY_QUERY, size_t,
+                   _spt_history_query_impl(ctx, from, to, since, out, max));
+}
+
+spt_entry
+spt_get_entry(spt_context *ctx, uint32_t slot)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_GET_ENTRY, spt_entry,
+                   _spt_get_entry_impl(ctx, slot));
+}
+
+uint64_t
+spt_count(spt_context *ctx, int field, uint32_t element)
+{
+    _SPT_STAT_CALL(ctx, SPT_STAT_COUNTS, uint64_t,
+                   _spt_count_impl(ctx, field, element));
+}
+
+void
+spt_counts(spt_context *ctx, int field, uint64_t *out)
+{
+    _SPT_STAT_CALL_VOID(ctx, SPT_STAT_COUNTS, _spt_counts_impl(ctx, field, out));
+}
+#endif
+
+void
+spt_stats_get(spt_context *ctx, spt_stats *out)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!out) {
+        _SPT_ERR(ctx, SPT_ERROR_BOUNDS, "%s", "Statistics output is NULL.");
+        return;
+    }
+
+#if SPT_STATS
+    *out = ctx->stats;
+    ctx->out_error = SPT_SUCCESS;
+#else
+    memset(out, 0, sizeof(*out));
+    ctx->out_error = SPT_NOOP;
+#endif
+}
+
+void
+spt_stats_reset(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+#if SPT_STATS
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->out_error = SPT_SUCCESS;
+#else
+    ctx->out_error = SPT_NOOP;
+#endif
+}
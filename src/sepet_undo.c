@@ -0,0 +1,354 @@
+#include "sepet.h"
+#include "sepet_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Pages of the persistent part, the last one may be partial. */
+#define _SPT_UNDO_PAGES \
+    ((_SPT_PERSISTENT_SIZE + SPT_UNDO_PAGE - 1) / SPT_UNDO_PAGE)
+
+/* Pages saved since a snapshot was taken: their content at that time. Once
+ * undone, the same pages hold the content they were undone from (swapping
+ * them back is a redo). */
+typedef struct _spt_snapshot {
+    uint32_t    id;
+    int         lost;               /* A page could not be saved, the snapshot can not be restored. */
+    uint32_t    count;              /* Saved pages. */
+    uint32_t   *saved;              /* Indices of the saved pages, in saving order. */
+    char      **pages;              /* Copy of every page, NULL if not saved. */
+} _spt_snapshot;
+
+/* Ring of depth snapshots: the undo stack (oldest first) followed by the
+ * redo stack (last undone first). */
+struct spt_undo {
+    _spt_snapshot *snaps;
+    uint32_t    depth;
+    uint32_t    base;               /* Ring index of the oldest snapshot. */
+    uint32_t    count;              /* Snapshots in the undo stack. */
+    uint32_t    redo;               /* Snapshots in the redo stack. */
+    uint32_t    next_id;
+};
+
+/* i-th snapshot from the oldest one, redo stack included. */
+static _spt_snapshot *
+_spt_undo_at(struct spt_undo *u, uint32_t i)
+{
+    return u->snaps + (u->base + i) % u->depth;
+}
+
+/* Bytes of the page within the persistent part. */
+static size_t
+_spt_page_size(uint32_t page)
+{
+    size_t at = (size_t)page * SPT_UNDO_PAGE;
+    return _SPT_PERSISTENT_SIZE - at < SPT_UNDO_PAGE ?
+           _SPT_PERSISTENT_SIZE - at : SPT_UNDO_PAGE;
+}
+
+static void
+_spt_snapshot_clear(_spt_snapshot *s)
+{
+    for (uint32_t i = 0; i < s->count; ++i) {
+        free(s->pages[s->saved[i]]);
+        s->pages[s->saved[i]] = NULL;
+    }
+    s->count = 0;
+    s->lost = 0;
+}
+
+static void
+_spt_redo_clear(struct spt_undo *u)
+{
+    for (uint32_t i = 0; i < u->redo; ++i) {
+        _spt_snapshot_clear(_spt_undo_at(u, u->count + i));
+    }
+    u->redo = 0;
+}
+
+void
+_spt_undo_touch(spt_context *ctx, size_t offset, size_t size)
+{
+    struct spt_undo *u = ctx->undo;
+    if (u->redo) {
+        _spt_redo_clear(u);
+    }
+    if (!u->count || !size) {
+        return;
+    }
+
+    _spt_snapshot *s = _spt_undo_at(u, u->count - 1);
+    const uint32_t last = (offset + size - 1) / SPT_UNDO_PAGE;
+    for (uint32_t page = offset / SPT_UNDO_PAGE; page <= last && !s->lost; ++page) {
+        if (s->pages[page]) {
+            continue;
+        }
+        char *copy = malloc(SPT_UNDO_PAGE);
+        if (!copy) {
+            s->lost = 1;
+            return;
+        }
+        memcpy(copy, (char *)ctx + (size_t)page * SPT_UNDO_PAGE,
+               _spt_page_size(page));
+        s->pages[page] = copy;
+        s->saved[s->count++] = page;
+    }
+}
+
+/* Exchanges the saved pages with the current ones. */
+static void
+_spt_snapshot_swap(spt_context *ctx, _spt_snapshot *s)
+{
+    char tmp[SPT_UNDO_PAGE];
+    for (uint32_t i = 0; i < s->count; ++i) {
+        const uint32_t page = s->saved[i];
+        const size_t size = _spt_page_size(page);
+        char *live = (char *)ctx + (size_t)page * SPT_UNDO_PAGE;
+        memcpy(tmp, live, size);
+        memcpy(live, s->pages[page], size);
+        memcpy(s->pages[page], tmp, size);
+    }
+}
+
+/* Journal records can not express going back, a replay would rebuild the
+ * state undone. Returns SPT_SUCCESS or the error code. */
+static int
+_spt_undo_journaled(spt_context *ctx)
+{
+    if (ctx->journal) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "Snapshots can not be restored "
+                "while a journal is open, close it first.");
+        return SPT_ERROR_STATE;
+    }
+    return SPT_SUCCESS;
+}
+
+/* Moves a restored state to the version after the one it was restored from,
+ * on a chain of its own. */
+static void
+_spt_undo_advance(spt_context *ctx, uint64_t version, uint64_t chain)
+{
+    ctx->version = version + 1;
+    ctx->chain = _spt_chain_step(chain, &ctx->version, sizeof(ctx->version));
+}
+
+/* The state no longer follows the mutations since the last version. */
+static void
+_spt_undo_restored(spt_context *ctx)
+{
+    _spt_path_cache_clear(ctx);
+    if (ctx->changelog) {
+        _spt_changelog_reset(ctx);
+    }
+    ctx->out_error = SPT_SUCCESS;
+}
+
+/* Position of the snapshot in the undo stack, checking that it and the
+ * newer ones can be restored. Returns SPT_SUCCESS or the error code. */
+static int
+_spt_undo_find(spt_context *ctx, uint32_t snapshot, uint32_t *pos)
+{
+    struct spt_undo *u = ctx->undo;
+    if (!u) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "Snapshots are not enabled.");
+        return SPT_ERROR_STATE;
+    }
+
+    uint32_t i = u->count;
+    while (i && _spt_undo_at(u, i - 1)->id != snapshot) {
+        --i;
+    }
+    if (!i || !snapshot) {
+        _SPT_ERR(ctx, SPT_ERROR_NOT_FOUND, "Snapshot %u is not in the undo "
+                "stack.", snapshot);
+        return SPT_ERROR_NOT_FOUND;
+    }
+    *pos = --i;
+
+    for (; i < u->count; ++i) {
+        if (_spt_undo_at(u, i)->lost) {
+            _SPT_ERR(ctx, SPT_ERROR_MEMORY, "Snapshot %u could not save every "
+                    "page written after it.", _spt_undo_at(u, i)->id);
+            return SPT_ERROR_MEMORY;
+        }
+    }
+    return SPT_SUCCESS;
+}
+
+void
+spt_undo_open(spt_context *ctx, uint32_t depth)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (ctx->undo) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "Snapshots are already enabled.");
+        return;
+    }
+
+#if !SPT_UNDO
+    ctx->out_error = SPT_NOOP;
+    return;
+#endif
+
+    depth = depth ? depth : SPT_UNDO_DEPTH;
+    struct spt_undo *u = malloc(sizeof(*u));
+    _spt_snapshot *snaps = calloc(depth, sizeof(*snaps));
+    int failed = !u || !snaps;
+    for (uint32_t i = 0; !failed && i < depth; ++i) {
+        snaps[i].saved = malloc(_SPT_UNDO_PAGES * sizeof(uint32_t));
+        snaps[i].pages = calloc(_SPT_UNDO_PAGES, sizeof(char *));
+        failed = !snaps[i].saved || !snaps[i].pages;
+    }
+    if (failed) {
+        for (uint32_t i = 0; snaps && i < depth; ++i) {
+            free(snaps[i].saved);
+            free(snaps[i].pages);
+        }
+        free(snaps);
+        free(u);
+        _SPT_ERR(ctx, SPT_ERROR_MEMORY, "Could not allocate %u snapshots.",
+                depth);
+        return;
+    }
+
+    *u = (struct spt_undo){.snaps = snaps, .depth = depth};
+    ctx->undo = u;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+void
+spt_undo_close(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    struct spt_undo *u = ctx->undo;
+    if (!u) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+
+    for (uint32_t i = 0; i < u->depth; ++i) {
+        _spt_snapshot_clear(u->snaps + i);
+        free(u->snaps[i].saved);
+        free(u->snaps[i].pages);
+    }
+    free(u->snaps);
+    free(u);
+    ctx->undo = NULL;
+    ctx->out_error = SPT_SUCCESS;
+}
+
+uint32_t
+_SPT_API(spt_snapshot)(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    struct spt_undo *u = ctx->undo;
+    if (!u) {
+        _SPT_ERR(ctx, SPT_ERROR_STATE, "%s", "Snapshots are not enabled.");
+        return 0;
+    }
+
+    _spt_redo_clear(u);
+    if (u->count == u->depth) {
+        _spt_snapshot_clear(_spt_undo_at(u, 0));
+        u->base = (u->base + 1) % u->depth;
+        --u->count;
+    }
+
+    _spt_snapshot *s = _spt_undo_at(u, u->count++);
+    s->id = ++u->next_id ? u->next_id : ++u->next_id;
+    ctx->out_error = SPT_SUCCESS;
+    return s->id;
+}
+
+void
+_SPT_API(spt_rollback)(spt_context *ctx, uint32_t snapshot)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    uint32_t pos;
+    if (_spt_undo_find(ctx, snapshot, &pos) != SPT_SUCCESS ||
+        _spt_undo_journaled(ctx) != SPT_SUCCESS) {
+        return;
+    }
+
+    /* The version is not restored, versions are never reused (a replica
+     * or delta would take the restored state for another one). */
+    struct spt_undo *u = ctx->undo;
+    const uint64_t version = ctx->version;
+    const uint64_t chain = ctx->chain;
+    _spt_write_begin(ctx);
+    while (u->count > pos) {
+        _spt_snapshot_swap(ctx, _spt_undo_at(u, --u->count));
+        ++u->redo;
+    }
+    _spt_undo_advance(ctx, version, chain);
+    _spt_write_end(ctx);
+    _spt_undo_restored(ctx);
+}
+
+void
+_SPT_API(spt_undo)(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    if (!ctx->undo || !ctx->undo->count) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+    _SPT_API(spt_rollback)(ctx, _spt_undo_at(ctx->undo,
+                                             ctx->undo->count - 1)->id);
+}
+
+void
+_SPT_API(spt_redo)(spt_context *ctx)
+{
+    _SPT_CHECK_CTX(ctx, _SPT_ARG_PH);
+    struct spt_undo *u = ctx->undo;
+    if (!u || !u->redo) {
+        ctx->out_error = SPT_NOOP;
+        return;
+    }
+    if (_spt_undo_journaled(ctx) != SPT_SUCCESS) {
+        return;
+    }
+
+    const uint64_t version = ctx->version;
+    const uint64_t chain = ctx->chain;
+    _spt_write_begin(ctx);
+    _spt_snapshot_swap(ctx, _spt_undo_at(u, u->count++));
+    --u->redo;
+    _spt_undo_advance(ctx, version, chain);
+    _spt_write_end(ctx);
+    _spt_undo_restored(ctx);
+}
+
+size_t
+_SPT_API(spt_snapshot_save)(spt_context *ctx, uint32_t snapshot, void *blob)
+{
+    _SPT_CHECK_CTX(ctx, 0);
+    uint32_t pos;
+    if (_spt_undo_find(ctx, snapshot, &pos) != SPT_SUCCESS) {
+        return 0;
+    }
+    if (!blob) {
+        _SPT_ERR(ctx, SPT_ERROR_FORMAT, "%s", "Image blob is NULL.");
+        return 0;
+    }
+
+    /* Every page written since the snapshot was saved by the oldest
+     * snapshot taken after the write, which is put back last. Pages past
+     * the current data size are saved ones as well. */
+    struct spt_undo *u = ctx->undo;
+    char *data = (char *)blob + sizeof(spt_image_header);
+    memcpy(data, ctx, offsetof(spt_context, names_arena) + ctx->arena_used);
+    for (uint32_t i = u->count; i-- > pos; ) {
+        const _spt_snapshot *s = _spt_undo_at(u, i);
+        for (uint32_t k = 0; k < s->count; ++k) {
+            const uint32_t page = s->saved[k];
+            memcpy(data + (size_t)page * SPT_UNDO_PAGE, s->pages[page],
+                   _spt_page_size(page));
+        }
+    }
+
+    spt_image_header h = _spt_header(data);
+    memcpy(blob, &h, sizeof(h));
+    ctx->out_error = SPT_SUCCESS;
+    return sizeof(h) + h.data_size;
+}
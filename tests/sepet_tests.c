@@ -0,0 +1,801 @@
+#include <sepet/sepet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every test is run by name (see: SEPET_TESTS in CMakeLists.txt), a failed check
+ * prints its location and ends the run with a non-zero status. */
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                    __FILE__, __LINE__, #cond);                             \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+/* Small inventory shared by the tests: two locations and three items, two
+ * of them stored. */
+static spt_context *
+fixture(void)
+{
+    spt_context *ctx = spt_create(NULL);
+    CHECK(ctx);
+    spt_add(ctx, SPT_FIELD_BUILDING, "Casa");
+    spt_add(ctx, SPT_FIELD_ROOM, "Cocina");
+    spt_add(ctx, SPT_FIELD_ROOM, "Salon");
+    spt_add(ctx, SPT_FIELD_CONTAINER, "Mesa");
+    spt_add(ctx, SPT_FIELD_SUBSECTION, "Cajon");
+    spt_add(ctx, SPT_FIELD_ITEM, "Cafetera");
+    spt_add(ctx, SPT_FIELD_ITEM, "Llaves");
+    spt_add(ctx, SPT_FIELD_ITEM, "Libro");
+    spt_insert_path(ctx, "Casa/Cocina/Mesa/Cajon", "Cafetera");
+    spt_insert_path(ctx, "Casa/Salon/Mesa/Cajon", "Llaves");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    return ctx;
+}
+
+/* Same location names of an entry in both contexts (IDs may differ). */
+static int
+same_location(spt_context *a, spt_entry ea, spt_context *b, spt_entry eb)
+{
+    const uint32_t ids_a[] = {ea.building, ea.room, ea.container, ea.subsection};
+    const uint32_t ids_b[] = {eb.building, eb.room, eb.container, eb.subsection};
+    const int fields[] = {SPT_FIELD_BUILDING, SPT_FIELD_ROOM,
+                          SPT_FIELD_CONTAINER, SPT_FIELD_SUBSECTION};
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(spt_get_name(a, fields[i], ids_a[i]),
+                   spt_get_name(b, fields[i], ids_b[i]))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Every item of a is in b, stored at the same location. */
+static int
+same_items(spt_context *a, spt_context *b)
+{
+    for (uint32_t id = spt_next(a, SPT_FIELD_ITEM, SPT_INVALID_ID);
+         id != SPT_INVALID_ID; id = spt_next(a, SPT_FIELD_ITEM, id)) {
+        uint32_t other = spt_get_id(b, SPT_FIELD_ITEM,
+                                    spt_get_name(a, SPT_FIELD_ITEM, id));
+        if (other == SPT_INVALID_ID) {
+            return 0;
+        }
+        spt_entry ea = spt_find(a, id), eb = spt_find(b, other);
+        if (!ea.item != !eb.item ||
+            (ea.item && !same_location(a, ea, b, eb))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+test_image_roundtrip(void)
+{
+    spt_context *ctx = fixture();
+    CHECK(spt_save(ctx, NULL) == 0);
+    CHECK(ctx->out_error == SPT_ERROR_FORMAT);
+
+    void *blob = malloc(SPT_IMAGE_SIZE);
+    CHECK(blob);
+    const size_t size = spt_save(ctx, blob);
+    CHECK(ctx->out_error == SPT_SUCCESS && size > 0 && size <= SPT_IMAGE_SIZE);
+
+    spt_context *copy = spt_create(NULL);
+    CHECK(copy);
+    spt_load(copy, blob);
+    CHECK(copy->out_error == SPT_SUCCESS);
+    CHECK(copy->version == ctx->version);
+    CHECK(same_items(ctx, copy) && same_items(copy, ctx));
+
+    /* A damaged image is rejected and leaves the context as it was. */
+    ((char *)blob)[size - 1] ^= 0x5a;
+    spt_context *other = spt_create(NULL);
+    CHECK(other);
+    spt_load(other, blob);
+    CHECK(other->out_error == SPT_ERROR_FORMAT);
+    CHECK(spt_get_id(other, SPT_FIELD_ITEM, "Cafetera") == SPT_INVALID_ID);
+
+    spt_save_file(ctx, "image_roundtrip.spt");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    int err;
+    spt_context *mapped = spt_open_mmap("image_roundtrip.spt", 0, &err);
+    CHECK(mapped && err == SPT_SUCCESS);
+    CHECK(same_items(ctx, mapped) && same_items(mapped, ctx));
+    spt_close_mmap(mapped);
+    remove("image_roundtrip.spt");
+
+    spt_destroy(other);
+    spt_destroy(copy);
+    spt_destroy(ctx);
+    free(blob);
+}
+
+static void
+test_csv_roundtrip(void)
+{
+    spt_context *ctx = fixture();
+    spt_add(ctx, SPT_FIELD_ITEM, "Caja \"grande\", roja");
+    spt_insert_path(ctx, "Casa/Salon/Mesa/Cajon", "Caja \"grande\", roja");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+
+    const size_t size = spt_export_csv(ctx, NULL, 0);
+    CHECK(ctx->out_error == SPT_SUCCESS && size > 0);
+    char *buf = malloc(size);
+    CHECK(buf);
+    CHECK(spt_export_csv(ctx, buf, size) == size);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+
+    /* Only stored items are exported. */
+    spt_context *copy = spt_create(NULL);
+    CHECK(copy);
+    spt_csv_result res;
+    CHECK(spt_import_csv(copy, buf, size, &res) == 3);
+    CHECK(copy->out_error == SPT_SUCCESS);
+    CHECK(res.rows == 3 && res.imported == 3 && res.rejected == 0);
+    CHECK(same_items(copy, ctx));
+    CHECK(spt_get_id(copy, SPT_FIELD_ITEM, "Libro") == SPT_INVALID_ID);
+
+    /* Bad rows are skipped, the others are imported. */
+    const char bad[] = "Casa,Cocina,Mesa,Cajon,Taza\nCasa,Cocina\n";
+    CHECK(spt_import_csv(copy, bad, sizeof(bad) - 1, &res) == 1);
+    CHECK(copy->out_error == SPT_ERROR_FORMAT);
+    CHECK(res.rejected == 1 && res.first_error_line == 2);
+
+    spt_destroy(copy);
+    spt_destroy(ctx);
+    free(buf);
+}
+
+static int errors_seen;
+
+static void
+count_error(void *usr_data, int errcode, const char *errmsg)
+{
+    ++*(int *)usr_data;
+}
+
+static void
+test_reset_created(void)
+{
+    const spt_config config = {.err_callback = count_error,
+                               .usr_data = &errors_seen};
+    spt_context *ctx = spt_create(&config);
+    CHECK(ctx);
+    const size_t alloc_size = ctx->alloc_size;
+    CHECK(alloc_size >= sizeof(spt_context));
+
+    remove("reset_created.jrn");
+    spt_journal_open(ctx, "reset_created.jrn", 1);
+    spt_changelog_open(ctx, 0);
+    spt_history_open(ctx, 0, NULL);
+    CHECK(ctx->journal && ctx->changelog && ctx->history);
+#if SPT_UNDO
+    spt_undo_open(ctx, 0);
+    CHECK(ctx->undo);
+    spt_snapshot(ctx);
+#endif
+    spt_add(ctx, SPT_FIELD_ITEM, "Cafetera");
+
+    /* Attachments are closed, the runtime part is kept. */
+    CHECK(spt_reset(ctx) == ctx && ctx->out_error == SPT_SUCCESS);
+    CHECK(!ctx->journal && !ctx->changelog && !ctx->undo && !ctx->history);
+    CHECK(ctx->alloc_size == alloc_size);
+    CHECK(ctx->err_callback == count_error && ctx->usr_data == &errors_seen);
+    CHECK(ctx->version == 0 && (ctx->seq & 1) == 0);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "Cafetera") == SPT_INVALID_ID);
+
+    const int before = errors_seen;
+    spt_add(ctx, SPT_FIELD_COUNT, "Llaves");
+    CHECK(ctx->out_error != SPT_SUCCESS && errors_seen == before + 1);
+
+    /* Still a working context. */
+    const uint32_t id = spt_add(ctx, SPT_FIELD_ITEM, "Llaves");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "Llaves") == id);
+    spt_destroy(ctx);
+    remove("reset_created.jrn");
+
+    /* Zeroed memory not owned by the library. Static, large builds do not
+     * fit on the stack. */
+    static spt_context zeroed;
+    CHECK(spt_reset(&zeroed) == &zeroed && zeroed.out_error == SPT_SUCCESS);
+    CHECK(zeroed.alloc_size == 0);
+    CHECK(spt_add(&zeroed, SPT_FIELD_ROOM, "Cocina") != SPT_INVALID_ID);
+    CHECK(spt_reset(&zeroed) == &zeroed);
+    CHECK(spt_get_id(&zeroed, SPT_FIELD_ROOM, "Cocina") == SPT_INVALID_ID);
+}
+
+static void
+test_config_capacities(void)
+{
+    spt_config config = SPT_CONFIG_INIT;
+    spt_context *ctx = spt_create(&config);
+    CHECK(ctx);
+    spt_destroy(ctx);
+
+    config.max_items = SPT_MAX_ITEMS * 2;
+    CHECK(!spt_create(&config));
+    config = (spt_config)SPT_CONFIG_INIT;
+    config.context_size = sizeof(spt_context) + 1;
+    CHECK(!spt_create(&config));
+
+    int err;
+    CHECK(!spt_shm_create("/sepet_tests_config", &config, &err));
+    CHECK(err == SPT_ERROR_FORMAT);
+}
+
+/* Copies the first size bytes of a file. */
+static void
+copy_prefix(const char *from, const char *to, long size)
+{
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    CHECK(in && out);
+    for (long i = 0; i < size; ++i) {
+        int c = fgetc(in);
+        CHECK(c != EOF);
+        fputc(c, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static long
+file_size(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    CHECK(f);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static void
+test_batch_atomicity(void)
+{
+    remove("batch.jrn");
+    spt_context *ctx = fixture();
+    spt_journal_open(ctx, "batch.jrn", 1);
+    spt_changelog_open(ctx, 0);
+    uint32_t rooms[4];
+    rooms[0] = spt_add(ctx, SPT_FIELD_ROOM, "Bano");
+    rooms[1] = spt_add(ctx, SPT_FIELD_ROOM, "Patio");
+    rooms[2] = rooms[1];
+    rooms[3] = spt_get_id(ctx, SPT_FIELD_ROOM, "Cocina");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+
+    spt_context *replica = spt_create(NULL);
+    CHECK(replica);
+    uint8_t *delta = malloc(SPT_IMAGE_SIZE);
+    CHECK(delta);
+    void *image = malloc(SPT_IMAGE_SIZE);
+    CHECK(image);
+    spt_save(ctx, image);
+    spt_load(replica, image);
+    CHECK(replica->out_error == SPT_SUCCESS);
+
+    /* One write section for the whole batch, one version per element. */
+    const uint64_t version = ctx->version;
+    const uint32_t seq = ctx->seq;
+    const long before = file_size("batch.jrn");
+    spt_delete_batch(ctx, SPT_FIELD_ROOM, rooms, 4, SPT_CASCADE_EXTRACT);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    CHECK(ctx->version == version + 3 && ctx->seq == seq + 2);
+    CHECK(!spt_find(ctx, spt_get_id(ctx, SPT_FIELD_ITEM, "Cafetera")).item);
+    const long after = file_size("batch.jrn");
+
+    /* Deltas apply the batch whole. */
+    const size_t size = spt_export_delta(ctx, version, delta, SPT_IMAGE_SIZE);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS && replica->version == ctx->version);
+    CHECK(spt_get_id(replica, SPT_FIELD_ROOM, "Patio") == SPT_INVALID_ID);
+    CHECK(same_items(ctx, replica) && same_items(replica, ctx));
+
+    /* A complete journal replays the batch. */
+    spt_journal_close(ctx);
+    spt_context *full = spt_create(NULL);
+    CHECK(full);
+    spt_load(full, image);
+    spt_journal_replay(full, "batch.jrn");
+    CHECK(full->out_error == SPT_SUCCESS && full->version == ctx->version);
+    CHECK(same_items(ctx, full) && same_items(full, ctx));
+
+    /* A batch cut short by a crash is not replayed at all, and reopening
+     * the journal drops it. */
+    copy_prefix("batch.jrn", "batch_cut.jrn", after - (after - before) / 3);
+    spt_context *cut = spt_create(NULL);
+    CHECK(cut);
+    spt_load(cut, image);
+    spt_journal_replay(cut, "batch_cut.jrn");
+    CHECK(cut->out_error == SPT_SUCCESS && cut->version == version);
+    CHECK(spt_get_id(cut, SPT_FIELD_ROOM, "Bano") == rooms[0]);
+    CHECK(spt_get_id(cut, SPT_FIELD_ROOM, "Patio") == rooms[1]);
+    CHECK(spt_find(cut, spt_get_id(cut, SPT_FIELD_ITEM, "Cafetera")).item);
+    spt_journal_open(cut, "batch_cut.jrn", 1);
+    CHECK(cut->out_error == SPT_SUCCESS);
+    CHECK(file_size("batch_cut.jrn") == before);
+
+    spt_destroy(cut);
+    spt_destroy(full);
+    spt_destroy(replica);
+    spt_destroy(ctx);
+    free(image);
+    free(delta);
+    remove("batch.jrn");
+    remove("batch_cut.jrn");
+}
+
+static void
+test_replay_after_undo(void)
+{
+#if SPT_UNDO
+    remove("undo.jrn");
+    spt_context *ctx = spt_create(NULL);
+    CHECK(ctx);
+    spt_undo_open(ctx, 0);
+    spt_changelog_open(ctx, 0);
+    spt_journal_open(ctx, "undo.jrn", 1);
+    spt_snapshot(ctx);
+    spt_add(ctx, SPT_FIELD_ITEM, "A");
+
+    /* The journal could not replay the undo. */
+    spt_undo(ctx);
+    CHECK(ctx->out_error == SPT_ERROR_STATE);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "A") != SPT_INVALID_ID);
+    spt_add(ctx, SPT_FIELD_ITEM, "B");
+    spt_journal_close(ctx);
+
+    spt_context *replayed = spt_create(NULL);
+    CHECK(replayed);
+    spt_journal_replay(replayed, "undo.jrn");
+    CHECK(replayed->out_error == SPT_SUCCESS);
+    CHECK(replayed->version == ctx->version);
+    CHECK(spt_get_id(replayed, SPT_FIELD_ITEM, "A") != SPT_INVALID_ID);
+    CHECK(spt_get_id(replayed, SPT_FIELD_ITEM, "B") != SPT_INVALID_ID);
+
+    /* A replica following the writer through deltas. */
+    uint8_t *delta = malloc(SPT_IMAGE_SIZE);
+    CHECK(delta);
+    size_t size = spt_export_delta(ctx, 0, delta, SPT_IMAGE_SIZE);
+    spt_context *replica = spt_create(NULL);
+    CHECK(replica);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS);
+
+    /* Without a journal, undo and redo move to new versions: the replica's
+     * version never names another state. */
+    const uint64_t version = ctx->version;
+    spt_undo(ctx);
+    CHECK(ctx->out_error == SPT_SUCCESS && ctx->version == version + 1);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "A") == SPT_INVALID_ID);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "B") == SPT_INVALID_ID);
+    spt_snapshot(ctx);
+    spt_add(ctx, SPT_FIELD_ITEM, "C");
+    CHECK(ctx->version == version + 2);
+    spt_export_delta(ctx, replica->version, delta, SPT_IMAGE_SIZE);
+    CHECK(ctx->out_error == SPT_ERROR_STATE);
+
+    spt_undo(ctx);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "C") == SPT_INVALID_ID);
+    spt_redo(ctx);
+    CHECK(ctx->out_error == SPT_SUCCESS && ctx->version == version + 4);
+    CHECK(spt_get_id(ctx, SPT_FIELD_ITEM, "C") != SPT_INVALID_ID);
+
+    /* The image of the new state replays the deltas that follow it. */
+    void *image = malloc(SPT_IMAGE_SIZE);
+    CHECK(image);
+    spt_save(ctx, image);
+    spt_load(replica, image);
+    spt_add(ctx, SPT_FIELD_ITEM, "D");
+    size = spt_export_delta(ctx, replica->version, delta, SPT_IMAGE_SIZE);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS && replica->version == ctx->version);
+    CHECK(spt_get_id(replica, SPT_FIELD_ITEM, "D") != SPT_INVALID_ID);
+    CHECK(spt_get_id(replica, SPT_FIELD_ITEM, "A") == SPT_INVALID_ID);
+
+    spt_destroy(replica);
+    spt_destroy(replayed);
+    spt_destroy(ctx);
+    free(image);
+    free(delta);
+    remove("undo.jrn");
+#endif
+}
+
+static void
+test_delta_lineage(void)
+{
+    spt_context *ctx = fixture();
+    spt_changelog_open(ctx, 0);
+    void *image = malloc(SPT_IMAGE_SIZE);
+    uint8_t *delta = malloc(SPT_IMAGE_SIZE);
+    CHECK(image && delta);
+    spt_save(ctx, image);
+
+    spt_context *replica = spt_create(NULL);
+    spt_context *local = spt_create(NULL);
+    CHECK(replica && local);
+    spt_load(replica, image);
+    spt_load(local, image);
+
+    /* Both reach the next version, local through its own mutation. */
+    const uint64_t version = ctx->version;
+    spt_add(ctx, SPT_FIELD_ITEM, "Taza");
+    spt_add(local, SPT_FIELD_ITEM, "Plato");
+    CHECK(local->version == ctx->version && local->chain != ctx->chain);
+    spt_add(ctx, SPT_FIELD_ITEM, "Vaso");
+
+    size_t size = spt_export_delta(ctx, version, delta, SPT_IMAGE_SIZE);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_apply_delta(local, delta, size);
+    CHECK(local->out_error == SPT_ERROR_STATE);
+    CHECK(spt_get_id(local, SPT_FIELD_ITEM, "Vaso") == SPT_INVALID_ID);
+
+    size = spt_export_delta(ctx, local->version, delta, SPT_IMAGE_SIZE);
+    spt_apply_delta(local, delta, size);
+    CHECK(local->out_error == SPT_ERROR_STATE);
+
+    /* The replica follows, twice is harmless. */
+    size = spt_export_delta(ctx, version, delta, SPT_IMAGE_SIZE);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS);
+    CHECK(replica->version == ctx->version && replica->chain == ctx->chain);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_NOOP);
+    CHECK(same_items(ctx, replica) && same_items(replica, ctx));
+
+    /* A full image brings the diverged context back on the writer's line. */
+    spt_save(ctx, image);
+    spt_load(local, image);
+    spt_add(ctx, SPT_FIELD_ITEM, "Jarra");
+    size = spt_export_delta(ctx, local->version, delta, SPT_IMAGE_SIZE);
+    spt_apply_delta(local, delta, size);
+    CHECK(local->out_error == SPT_SUCCESS && local->chain == ctx->chain);
+
+    /* The chain survives the oldest records being dropped from the smallest
+     * log. */
+    spt_changelog_close(ctx);
+    spt_changelog_open(ctx, 1);
+    char name[16];
+    for (int i = 0; i < 40; ++i) {
+        snprintf(name, sizeof(name), "Cosa%02d", i);
+        spt_add(ctx, SPT_FIELD_ITEM, name);
+        if (i == 36) {
+            spt_save(ctx, image);
+        }
+    }
+    spt_load(replica, image);
+    size = spt_export_delta(ctx, replica->version, delta, SPT_IMAGE_SIZE);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS && replica->chain == ctx->chain);
+    spt_export_delta(ctx, replica->version - 39, delta, SPT_IMAGE_SIZE);
+    CHECK(ctx->out_error == SPT_ERROR_STATE);
+
+    spt_destroy(local);
+    spt_destroy(replica);
+    spt_destroy(ctx);
+    free(delta);
+    free(image);
+}
+
+static void
+test_stats_coverage(void)
+{
+    spt_context *ctx = fixture();
+    spt_stats stats;
+    spt_stats_get(ctx, &stats);
+#if SPT_STATS
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_stats_reset(ctx);
+    spt_undo_open(ctx, 0);
+    spt_history_open(ctx, 0, NULL);
+
+    char buf[4096];
+    spt_move moves[4];
+    uint64_t counts[SPT_MAX_FIELDS];
+    spt_insert_path(ctx, "Casa/Salon/Mesa/Cajon", "Libro");
+    const size_t size = spt_export_csv(ctx, buf, sizeof(buf));
+    spt_import_csv(ctx, buf, size, NULL);
+    spt_item_history(ctx, spt_get_id(ctx, SPT_FIELD_ITEM, "Libro"), moves, 4);
+    spt_history_query(ctx, NULL, NULL, 0, moves, 4);
+    spt_get_entry(ctx, 0);
+    spt_count(ctx, SPT_FIELD_ROOM, 2);
+    spt_counts(ctx, SPT_FIELD_ROOM, counts);
+#if SPT_UNDO
+    const uint32_t snap = spt_snapshot(ctx);
+    spt_add(ctx, SPT_FIELD_ITEM, "Taza");
+    void *image = malloc(SPT_IMAGE_SIZE);
+    CHECK(image);
+    spt_snapshot_save(ctx, snap, image);
+    spt_undo(ctx);
+    spt_redo(ctx);
+    spt_rollback(ctx, snap);
+    free(image);
+#endif
+
+    spt_stats_get(ctx, &stats);
+    const int ops[] = {
+        SPT_STAT_INSERT_PATH, SPT_STAT_IMPORT_CSV, SPT_STAT_EXPORT_CSV,
+        SPT_STAT_ITEM_HISTORY, SPT_STAT_HISTORY_QUERY, SPT_STAT_GET_ENTRY,
+#if SPT_UNDO
+        SPT_STAT_SNAPSHOT, SPT_STAT_SNAPSHOT_SAVE, SPT_STAT_UNDO,
+        SPT_STAT_REDO, SPT_STAT_ROLLBACK,
+#endif
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        CHECK(stats.ops[ops[i]].calls == 1);
+    }
+    CHECK(stats.ops[SPT_STAT_COUNTS].calls == 2);
+#else
+    CHECK(ctx->out_error == SPT_NOOP);
+#endif
+    spt_destroy(ctx);
+}
+
+static void
+test_journal_quantity(void)
+{
+    remove("quantity.jrn");
+    spt_context *ctx = spt_create(NULL);
+    CHECK(ctx);
+    spt_journal_open(ctx, "quantity.jrn", 1);
+    spt_changelog_open(ctx, 0);
+    spt_add(ctx, SPT_FIELD_BUILDING, "Casa");
+    spt_add(ctx, SPT_FIELD_ROOM, "Garaje");
+    spt_entry e = spt_insert_path(ctx, "Casa/Garaje", "Tornillos");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+
+    /* Quantities above INT_MAX survive the journal and deltas. */
+    spt_set_quantity(ctx, e.item, 0xFFFFFFF0u);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_journal_close(ctx);
+
+    spt_context *replayed = spt_create(NULL);
+    CHECK(replayed);
+    spt_journal_replay(replayed, "quantity.jrn");
+    CHECK(replayed->out_error == SPT_SUCCESS);
+    CHECK(replayed->version == ctx->version);
+    CHECK(spt_count(replayed, SPT_FIELD_ITEM, e.item) == 0xFFFFFFF0u);
+    CHECK(spt_count(replayed, SPT_FIELD_ROOM, e.room) == 0xFFFFFFF0u);
+
+    uint8_t *delta = malloc(SPT_IMAGE_SIZE);
+    CHECK(delta);
+    const size_t size = spt_export_delta(ctx, 0, delta, SPT_IMAGE_SIZE);
+    spt_context *replica = spt_create(NULL);
+    CHECK(replica);
+    spt_apply_delta(replica, delta, size);
+    CHECK(replica->out_error == SPT_SUCCESS);
+    CHECK(spt_count(replica, SPT_FIELD_ITEM, e.item) == 0xFFFFFFF0u);
+
+    spt_destroy(replica);
+    spt_destroy(replayed);
+    spt_destroy(ctx);
+    free(delta);
+    remove("quantity.jrn");
+}
+
+/* Matches of pred found by walking every entry slot, in slot order. */
+static size_t
+scan_reference(spt_context *ctx, int building, int room, uint32_t item_min,
+               uint32_t item_max, spt_entry *out)
+{
+    size_t n = 0;
+    for (uint32_t slot = 0; slot < SPT_MAX_ITEMS; ++slot) {
+        spt_entry e = spt_get_entry(ctx, slot);
+        if (e.item && (building == SPT_ANY || e.building == building) &&
+            (room == SPT_ANY || e.room == room) &&
+            e.item >= item_min && e.item <= item_max) {
+            out[n++] = e;
+        }
+    }
+    return n;
+}
+
+static void
+test_scan_kernels(void)
+{
+    /* The kernel is picked at runtime (AVX2, SSE2 or scalar), every one has
+     * to agree with the slot walk. Odd stored counts and early stops leave
+     * partial vectors for the scalar tail. */
+    static const size_t sizes[] = {1, 3, 7, 9, 37};
+    static const struct { int building, room; uint32_t min, max; } preds[] = {
+        {SPT_ANY, SPT_ANY, 0, UINT32_MAX},
+        {2, SPT_ANY, 0, UINT32_MAX},
+        {SPT_ANY, 3, 0, UINT32_MAX},
+        {2, 3, 0, UINT32_MAX},
+        {SPT_ANY, SPT_ANY, 5, 21},
+        {3, SPT_ANY, 9, 30},
+        {SPT_ANY, SPT_ANY, 40, UINT32_MAX},
+    };
+    spt_entry *got = malloc(sizeof(spt_entry) * SPT_MAX_ITEMS);
+    spt_entry *want = malloc(sizeof(spt_entry) * SPT_MAX_ITEMS);
+    CHECK(got && want);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        spt_context *ctx = spt_create(NULL);
+        CHECK(ctx);
+        spt_add(ctx, SPT_FIELD_BUILDING, "Norte");
+        spt_add(ctx, SPT_FIELD_BUILDING, "Sur");
+        spt_add(ctx, SPT_FIELD_ROOM, "Taller");
+        spt_add(ctx, SPT_FIELD_ROOM, "Almacen");
+        for (size_t i = 0; i < sizes[s]; ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "Pieza %zu", i);
+            uint32_t item = spt_add(ctx, SPT_FIELD_ITEM, name);
+            spt_insert(ctx, item, (spt_loc_id)(2 + i % 2), (spt_loc_id)(2 + i % 3 / 2),
+                       SPT_DEFAULT_ID, SPT_DEFAULT_ID);
+            CHECK(ctx->out_error == SPT_SUCCESS);
+        }
+        /* Holes between the stored slots. */
+        for (uint32_t item = 2 + 4; item < 2 + sizes[s]; item += 5) {
+            spt_extract(ctx, spt_find(ctx, item));
+            CHECK(ctx->out_error == SPT_SUCCESS);
+        }
+
+        for (size_t p = 0; p < sizeof(preds) / sizeof(preds[0]); ++p) {
+            const spt_predicate pred = spt_predicate_compile(
+                preds[p].building, preds[p].room, SPT_ANY, SPT_ANY,
+                preds[p].min, preds[p].max);
+            const size_t n = scan_reference(ctx, preds[p].building, preds[p].room,
+                                            preds[p].min, preds[p].max, want);
+            CHECK(spt_scan(ctx, &pred, NULL, 0) == n);
+            CHECK(ctx->out_error == SPT_SUCCESS);
+            for (size_t max = 1; max <= n + 1; ++max) {
+                const size_t m = spt_scan(ctx, &pred, got, max);
+                CHECK(m == (max < n ? max : n));
+                CHECK(!memcmp(got, want, m * sizeof(spt_entry)));
+            }
+            for (size_t i = 0; i < n; ++i) {
+                spt_entry e = spt_find(ctx, want[i].item);
+                CHECK(!memcmp(&e, &want[i], sizeof(spt_entry)));
+            }
+        }
+        spt_destroy(ctx);
+    }
+    free(got);
+    free(want);
+}
+
+static void
+test_history_file(void)
+{
+    remove("moves.sph");
+    spt_context *ctx = spt_create(NULL);
+    CHECK(ctx);
+    /* Raised to hold a whole call's movements, none is lost. */
+    spt_history_open(ctx, 4, "moves.sph");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_add(ctx, SPT_FIELD_BUILDING, "Casa");
+    spt_add(ctx, SPT_FIELD_ROOM, "Taller");
+    for (int i = 0; i < 100; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "Herramienta %d", i);
+        spt_insert_path(ctx, "Casa/Taller", name);
+        CHECK(ctx->out_error == SPT_SUCCESS);
+    }
+    spt_delete_ex(ctx, SPT_FIELD_ROOM, spt_get_id(ctx, SPT_FIELD_ROOM, "Taller"),
+                  SPT_CASCADE_REHOME);
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_history_close(ctx);
+
+    spt_context *reader = spt_create(NULL);
+    CHECK(reader);
+    spt_history_open(reader, 0, "moves.sph");
+    CHECK(reader->out_error == SPT_SUCCESS);
+    spt_move moves[256];
+    CHECK(spt_history_query(reader, NULL, NULL, 0, moves, 256) == 200);
+    /* Every rehomed item once, not ring slots overwritten mid-call. */
+    uint8_t seen[SPT_MAX_ITEMS] = {0};
+    for (int i = 0; i < 100; ++i) {
+        CHECK(moves[i].to.room == SPT_DEFAULT_ID && moves[i].from.room != SPT_DEFAULT_ID);
+        CHECK(!seen[moves[i].to.item]++);
+    }
+
+    spt_destroy(reader);
+    spt_destroy(ctx);
+    remove("moves.sph");
+}
+
+static void
+test_history_replay(void)
+{
+    remove("replay.jrn");
+    remove("replay.sph");
+    spt_context *ctx = spt_create(NULL);
+    CHECK(ctx);
+    spt_journal_open(ctx, "replay.jrn", 1);
+    spt_history_open(ctx, 0, "replay.sph");
+    spt_add(ctx, SPT_FIELD_BUILDING, "Casa");
+    spt_add(ctx, SPT_FIELD_ROOM, "Cocina");
+    spt_add(ctx, SPT_FIELD_ROOM, "Salon");
+    spt_insert_path(ctx, "Casa/Cocina", "Cafetera");
+    spt_insert_path(ctx, "Casa/Cocina", "Llaves");
+    spt_insert_path(ctx, "Casa/Salon", "Llaves");
+    CHECK(ctx->out_error == SPT_SUCCESS);
+    spt_move moves[8];
+    CHECK(spt_history_query(ctx, NULL, NULL, 0, moves, 8) == 3);
+    spt_journal_close(ctx);
+    spt_history_close(ctx);
+
+    /* Restart: the history continues from its file, the replay does not
+     * record the journaled movements a second time. */
+    spt_context *restarted = spt_create(NULL);
+    CHECK(restarted);
+    spt_history_open(restarted, 0, "replay.sph");
+    spt_journal_replay(restarted, "replay.jrn");
+    CHECK(restarted->out_error == SPT_SUCCESS);
+    CHECK(restarted->version == ctx->version && same_items(ctx, restarted));
+    spt_move replayed[8];
+    CHECK(spt_history_query(restarted, NULL, NULL, 0, replayed, 8) == 3);
+    CHECK(!memcmp(moves, replayed, sizeof(spt_move) * 3));
+    spt_history_close(restarted);
+
+    spt_history_open(restarted, 0, "replay.sph");
+    CHECK(spt_history_query(restarted, NULL, NULL, 0, replayed, 8) == 3);
+
+    spt_destroy(restarted);
+    spt_destroy(ctx);
+    remove("replay.jrn");
+    remove("replay.sph");
+}
+
+static void
+test_reader_timeout(void)
+{
+    spt_context *ctx = fixture();
+    const uint32_t item = spt_get_id(ctx, SPT_FIELD_ITEM, "Cafetera");
+    int err;
+
+    /* A writer that died mid-mutation leaves the sequence odd: readers
+     * give up instead of waiting forever. */
+    ++ctx->seq;
+    spt_entry e = spt_find_r(ctx, item, &err);
+    CHECK(err == SPT_ERROR_TIMEOUT && !e.item);
+    ++ctx->seq;
+    e = spt_find_r(ctx, item, &err);
+    CHECK(err == SPT_SUCCESS && e.item == item);
+
+    spt_destroy(ctx);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    {"image_roundtrip", test_image_roundtrip},
+    {"csv_roundtrip", test_csv_roundtrip},
+    {"reset_created", test_reset_created},
+    {"config_capacities", test_config_capacities},
+    {"batch_atomicity", test_batch_atomicity},
+    {"replay_after_undo", test_replay_after_undo},
+    {"delta_lineage", test_delta_lineage},
+    {"stats_coverage", test_stats_coverage},
+    {"journal_quantity", test_journal_quantity},
+    {"scan_kernels", test_scan_kernels},
+    {"history_file", test_history_file},
+    {"history_replay", test_history_replay},
+    {"reader_timeout", test_reader_timeout},
+};
+
+int
+main(int argc, char **argv)
+{
+    int found = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        if (argc < 2 || !strcmp(argv[1], tests[i].name)) {
+            tests[i].run();
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown test %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}